@@ -37,6 +37,8 @@ uint8_t cfg_is_ndef_enable(void) { return current_config.ndef_en; }
 
 uint8_t cfg_is_webusb_landing_enable(void) { return current_config.webusb_landing_en; }
 
+uint8_t cfg_is_session_retention_enable(void) { return current_config.session_retention_en; }
+
 void admin_poweroff(void) { pin.is_validated = 0; }
 
 int admin_install(uint8_t reset) {
@@ -109,6 +111,9 @@ static int admin_config(const CAPDU *capdu, RAPDU *rapdu) {
   case ADMIN_P1_CFG_WEBUSB_LANDING:
     current_config.webusb_landing_en = P2 & 1;
     break;
+  case ADMIN_P1_CFG_SESSION_RETENTION:
+    current_config.session_retention_en = P2 & 1;
+    break;
   default:
     EXCEPT(SW_WRONG_P1P2);
   }
@@ -130,6 +135,8 @@ static int admin_read_config(const CAPDU *capdu, RAPDU *rapdu) {
   RDATA[3] = current_config.ndef_en;
   RDATA[4] = current_config.webusb_landing_en;
   LL = 5;
+  // appended later, so that the clients asking for exactly 5 bytes still work
+  if (LE >= 6) RDATA[LL++] = current_config.session_retention_en;
 
   return 0;
 }
@@ -15,7 +15,13 @@
 #define PIN_CTR_ATTR 0x03
 #define KH_KEY_ATTR 0x04
 #define HE_KEY_ATTR 0x05
-#define RK_FILE "ctap_rk"
+#define RK_FILE "ctap_rk" // fixed-size records of old versions, migrated by rk_install
+#define CTAP_COUNTER_FILE "ctap_ctr" // the per-RP signature counters, see CTAP_PER_RP_COUNTER
+
+// signature counter values reserved by one flash write
+#ifndef CTAP_SIGN_COUNTER_RESERVE
+#define CTAP_SIGN_COUNTER_RESERVE 16
+#endif
 
 #define CTAP_INS_MSG 0x10
 
@@ -125,7 +131,7 @@
 #define USER_NAME_LIMIT 65    // Must be minimum of 64 bytes but can be more.
 #define DISPLAY_NAME_LIMIT 65 // Must be minimum of 64 bytes but can be more.
 #define ICON_LIMIT 129        // Must be minimum of 64 bytes but can be more.
-#define MAX_RK_NUM 64
+#define MAX_RK_NUM 64 // the maximum number of credentials of an RP returned by GetAssertion
 
 typedef struct {
   uint8_t id[USER_ID_MAX_SIZE];
@@ -3,6 +3,7 @@
 #include "ctap-errors.h"
 #include "ctap-internal.h"
 #include "ctap-parser.h"
+#include "rk.h"
 #include "secret.h"
 #include "u2f.h"
 #include <aes.h>
@@ -51,40 +52,88 @@ static const uint8_t aaguid[] = {0x24, 0x4e, 0xb2, 0x9e, 0xe0, 0x90, 0x4e, 0x49,
                                  0x81, 0xfe, 0x1f, 0x20, 0xf8, 0xd3, 0xb8, 0xf4};
 // pin related
 static uint8_t key_agreement_keypair[PRI_KEY_SIZE + PUB_KEY_SIZE];
+static uint8_t has_key_agreement; // the key pair is generated on first use
+
+#ifndef CTAP_SHARED_SECRET_CACHE_NUM
+#define CTAP_SHARED_SECRET_CACHE_NUM 2
+#endif
+
+// shared secrets with the recent platform keys, valid as long as key_agreement_keypair
+static struct {
+  uint8_t pub_key_hash[SHA256_DIGEST_LENGTH];
+  uint8_t secret[SHARED_SECRET_SIZE];
+  uint8_t in_use;
+  uint32_t last_used;
+} shared_secret_cache[CTAP_SHARED_SECRET_CACHE_NUM];
+static uint32_t shared_secret_clock;
 static uint8_t pin_token[PIN_TOKEN_SIZE];
 static uint8_t consecutive_pin_counter;
 // assertion related
-static uint8_t credential_list[MAX_RK_NUM], credential_numbers, credential_idx, last_cmd;
+static uint16_t credential_list[MAX_RK_NUM];
+static uint8_t credential_numbers, credential_idx, last_cmd;
+
+#ifndef CTAP_RK_SESSION_NUM
+#define CTAP_RK_SESSION_NUM 4
+#endif
+
+// the credentials following the first one of a GetAssertion, read ahead so that GetNextAssertion only signs;
+// entry i is for credential_idx i + 1
+static struct {
+  CTAP_residentKey rk;
+  uint8_t pri_key[PRI_KEY_SIZE];
+} rk_session[CTAP_RK_SESSION_NUM];
+static uint8_t rk_session_num;
+
+static void clear_rk_session(void) {
+  memzero(rk_session, sizeof(rk_session));
+  rk_session_num = 0;
+}
 
 uint8_t ctap_install(uint8_t reset) {
+  clear_key_cache();
+  clear_cert_cache();
+  clear_rk_session();
+  memzero(shared_secret_cache, sizeof(shared_secret_cache));
   consecutive_pin_counter = 3;
   credential_numbers = 0;
   credential_idx = 0;
   last_cmd = 0xff;
   random_buffer(pin_token, sizeof(pin_token));
-  if (ecc_generate(ECC_SECP256R1, key_agreement_keypair, key_agreement_keypair + PRI_KEY_SIZE) < 0)
-    return CTAP2_ERR_UNHANDLED_REQUEST;
-  if (!reset && get_file_size(CTAP_CERT_FILE) >= 0) return 0;
-  uint8_t kh_key[KH_KEY_SIZE] = {0};
-  if (write_file(RK_FILE, NULL, 0, 0, 1) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+  memzero(key_agreement_keypair, sizeof(key_agreement_keypair));
+  has_key_agreement = 0;
+  if (!reset && get_file_size(CTAP_CERT_FILE) >= 0) {
+    if (rk_install(0) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+    if (install_counter() < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+    return 0;
+  }
+  // the pooled credentials are bound to the old KH key
+  clear_keypair_pool();
+  uint8_t kh_key[KH_KEY_SIZE], he_key[HE_KEY_SIZE];
+  if (rk_install(1) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
   if (write_file(CTAP_CERT_FILE, NULL, 0, 0, 0) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-  if (write_attr(CTAP_CERT_FILE, SIGN_CTR_ATTR, kh_key, 4) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-  if (write_attr(CTAP_CERT_FILE, PIN_ATTR, NULL, 0) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-  random_buffer(kh_key, sizeof(kh_key));
-  if (write_attr(CTAP_CERT_FILE, KH_KEY_ATTR, kh_key, sizeof(kh_key)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
   random_buffer(kh_key, sizeof(kh_key));
-  if (write_attr(CTAP_CERT_FILE, HE_KEY_ATTR, kh_key, sizeof(kh_key)) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+  random_buffer(he_key, sizeof(he_key));
+  struct lfs_attr attrs[] = {
+      {PIN_ATTR, NULL, 0}, {KH_KEY_ATTR, kh_key, sizeof(kh_key)}, {HE_KEY_ATTR, he_key, sizeof(he_key)}};
+  int err = write_attrs(CTAP_CERT_FILE, attrs, sizeof(attrs) / sizeof(attrs[0]));
   memzero(kh_key, sizeof(kh_key));
+  memzero(he_key, sizeof(he_key));
+  if (err < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+  if (reset_counter() < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
   return 0;
 }
 
+void ctap_precompute(void) { precompute_keypairs(); }
+
 int ctap_install_private_key(const CAPDU *capdu, RAPDU *rapdu) {
   if (LC != PRI_KEY_SIZE) EXCEPT(SW_WRONG_LENGTH);
+  clear_key_cache();
   return write_attr(CTAP_CERT_FILE, KEY_ATTR, DATA, LC);
 }
 
 int ctap_install_cert(const CAPDU *capdu, RAPDU *rapdu) {
   if (LC > MAX_CERT_SIZE) EXCEPT(SW_WRONG_LENGTH);
+  clear_cert_cache();
   return write_file(CTAP_CERT_FILE, DATA, 0, LC, 1);
 }
 
@@ -151,10 +200,39 @@ static void build_ed25519_cose_key(uint8_t *data) {
   data[7] = 0x21; data[8] = 0x58; data[9] = 0x20;
 }
 
+// Most sessions never use ClientPIN or hmac-secret, so the key pair is not generated by ctap_install.
+// It is usually taken from the pool filled in idle time, which makes the first use cheap as well.
+static int load_key_agreement(void) {
+  if (has_key_agreement) return 0;
+  if (generate_key_agreement_keypair(key_agreement_keypair) < 0) return -1;
+  has_key_agreement = 1;
+  return 0;
+}
+
+// Platforms keep their keyAgreement key for a session, e.g. over a burst of hmac-secret assertions,
+// so the ECDH is done once per platform key.
 static uint8_t get_shared_secret(uint8_t *pub_key) {
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  int victim = 0;
+  if (load_key_agreement() < 0) return 1;
+  sha256_raw(pub_key, PUB_KEY_SIZE, hash);
+  for (int i = 0; i < CTAP_SHARED_SECRET_CACHE_NUM; ++i) {
+    if (shared_secret_cache[i].in_use && memcmp(shared_secret_cache[i].pub_key_hash, hash, sizeof(hash)) == 0) {
+      shared_secret_cache[i].last_used = ++shared_secret_clock;
+      memcpy(pub_key, shared_secret_cache[i].secret, SHARED_SECRET_SIZE);
+      return 0;
+    }
+    if (!shared_secret_cache[victim].in_use) continue;
+    if (!shared_secret_cache[i].in_use || shared_secret_cache[i].last_used < shared_secret_cache[victim].last_used)
+      victim = i;
+  }
   int ret = ecdh_decrypt(ECC_SECP256R1, key_agreement_keypair, pub_key, pub_key);
   if (ret < 0) return 1;
   sha256_raw(pub_key, PRI_KEY_SIZE, pub_key);
+  memcpy(shared_secret_cache[victim].pub_key_hash, hash, sizeof(hash));
+  memcpy(shared_secret_cache[victim].secret, pub_key, SHARED_SECRET_SIZE);
+  shared_secret_cache[victim].in_use = 1;
+  shared_secret_cache[victim].last_used = ++shared_secret_clock;
   return 0;
 }
 
@@ -183,7 +261,7 @@ uint8_t ctap_make_auth_data(uint8_t *rpIdHash, uint8_t *buf, uint8_t flags, uint
   ad->flags = flags;
 
   uint32_t ctr;
-  int ret = increase_counter(&ctr);
+  int ret = increase_counter(rpIdHash, &ctr);
   if (ret < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
   ad->signCount = htobe32(ctr);
 
@@ -213,6 +291,37 @@ uint8_t ctap_make_auth_data(uint8_t *rpIdHash, uint8_t *buf, uint8_t flags, uint
   return 0;
 }
 
+// {1: "packed", 2: authData, 3: {"alg": COSE_ALG_ES256, "sig": bytes, "x5c": [cert]}}
+// the constant parts of the response of MakeCredential, around the byte strings
+static const uint8_t packed_fmt_template[] = {
+    0xA3,                                     // map(3)
+    0x01, 0x66, 'p', 'a', 'c', 'k', 'e', 'd', // 1: "packed"
+    0x02,                                     // 2: authData follows
+};
+static const uint8_t packed_att_stmt_template[] = {
+    0x03, 0xA3,                // 3: map(3)
+    0x63, 'a', 'l', 'g', 0x26, // "alg": -7
+    0x63, 's', 'i', 'g',       // "sig": signature follows
+};
+static const uint8_t packed_x5c_template[] = {
+    0x63, 'x', '5', 'c', 0x81, // "x5c": array(1), cert follows
+};
+
+// Write the head of a byte string of len bytes, in the shortest form as tinycbor does.
+static uint8_t *encode_bytes_header(uint8_t *ptr, uint16_t len) {
+  if (len < 24) {
+    *ptr++ = 0x40 | len;
+  } else if (len < 256) {
+    *ptr++ = 0x58;
+    *ptr++ = len;
+  } else {
+    *ptr++ = 0x59;
+    *ptr++ = HI(len);
+    *ptr++ = LO(len);
+  }
+  return ptr;
+}
+
 static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_t len) {
   // https://fidoalliance.org/specs/fido-v2.0-ps-20190130/fido-client-to-authenticator-protocol-v2.0-ps-20190130.html#authenticatorMakeCredential
   CborParser parser;
@@ -261,47 +370,23 @@ static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_
 
   WAIT();
 
-  // build response
-  CborEncoder map;
-  ret = cbor_encoder_create_map(encoder, &map, 3);
-  CHECK_CBOR_RET(ret);
-
-  // fmt
-  ret = cbor_encode_int(&map, RESP_fmt);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_text_stringz(&map, "packed");
-  CHECK_CBOR_RET(ret);
-
   // auth data
   len = sizeof(data_buf);
   uint8_t flags = FLAGS_AT | (mc.extension_hmac_secret ? FLAGS_ED : 0) | (has_pin() > 0 ? FLAGS_UV : 0) | FLAGS_UP;
   ret = ctap_make_auth_data(mc.rpIdHash, data_buf, flags, sizeof(hmacExt), hmacExt, &len, mc.alg_type);
   if (ret != 0) return ret;
-  ret = cbor_encode_int(&map, RESP_authData);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_byte_string(&map, data_buf, len);
-  CHECK_CBOR_RET(ret);
 
   // process rk
   if (mc.rk) {
     CTAP_residentKey rk;
-    int size = get_file_size(RK_FILE);
-    if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-    size_t nRk = size / sizeof(CTAP_residentKey), i;
-    for (i = 0; i != nRk; ++i) {
-      size = read_file(RK_FILE, &rk, i * sizeof(CTAP_residentKey), sizeof(CTAP_residentKey));
-      if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      if (memcmp(mc.rpIdHash, rk.credential_id.rpIdHash, SHA256_DIGEST_LENGTH) == 0 &&
-          mc.user.id_size == rk.user.id_size && memcmp(mc.user.id, rk.user.id, mc.user.id_size) == 0)
-        break;
-    }
-    if (i >= MAX_RK_NUM) return CTAP2_ERR_KEY_STORE_FULL;
     memcpy(&rk.credential_id, data_buf + 55, sizeof(rk.credential_id));
     memcpy(&rk.user, &mc.user, sizeof(UserEntity));
-    ret = write_file(RK_FILE, &rk, i * sizeof(CTAP_residentKey), sizeof(CTAP_residentKey), 0);
+    ret = rk_save(&rk);
+    if (ret == RK_STORE_FULL) return CTAP2_ERR_KEY_STORE_FULL;
     if (ret < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
   }
 
+  // build response
   // attestation statement
   // https://www.w3.org/TR/webauthn/#packed-attestation
   // {
@@ -309,56 +394,31 @@ static uint8_t ctap_make_credential(CborEncoder *encoder, uint8_t *params, size_
   //   sig: bytes (ASN.1),
   //   x5c: [ attestnCert: bytes, * (caCert: bytes) ]
   // }
-  ret = cbor_encode_int(&map, RESP_attStmt);
-  CHECK_CBOR_RET(ret);
-  CborEncoder att_map;
-  ret = cbor_encoder_create_map(&map, &att_map, 3);
-  CHECK_CBOR_RET(ret);
-  {
-    // alg (ECC secp256r1)
-    ret = cbor_encode_text_stringz(&att_map, "alg");
-    CHECK_CBOR_RET(ret);
-    ret = cbor_encode_int(&att_map, COSE_ALG_ES256);
-    CHECK_CBOR_RET(ret);
-
-    // sig (asn.1)
-    ret = cbor_encode_text_stringz(&att_map, "sig");
-    CHECK_CBOR_RET(ret);
-    sha256_init();
-    sha256_update(data_buf, len);
-    sha256_update(mc.clientDataHash, sizeof(mc.clientDataHash));
-    sha256_final(data_buf);
-    len = sign_with_device_key(data_buf, data_buf);
-    ret = cbor_encode_byte_string(&att_map, data_buf, len);
-    CHECK_CBOR_RET(ret);
-
-    // cert (is an array)
-    ret = cbor_encode_text_stringz(&att_map, "x5c");
-    CHECK_CBOR_RET(ret);
-    CborEncoder x5carr;
-    ret = cbor_encoder_create_array(&att_map, &x5carr, 1);
-    CHECK_CBOR_RET(ret);
-    {
-      // to save RAM, generate an empty cert first, then fill it manually
-      ret = cbor_encode_byte_string(&x5carr, NULL, 0);
-      CHECK_CBOR_RET(ret);
-      uint8_t *ptr = x5carr.data.ptr - 1;
-      ret = get_cert(ptr + 3);
-      if (ret < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      *ptr++ = 0x59;
-      *ptr++ = HI(ret);
-      *ptr++ = LO(ret);
-      x5carr.data.ptr = ptr + ret;
-    }
-    ret = cbor_encoder_close_container(&att_map, &x5carr);
-    CHECK_CBOR_RET(ret);
-    // att done
-  }
-  ret = cbor_encoder_close_container(&map, &att_map);
-  CHECK_CBOR_RET(ret);
-
-  ret = cbor_encoder_close_container(encoder, &map);
-  CHECK_CBOR_RET(ret);
+  const uint8_t *cert;
+  int cert_len = get_cert(&cert);
+  if (cert_len < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+  uint8_t *ptr = encoder->data.ptr;
+  if ((size_t)(encoder->end - ptr) < sizeof(packed_fmt_template) + 3 + len + sizeof(packed_att_stmt_template) + 2 +
+                                         U2F_MAX_EC_SIG_SIZE + sizeof(packed_x5c_template) + 3 + cert_len)
+    return CTAP2_ERR_LIMIT_EXCEEDED;
+  memcpy(ptr, packed_fmt_template, sizeof(packed_fmt_template));
+  ptr = encode_bytes_header(ptr + sizeof(packed_fmt_template), len);
+  memcpy(ptr, data_buf, len);
+  ptr += len;
+  memcpy(ptr, packed_att_stmt_template, sizeof(packed_att_stmt_template));
+  ptr += sizeof(packed_att_stmt_template);
+  sha256_init();
+  sha256_update(data_buf, len);
+  sha256_update(mc.clientDataHash, sizeof(mc.clientDataHash));
+  sha256_final(data_buf);
+  len = sign_with_device_key(data_buf, data_buf);
+  ptr = encode_bytes_header(ptr, len);
+  memcpy(ptr, data_buf, len);
+  ptr += len;
+  memcpy(ptr, packed_x5c_template, sizeof(packed_x5c_template));
+  ptr = encode_bytes_header(ptr + sizeof(packed_x5c_template), cert_len);
+  memcpy(ptr, cert, cert_len);
+  encoder->data.ptr = ptr + cert_len;
 
   return 0;
 }
@@ -409,32 +469,37 @@ static uint8_t ctap_get_assertion(CborEncoder *encoder, uint8_t *params, size_t
       return CTAP2_ERR_NO_CREDENTIALS;
     }
   } else {
-    int size = 0;
     if (credential_idx == 0) {
-      size = get_file_size(RK_FILE);
-      if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-      int nRk = (int)(size / sizeof(CTAP_residentKey));
-      credential_numbers = 0;
       // GA step 9: If more than one credential was located in step 1 and allowList is present and not empty, select any
       // applicable credential and proceed to step 12. Otherwise, order the credentials by the time when they were
       // created in reverse order. The first credential is the most recent credential that was created.
-      for (int i = nRk - 1; i >= 0; --i) {
-        size = read_file(RK_FILE, &rk, i * sizeof(CTAP_residentKey), sizeof(CTAP_residentKey));
-        if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-        if (memcmp(ga.rpIdHash, rk.credential_id.rpIdHash, SHA256_DIGEST_LENGTH) == 0)
-          credential_list[credential_numbers++] = i;
-      }
+      int n = rk_list(ga.rpIdHash, credential_list, MAX_RK_NUM);
+      if (n < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+      credential_numbers = n;
       if (credential_numbers == 0) {
         if (ga.up) WAIT();
         return CTAP2_ERR_NO_CREDENTIALS;
       }
+      // a credential that cannot be read ahead ends the list there instead of failing the first assertion
+      for (int i = 1; i < credential_numbers && rk_session_num < CTAP_RK_SESSION_NUM; ++i, ++rk_session_num) {
+        if (rk_read(credential_list[i], &rk_session[rk_session_num].rk) < 0 ||
+            verify_key_handle(&rk_session[rk_session_num].rk.credential_id, rk_session[rk_session_num].pri_key) != 0) {
+          memzero(&rk_session[rk_session_num], sizeof(rk_session[0]));
+          credential_numbers = i;
+          break;
+        }
+      }
+    }
+    if (credential_idx > 0 && credential_idx <= rk_session_num) {
+      memcpy(&rk, &rk_session[credential_idx - 1].rk, sizeof(rk));
+      memcpy(pri_key, rk_session[credential_idx - 1].pri_key, PRI_KEY_SIZE);
+      memzero(&rk_session[credential_idx - 1], sizeof(rk_session[0]));
+    } else {
+      // fetch rk and get private key
+      if (rk_read(credential_list[credential_idx], &rk) < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
+      int err = verify_key_handle(&rk.credential_id, pri_key);
+      if (err != 0) return CTAP2_ERR_UNHANDLED_REQUEST;
     }
-    // fetch rk and get private key
-    size =
-        read_file(RK_FILE, &rk, credential_list[credential_idx] * sizeof(CTAP_residentKey), sizeof(CTAP_residentKey));
-    if (size < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
-    int err = verify_key_handle(&rk.credential_id, pri_key);
-    if (err != 0) return CTAP2_ERR_UNHANDLED_REQUEST;
   }
 
   uint8_t extensionBuffer[79], extensionSize = 0;
@@ -590,83 +655,36 @@ static uint8_t ctap_get_next_assertion(CborEncoder *encoder) {
   return ctap_get_assertion(encoder, NULL, 0);
 }
 
+// {1: ["FIDO_2_0", "U2F_V2"], 2: ["hmac-secret"], 3: aaguid, 4: {"rk": true, "clientPin": has_pin},
+//  5: MAX_CTAP_BUFSIZE, 6: [1]}
+// the same map that tinycbor used to build on every call, see test_get_info in test/test_ctap.c
+static const uint8_t get_info_template[] = {
+    0xA6,                                                                         // map(6)
+    0x01, 0x82,                                                                   // 1: array(2)
+    0x68, 'F', 'I', 'D', 'O', '_', '2', '_', '0',                                 // "FIDO_2_0"
+    0x66, 'U', '2', 'F', '_', 'V', '2',                                           // "U2F_V2"
+    0x02, 0x81,                                                                   // 2: array(1)
+    0x6B, 'h', 'm', 'a', 'c', '-', 's', 'e', 'c', 'r', 'e', 't',                  // "hmac-secret"
+    0x03, 0x50,                                                                   // 3: bytes(16)
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                               // aaguid, filled in
+    0x04, 0xA2,                                                                   // 4: map(2)
+    0x62, 'r', 'k', 0xF5,                                                         // "rk": true
+    0x69, 'c', 'l', 'i', 'e', 'n', 't', 'P', 'i', 'n', 0xF4,                      // "clientPin": false
+    0x05, 0x19, HI(MAX_CTAP_BUFSIZE), LO(MAX_CTAP_BUFSIZE),                       // 5: uint16
+    0x06, 0x81, 0x01,                                                             // 6: [1]
+};
+#define GET_INFO_AAGUID_OFFSET 35
+#define GET_INFO_CLIENT_PIN_OFFSET 67
+
 static uint8_t ctap_get_info(CborEncoder *encoder) {
   // https://fidoalliance.org/specs/fido-v2.0-ps-20190130/fido-client-to-authenticator-protocol-v2.0-ps-20190130.html#authenticatorGetInfo
   // Currently, we respond versions, aaguid, pin protocol.
-  CborEncoder map;
-  int ret = cbor_encoder_create_map(encoder, &map, 6);
-  CHECK_CBOR_RET(ret);
-
-  // versions
-  ret = cbor_encode_int(&map, RESP_versions);
-  CHECK_CBOR_RET(ret);
-  CborEncoder array;
-  ret = cbor_encoder_create_array(&map, &array, 2);
-  CHECK_CBOR_RET(ret);
-  {
-    ret = cbor_encode_text_stringz(&array, "FIDO_2_0");
-    CHECK_CBOR_RET(ret);
-    ret = cbor_encode_text_stringz(&array, "U2F_V2");
-    CHECK_CBOR_RET(ret);
-  }
-  ret = cbor_encoder_close_container(&map, &array);
-  CHECK_CBOR_RET(ret);
-
-  // extensions
-  ret = cbor_encode_int(&map, RESP_extensions);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encoder_create_array(&map, &array, 1);
-  CHECK_CBOR_RET(ret);
-  {
-    ret = cbor_encode_text_stringz(&array, "hmac-secret");
-    CHECK_CBOR_RET(ret);
-  }
-  ret = cbor_encoder_close_container(&map, &array);
-  CHECK_CBOR_RET(ret);
-
-  // aaguid
-  ret = cbor_encode_int(&map, RESP_aaguid);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_byte_string(&map, aaguid, sizeof(aaguid));
-  CHECK_CBOR_RET(ret);
-
-  // options
-  ret = cbor_encode_int(&map, RESP_options);
-  CHECK_CBOR_RET(ret);
-  CborEncoder option_map;
-  ret = cbor_encoder_create_map(&map, &option_map, 2);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_text_stringz(&option_map, "rk");
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_boolean(&option_map, true);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_text_stringz(&option_map, "clientPin");
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_boolean(&option_map, has_pin() > 0);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encoder_close_container(&map, &option_map);
-  CHECK_CBOR_RET(ret);
-
-  // max message length
-  ret = cbor_encode_int(&map, RESP_maxMsgSize);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encode_int(&map, MAX_CTAP_BUFSIZE);
-  CHECK_CBOR_RET(ret);
-
-  // pin protocol
-  ret = cbor_encode_int(&map, RESP_pinProtocols);
-  CHECK_CBOR_RET(ret);
-  ret = cbor_encoder_create_array(&map, &array, 1);
-  CHECK_CBOR_RET(ret);
-  {
-    ret = cbor_encode_int(&array, 1);
-    CHECK_CBOR_RET(ret);
-  }
-  ret = cbor_encoder_close_container(&map, &array);
-  CHECK_CBOR_RET(ret);
-
-  ret = cbor_encoder_close_container(encoder, &map);
-  CHECK_CBOR_RET(ret);
+  uint8_t *ptr = encoder->data.ptr;
+  if (encoder->end - ptr < (ptrdiff_t)sizeof(get_info_template)) return CTAP2_ERR_LIMIT_EXCEEDED;
+  memcpy(ptr, get_info_template, sizeof(get_info_template));
+  memcpy(ptr + GET_INFO_AAGUID_OFFSET, aaguid, sizeof(aaguid));
+  if (has_pin() > 0) ptr[GET_INFO_CLIENT_PIN_OFFSET] = 0xF5; // true
+  encoder->data.ptr = ptr + sizeof(get_info_template);
   return 0;
 }
 
@@ -695,6 +713,7 @@ static uint8_t ctap_client_pin(CborEncoder *encoder, const uint8_t *params, size
     break;
 
   case CP_cmdGetKeyAgreement:
+    if (load_key_agreement() < 0) return CTAP2_ERR_UNHANDLED_REQUEST;
     ret = cbor_encoder_create_map(encoder, &map, 1);
     CHECK_CBOR_RET(ret);
     ret = cbor_encode_int(&map, RESP_keyAgreement);
@@ -840,6 +859,8 @@ int ctap_process_cbor(uint8_t *req, size_t req_len, uint8_t *resp, size_t *resp_
   cbor_encoder_init(&encoder, resp + 1, *resp_len - 1, 0);
 
   uint8_t cmd = *req++;
+  // the read-ahead credentials only live as long as the GetNextAssertion sequence
+  if (cmd != CTAP_GET_NEXT_ASSERTION && rk_session_num > 0) clear_rk_session();
   switch (cmd) {
   case CTAP_MAKE_CREDENTIAL:
     DBG_MSG("-----------------MC-------------------\n");
@@ -0,0 +1,378 @@
+// SPDX-License-Identifier: Apache-2.0
+#include "rk.h"
+#include <fs.h>
+#include <memzero.h>
+#include <stddef.h>
+#include <string.h>
+
+// Resident keys are stored as variable-length records in RK_DATA_FILE. Empty strings take no space.
+//
+// RK_INDEX_FILE holds one rk_index_t per credential, sorted by a prefix of rpIdHash. Entries of the same prefix are
+// kept in creation order, so the credentials of an RP are found by a binary search and a short walk.
+//
+// RK_FREE_FILE lists the free extents of RK_DATA_FILE. A record is written first, then the index that refers to it,
+// and the free extents are only updated after that. rk_install checks them against the index and rebuilds them if
+// a power loss came in between, so no space is leaked and no extent in use is listed as free.
+#define RK_DATA_FILE "ctap_rkd"
+#define RK_INDEX_FILE "ctap_rki"
+#define RK_FREE_FILE "ctap_rkf"
+#define RK_RP_PREFIX_SIZE 4
+#define RK_ALLOC_UNIT 16
+
+#ifndef RK_SCAN_WINDOW
+#define RK_SCAN_WINDOW 1024 // allocation units covered by one pass over the index when checking the free extents
+#endif
+
+typedef struct {
+  uint8_t rp_prefix[RK_RP_PREFIX_SIZE];
+  uint32_t user_hash;
+  uint32_t offset;
+  uint32_t size;
+} __packed rk_index_t;
+
+typedef struct {
+  uint32_t offset;
+  uint32_t size; // 0 for an unused entry
+} __packed rk_extent_t;
+
+typedef struct {
+  CredentialId credential_id;
+  uint8_t id_size;
+  uint8_t name_len;
+  uint8_t display_name_len;
+  uint8_t icon_len;
+} __packed rk_record_header_t;
+
+#define RK_MAX_RECORD_SIZE                                                                                             \
+  (sizeof(rk_record_header_t) + USER_ID_MAX_SIZE + USER_NAME_LIMIT + DISPLAY_NAME_LIMIT + ICON_LIMIT)
+
+static uint32_t hash_user_id(const uint8_t *id, uint8_t id_size) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (uint8_t i = 0; i < id_size; ++i) {
+    hash ^= id[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint8_t bounded_strlen(const uint8_t *s, uint8_t limit) {
+  uint8_t len = 0;
+  while (len < limit - 1 && s[len]) ++len;
+  return len;
+}
+
+static size_t encode_record(const CTAP_residentKey *rk, uint8_t *buf) {
+  rk_record_header_t *header = (rk_record_header_t *)buf;
+  size_t off = sizeof(rk_record_header_t);
+
+  memcpy(&header->credential_id, &rk->credential_id, sizeof(CredentialId));
+  header->id_size = MIN(rk->user.id_size, USER_ID_MAX_SIZE);
+  header->name_len = bounded_strlen(rk->user.name, USER_NAME_LIMIT);
+  header->display_name_len = bounded_strlen(rk->user.displayName, DISPLAY_NAME_LIMIT);
+  header->icon_len = bounded_strlen(rk->user.icon, ICON_LIMIT);
+  memcpy(buf + off, rk->user.id, header->id_size);
+  off += header->id_size;
+  memcpy(buf + off, rk->user.name, header->name_len);
+  off += header->name_len;
+  memcpy(buf + off, rk->user.displayName, header->display_name_len);
+  off += header->display_name_len;
+  memcpy(buf + off, rk->user.icon, header->icon_len);
+  off += header->icon_len;
+  return off;
+}
+
+static int decode_record(const uint8_t *buf, size_t len, CTAP_residentKey *rk) {
+  const rk_record_header_t *header = (const rk_record_header_t *)buf;
+  size_t off = sizeof(rk_record_header_t);
+
+  if (len < off || header->id_size > USER_ID_MAX_SIZE || header->name_len >= USER_NAME_LIMIT ||
+      header->display_name_len >= DISPLAY_NAME_LIMIT || header->icon_len >= ICON_LIMIT ||
+      len < off + header->id_size + header->name_len + header->display_name_len + header->icon_len)
+    return RK_IO_FAIL;
+  memzero(rk, sizeof(CTAP_residentKey));
+  memcpy(&rk->credential_id, &header->credential_id, sizeof(CredentialId));
+  rk->user.id_size = header->id_size;
+  memcpy(rk->user.id, buf + off, header->id_size);
+  off += header->id_size;
+  memcpy(rk->user.name, buf + off, header->name_len);
+  off += header->name_len;
+  memcpy(rk->user.displayName, buf + off, header->display_name_len);
+  off += header->display_name_len;
+  memcpy(rk->user.icon, buf + off, header->icon_len);
+  return 0;
+}
+
+static int index_size(void) {
+  int size = get_file_size(RK_INDEX_FILE);
+  if (size < 0) return RK_IO_FAIL;
+  return size / (int)sizeof(rk_index_t);
+}
+
+static int read_index(int pos, rk_index_t *entry) {
+  if (read_file(RK_INDEX_FILE, entry, pos * sizeof(rk_index_t), sizeof(rk_index_t)) != sizeof(rk_index_t))
+    return RK_IO_FAIL;
+  return 0;
+}
+
+// Find the first entry whose prefix is not less than that of rp_id_hash.
+static int index_lower_bound(const uint8_t *rp_id_hash, int n) {
+  rk_index_t entry;
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (read_index(mid, &entry) < 0) return RK_IO_FAIL;
+    if (memcmp(entry.rp_prefix, rp_id_hash, RK_RP_PREFIX_SIZE) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int record_matches_rp(const rk_index_t *entry, const uint8_t *rp_id_hash) {
+  uint8_t stored_hash[SHA256_DIGEST_LENGTH];
+  if (read_file(RK_DATA_FILE, stored_hash,
+                entry->offset + offsetof(rk_record_header_t, credential_id) + offsetof(CredentialId, rpIdHash),
+                sizeof(stored_hash)) != sizeof(stored_hash))
+    return RK_IO_FAIL;
+  return memcmp(stored_hash, rp_id_hash, SHA256_DIGEST_LENGTH) == 0;
+}
+
+// Find room for a record, without taking it yet. *slot is the free extent to shrink by commit_extent, or -1 when the
+// data file grows.
+static int find_extent(uint32_t size, uint32_t *offset, int *slot) {
+  rk_extent_t extent;
+  int n = get_file_size(RK_FREE_FILE);
+  if (n < 0) return RK_IO_FAIL;
+  n /= sizeof(rk_extent_t);
+  // first fit, or grow the data file
+  for (int i = 0; i < n; ++i) {
+    if (read_file(RK_FREE_FILE, &extent, i * sizeof(rk_extent_t), sizeof(extent)) != sizeof(extent)) return RK_IO_FAIL;
+    if (extent.size < size) continue;
+    *offset = extent.offset;
+    *slot = i;
+    return 0;
+  }
+  int end = get_file_size(RK_DATA_FILE);
+  if (end < 0) return RK_IO_FAIL;
+  // the last record may be shorter than its extent
+  *offset = (end + RK_ALLOC_UNIT - 1) / RK_ALLOC_UNIT * RK_ALLOC_UNIT;
+  *slot = -1;
+  return 0;
+}
+
+// Take the room found by find_extent, once the index refers to it.
+static int commit_extent(int slot, uint32_t size) {
+  rk_extent_t extent;
+  if (slot < 0) return 0;
+  if (read_file(RK_FREE_FILE, &extent, slot * sizeof(rk_extent_t), sizeof(extent)) != sizeof(extent))
+    return RK_IO_FAIL;
+  extent.offset += size;
+  extent.size -= size;
+  return write_file(RK_FREE_FILE, &extent, slot * sizeof(rk_extent_t), sizeof(extent), 0) < 0 ? RK_IO_FAIL : 0;
+}
+
+static int free_extent(uint32_t offset, uint32_t size) {
+  rk_extent_t extent;
+  int n = get_file_size(RK_FREE_FILE), unused = -1;
+  if (n < 0) return RK_IO_FAIL;
+  n /= sizeof(rk_extent_t);
+  for (int i = 0; i < n; ++i) {
+    if (read_file(RK_FREE_FILE, &extent, i * sizeof(rk_extent_t), sizeof(extent)) != sizeof(extent)) return RK_IO_FAIL;
+    if (extent.size == 0) {
+      if (unused < 0) unused = i;
+      continue;
+    }
+    // merge with a neighbour
+    if (extent.offset + extent.size == offset || offset + size == extent.offset) {
+      if (offset < extent.offset) extent.offset = offset;
+      extent.size += size;
+      return write_file(RK_FREE_FILE, &extent, i * sizeof(rk_extent_t), sizeof(extent), 0) < 0 ? RK_IO_FAIL : 0;
+    }
+  }
+  extent.offset = offset;
+  extent.size = size;
+  if (unused < 0) unused = n;
+  return write_file(RK_FREE_FILE, &extent, unused * sizeof(rk_extent_t), sizeof(extent), 0) < 0 ? RK_IO_FAIL : 0;
+}
+
+// Set the bits of the units of [offset, offset + size) that fall into the window of units starting at base.
+static void mark_units(uint8_t *bits, uint32_t base, uint32_t offset, uint32_t size) {
+  uint32_t first = MAX(offset / RK_ALLOC_UNIT, base);
+  uint32_t last = MIN((offset + size) / RK_ALLOC_UNIT, base + RK_SCAN_WINDOW);
+  for (uint32_t u = first; u < last; ++u)
+    bits[(u - base) / 8] |= 1 << ((u - base) % 8);
+}
+
+// Mark the units used by the index, and those listed as free, in the window starting at base.
+static int scan_window(uint32_t base, int n, uint8_t *used, uint8_t *listed) {
+  rk_index_t entry;
+  rk_extent_t extent;
+  memset(used, 0, RK_SCAN_WINDOW / 8);
+  memset(listed, 0, RK_SCAN_WINDOW / 8);
+  for (int i = 0; i < n; ++i) {
+    if (read_index(i, &entry) < 0) return RK_IO_FAIL;
+    mark_units(used, base, entry.offset, entry.size);
+  }
+  int m = get_file_size(RK_FREE_FILE);
+  if (m < 0) return RK_IO_FAIL;
+  for (int i = 0; i < m / (int)sizeof(rk_extent_t); ++i) {
+    if (read_file(RK_FREE_FILE, &extent, i * sizeof(rk_extent_t), sizeof(extent)) != sizeof(extent)) return RK_IO_FAIL;
+    mark_units(listed, base, extent.offset, extent.size);
+  }
+  return 0;
+}
+
+// Check that every unit of the data file is either used by the index or listed as free, and rebuild the free extents
+// from the index otherwise.
+static int check_free_extents(void) {
+  uint8_t used[RK_SCAN_WINDOW / 8], listed[RK_SCAN_WINDOW / 8];
+  int n = index_size(), end = get_file_size(RK_DATA_FILE), consistent = 1;
+  if (n < 0 || end < 0) return RK_IO_FAIL;
+  uint32_t units = (end + RK_ALLOC_UNIT - 1) / RK_ALLOC_UNIT;
+
+  for (uint32_t base = 0; base < units && consistent; base += RK_SCAN_WINDOW) {
+    if (scan_window(base, n, used, listed) < 0) return RK_IO_FAIL;
+    for (uint32_t u = base; u < MIN(units, base + RK_SCAN_WINDOW); ++u) {
+      uint8_t bit = 1 << ((u - base) % 8);
+      if (!(used[(u - base) / 8] & bit) == !(listed[(u - base) / 8] & bit)) {
+        consistent = 0;
+        break;
+      }
+    }
+  }
+  if (consistent) return 0;
+
+  // list the runs of unused units, with a single commit
+  lfs_file_t f;
+  rk_extent_t extent = {0, 0};
+  int err = create_file(&f, RK_FREE_FILE);
+  if (err < 0) return RK_IO_FAIL;
+  for (uint32_t base = 0; base < units && err >= 0; base += RK_SCAN_WINDOW) {
+    if ((err = scan_window(base, n, used, listed)) < 0) break;
+    for (uint32_t u = base; u < MIN(units, base + RK_SCAN_WINDOW) && err >= 0; ++u) {
+      if (!(used[(u - base) / 8] & (1 << ((u - base) % 8)))) {
+        if (extent.size == 0) extent.offset = u * RK_ALLOC_UNIT;
+        extent.size += RK_ALLOC_UNIT;
+      } else if (extent.size > 0) {
+        err = append_file(&f, &extent, sizeof(extent));
+        extent.size = 0;
+      }
+    }
+  }
+  if (err >= 0 && extent.size > 0) err = append_file(&f, &extent, sizeof(extent));
+  if (close_file(&f) < 0 || err < 0) return RK_IO_FAIL;
+  return 0;
+}
+
+static int migrate_legacy_file(void) {
+  CTAP_residentKey rk;
+  int size = get_file_size(RK_FILE);
+  if (size == LFS_ERR_NOENT) return 0;
+  if (size < 0) return RK_IO_FAIL;
+  // saving a credential replaces the one of the same rp and user, so this can be redone if interrupted
+  for (int i = 0; i < size / (int)sizeof(CTAP_residentKey); ++i) {
+    if (read_file(RK_FILE, &rk, i * sizeof(CTAP_residentKey), sizeof(CTAP_residentKey)) != sizeof(CTAP_residentKey))
+      return RK_IO_FAIL;
+    if (rk_save(&rk) < 0) return RK_IO_FAIL;
+  }
+  memzero(&rk, sizeof(rk));
+  return remove_file(RK_FILE) < 0 ? RK_IO_FAIL : 0;
+}
+
+int rk_install(uint8_t reset) {
+  if (reset || get_file_size(RK_INDEX_FILE) < 0) {
+    if (write_file(RK_DATA_FILE, NULL, 0, 0, 1) < 0) return RK_IO_FAIL;
+    if (write_file(RK_FREE_FILE, NULL, 0, 0, 1) < 0) return RK_IO_FAIL;
+    // the index is created last, it marks the store as initialized
+    if (write_file(RK_INDEX_FILE, NULL, 0, 0, 1) < 0) return RK_IO_FAIL;
+  }
+  if (reset) {
+    int err = remove_file(RK_FILE);
+    return err < 0 && err != LFS_ERR_NOENT ? RK_IO_FAIL : 0;
+  }
+  if (check_free_extents() < 0) return RK_IO_FAIL;
+  return migrate_legacy_file();
+}
+
+int rk_save(const CTAP_residentKey *rk) {
+  uint8_t record[RK_MAX_RECORD_SIZE];
+  rk_index_t entry, old;
+  CTAP_residentKey stored;
+  int n = index_size();
+  if (n < 0) return RK_IO_FAIL;
+
+  memcpy(entry.rp_prefix, rk->credential_id.rpIdHash, RK_RP_PREFIX_SIZE);
+  entry.user_hash = hash_user_id(rk->user.id, rk->user.id_size);
+
+  // a credential of the same rp and user is replaced, otherwise the new one goes to the end of its rp
+  int pos = index_lower_bound(rk->credential_id.rpIdHash, n), found = -1;
+  if (pos < 0) return RK_IO_FAIL;
+  for (; pos < n; ++pos) {
+    if (read_index(pos, &old) < 0) return RK_IO_FAIL;
+    if (memcmp(old.rp_prefix, entry.rp_prefix, RK_RP_PREFIX_SIZE) != 0) break;
+    if (old.user_hash != entry.user_hash) continue;
+    if (rk_read(pos, &stored) < 0) return RK_IO_FAIL;
+    int match = memcmp(stored.credential_id.rpIdHash, rk->credential_id.rpIdHash, SHA256_DIGEST_LENGTH) == 0 &&
+                stored.user.id_size == rk->user.id_size &&
+                memcmp(stored.user.id, rk->user.id, rk->user.id_size) == 0;
+    memzero(&stored, sizeof(stored));
+    if (match) {
+      found = pos;
+      break;
+    }
+  }
+
+  size_t len = encode_record(rk, record);
+  entry.size = (len + RK_ALLOC_UNIT - 1) / RK_ALLOC_UNIT * RK_ALLOC_UNIT;
+  uint32_t offset;
+  int slot;
+  if (find_extent(entry.size, &offset, &slot) < 0) return RK_IO_FAIL;
+  entry.offset = offset;
+  int err = write_file(RK_DATA_FILE, record, entry.offset, len, 0);
+  memzero(record, sizeof(record));
+  if (err < 0) return err == LFS_ERR_NOSPC ? RK_STORE_FULL : RK_IO_FAIL;
+
+  if (found >= 0)
+    err = write_file(RK_INDEX_FILE, &entry, found * sizeof(rk_index_t), sizeof(rk_index_t), 0);
+  else
+    err = insert_file(RK_INDEX_FILE, &entry, pos * sizeof(rk_index_t), sizeof(rk_index_t));
+  if (err < 0) return err == LFS_ERR_NOSPC ? RK_STORE_FULL : RK_IO_FAIL;
+  if (commit_extent(slot, entry.size) < 0) return RK_IO_FAIL;
+  if (found >= 0) return free_extent(old.offset, old.size);
+  return 0;
+}
+
+int rk_list(const uint8_t *rp_id_hash, uint16_t *list, uint8_t max_num) {
+  rk_index_t entry;
+  int n = index_size();
+  if (n < 0) return RK_IO_FAIL;
+  int lo = index_lower_bound(rp_id_hash, n), hi;
+  if (lo < 0) return RK_IO_FAIL;
+  for (hi = lo; hi < n; ++hi) {
+    if (read_index(hi, &entry) < 0) return RK_IO_FAIL;
+    if (memcmp(entry.rp_prefix, rp_id_hash, RK_RP_PREFIX_SIZE) != 0) break;
+  }
+
+  // the most recently created credential comes first
+  uint8_t num = 0;
+  for (int pos = hi - 1; pos >= lo && num < max_num; --pos) {
+    if (read_index(pos, &entry) < 0) return RK_IO_FAIL;
+    int ret = record_matches_rp(&entry, rp_id_hash);
+    if (ret < 0) return RK_IO_FAIL;
+    if (ret) list[num++] = pos;
+  }
+  return num;
+}
+
+int rk_read(uint16_t id, CTAP_residentKey *rk) {
+  uint8_t record[RK_MAX_RECORD_SIZE];
+  rk_index_t entry;
+  if (read_index(id, &entry) < 0) return RK_IO_FAIL;
+  int len = read_file(RK_DATA_FILE, record, entry.offset, MIN(entry.size, sizeof(record)));
+  if (len < 0) return RK_IO_FAIL;
+  int err = decode_record(record, len, rk);
+  memzero(record, sizeof(record));
+  return err;
+}
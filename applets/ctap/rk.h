@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef CANOKEY_CORE_FIDO2_RK_H_
+#define CANOKEY_CORE_FIDO2_RK_H_
+
+#include "ctap-internal.h"
+
+#define RK_IO_FAIL -1
+#define RK_STORE_FULL -2
+
+int rk_install(uint8_t reset);
+int rk_save(const CTAP_residentKey *rk);
+int rk_list(const uint8_t *rp_id_hash, uint16_t *list, uint8_t max_num);
+int rk_read(uint16_t id, CTAP_residentKey *rk);
+
+#endif // CANOKEY_CORE_FIDO2_RK_H_
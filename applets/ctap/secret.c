@@ -1,64 +1,191 @@
 // SPDX-License-Identifier: Apache-2.0
 #include "secret.h"
 #include <apdu.h>
+#include <counter.h>
 #include <ecc.h>
 #include <ed25519.h>
 #include <fs.h>
+#include <hmac-ctx.h>
 #include <hmac.h>
 #include <memzero.h>
 #include <rand.h>
 #include "cose-key.h"
 
-static int read_pri_key(uint8_t *pri_key) {
-  int ret = read_attr(CTAP_CERT_FILE, KEY_ATTR, pri_key, PRI_KEY_SIZE);
-  if (ret < 0) return ret;
+// the master keys are loaded from flash once and kept until power-off or reset
+static struct {
+  uint8_t pri_key[PRI_KEY_SIZE];
+  hmac_sha256_ctx_t kh_ctx; // the KH key is only used as an hmac key
+  uint8_t he_key[HE_KEY_SIZE];
+  uint8_t loaded;
+} key_cache;
+
+#ifndef CTAP_KEYPAIR_POOL_NUM
+#define CTAP_KEYPAIR_POOL_NUM 4
+#endif
+
+// key pairs computed ahead of requests while the device is idle, kept in RAM only
+static struct {
+  struct {
+    uint8_t nonce[CREDENTIAL_NONCE_SIZE];
+    uint8_t pubkey[PUB_KEY_SIZE]; // of the P-256 private key derived from the nonce
+  } credential[CTAP_KEYPAIR_POOL_NUM];
+  uint8_t credential_num;
+  uint8_t key_agreement[PRI_KEY_SIZE + PUB_KEY_SIZE];
+  uint8_t has_key_agreement;
+} keypair_pool;
+
+// the attestation certificate, loaded again after ctap_install_cert and every ctap_install
+static struct {
+  uint8_t cert[MAX_CERT_SIZE];
+  uint16_t len;
+  uint8_t loaded;
+} cert_cache;
+
+#define KEY_CACHE_PRI 0x01
+#define KEY_CACHE_KH 0x02
+#define KEY_CACHE_HE 0x04
+
+static int read_cached_key(uint8_t mask, uint8_t attr, uint8_t *cached, uint8_t *key, uint8_t len) {
+  if (!(key_cache.loaded & mask)) {
+    int ret = read_attr(CTAP_CERT_FILE, attr, cached, len);
+    if (ret < 0) return ret;
+    key_cache.loaded |= mask;
+  }
+  memcpy(key, cached, len);
   return 0;
 }
 
-static int read_kh_key(uint8_t *kh_key) {
-  int ret = read_attr(CTAP_CERT_FILE, KH_KEY_ATTR, kh_key, KH_KEY_SIZE);
-  if (ret < 0) return ret;
-  return 0;
+static int read_pri_key(uint8_t *pri_key) {
+  return read_cached_key(KEY_CACHE_PRI, KEY_ATTR, key_cache.pri_key, pri_key, PRI_KEY_SIZE);
+}
+
+static const hmac_sha256_ctx_t *load_kh_ctx(void) {
+  if (!(key_cache.loaded & KEY_CACHE_KH)) {
+    uint8_t kh_key[KH_KEY_SIZE];
+    int ret = read_attr(CTAP_CERT_FILE, KH_KEY_ATTR, kh_key, KH_KEY_SIZE);
+    if (ret < 0) return NULL;
+    hmac_sha256_ctx_init(&key_cache.kh_ctx, kh_key, KH_KEY_SIZE);
+    memzero(kh_key, sizeof(kh_key));
+    key_cache.loaded |= KEY_CACHE_KH;
+  }
+  return &key_cache.kh_ctx;
 }
 
 static int read_he_key(uint8_t *he_key) {
-  int ret = read_attr(CTAP_CERT_FILE, HE_KEY_ATTR, he_key, HE_KEY_SIZE);
-  if (ret < 0) return ret;
-  return 0;
+  return read_cached_key(KEY_CACHE_HE, HE_KEY_ATTR, key_cache.he_key, he_key, HE_KEY_SIZE);
 }
 
-int increase_counter(uint32_t *counter) {
-  int ret = read_attr(CTAP_CERT_FILE, SIGN_CTR_ATTR, counter, sizeof(uint32_t));
+void clear_key_cache(void) { memzero(&key_cache, sizeof(key_cache)); }
+
+static counter_t sign_counter = COUNTER_INIT(CTAP_CERT_FILE, SIGN_CTR_ATTR, CTAP_SIGN_COUNTER_RESERVE);
+
+// called along with wiping the credentials, so every counter may start from 0 again
+int reset_counter(void) {
+  int ret = counter_reset(&sign_counter, 0);
   if (ret < 0) return ret;
-  ++*counter;
-  ret = write_attr(CTAP_CERT_FILE, SIGN_CTR_ATTR, counter, sizeof(uint32_t));
+#ifdef CTAP_PER_RP_COUNTER
+  ret = counter_set_reset(CTAP_COUNTER_FILE, 0);
   if (ret < 0) return ret;
+#endif
   return 0;
 }
 
-static void generate_credential_id_nonce_tag(CredentialId *kh, uint8_t *pubkey) {
-  // works for es256 and ed25519 since their pubkeys share the same length
-  random_buffer(kh->nonce, sizeof(kh->nonce));
+int install_counter(void) {
+#ifdef CTAP_PER_RP_COUNTER
+  // the RPs may have seen the values of the global counter, so the per-RP ones start above all of them
+  uint32_t ceiling;
+  counter_unload(&sign_counter);
+  if (counter_read(&sign_counter, &ceiling) < 0) return -1;
+  return counter_set_init(CTAP_COUNTER_FILE, ceiling);
+#else
+  return 0;
+#endif
+}
+
+// With CTAP_PER_RP_COUNTER, each RP gets its own counter keyed by the rpIdHash, so that the counter
+// values do not reveal the use of the authenticator at other RPs.
+int increase_counter(const uint8_t *rpIdHash, uint32_t *counter) {
+#ifdef CTAP_PER_RP_COUNTER
+  return counter_set_increase(CTAP_COUNTER_FILE, rpIdHash, CTAP_SIGN_COUNTER_RESERVE, counter);
+#else
+  (void)rpIdHash;
+  return counter_increase(&sign_counter, counter);
+#endif
+}
+
+static void generate_credential_id_tag(const hmac_sha256_ctx_t *kh_ctx, CredentialId *kh, uint8_t *pubkey) {
   // private key = hmac-sha256(device private key, nonce), stored in pubkey[0:32)
-  hmac_sha256(pubkey, KH_KEY_SIZE, kh->nonce, sizeof(kh->nonce), pubkey);
+  hmac_sha256_ctx_compute(kh_ctx, kh->nonce, sizeof(kh->nonce), pubkey);
   // tag = left(hmac-sha256(private key, rpIdHash or appid), 16), stored in pubkey[32, 64)
   hmac_sha256(pubkey, KH_KEY_SIZE, kh->rpIdHash, sizeof(kh->rpIdHash), pubkey + KH_KEY_SIZE);
   memcpy(kh->tag, pubkey + KH_KEY_SIZE, sizeof(kh->tag));
 }
 
+static void generate_credential_id_nonce_tag(const hmac_sha256_ctx_t *kh_ctx, CredentialId *kh, uint8_t *pubkey) {
+  // works for es256 and ed25519 since their pubkeys share the same length
+  random_buffer(kh->nonce, sizeof(kh->nonce));
+  generate_credential_id_tag(kh_ctx, kh, pubkey);
+}
+
+// Take a precomputed P-256 credential key pair, returns 0 if the pool is empty.
+static int take_pooled_credential(const hmac_sha256_ctx_t *kh_ctx, CredentialId *kh, uint8_t *pubkey) {
+  if (keypair_pool.credential_num == 0) return 0;
+  uint8_t idx = --keypair_pool.credential_num;
+  memcpy(kh->nonce, keypair_pool.credential[idx].nonce, sizeof(kh->nonce));
+  // the tag binds the rpIdHash, so it is made now
+  generate_credential_id_tag(kh_ctx, kh, pubkey);
+  memcpy(pubkey, keypair_pool.credential[idx].pubkey, PUB_KEY_SIZE);
+  memzero(&keypair_pool.credential[idx], sizeof(keypair_pool.credential[idx]));
+  return 1;
+}
+
+void precompute_keypairs(void) {
+  if (!keypair_pool.has_key_agreement) {
+    if (ecc_generate(ECC_SECP256R1, keypair_pool.key_agreement, keypair_pool.key_agreement + PRI_KEY_SIZE) < 0)
+      return;
+    keypair_pool.has_key_agreement = 1;
+    return;
+  }
+  if (keypair_pool.credential_num < CTAP_KEYPAIR_POOL_NUM) {
+    const hmac_sha256_ctx_t *kh_ctx = load_kh_ctx();
+    if (kh_ctx == NULL) return;
+    uint8_t pri_key[PRI_KEY_SIZE];
+    uint8_t idx = keypair_pool.credential_num;
+    random_buffer(keypair_pool.credential[idx].nonce, CREDENTIAL_NONCE_SIZE);
+    hmac_sha256_ctx_compute(kh_ctx, keypair_pool.credential[idx].nonce, CREDENTIAL_NONCE_SIZE, pri_key);
+    // a nonce giving an invalid key is dropped, and another one is tried next time
+    if (ecc_get_public_key(ECC_SECP256R1, pri_key, keypair_pool.credential[idx].pubkey) >= 0)
+      ++keypair_pool.credential_num;
+    memzero(pri_key, sizeof(pri_key));
+  }
+}
+
+void clear_keypair_pool(void) { memzero(&keypair_pool, sizeof(keypair_pool)); }
+
+int generate_key_agreement_keypair(uint8_t *keypair) {
+  if (keypair_pool.has_key_agreement) {
+    memcpy(keypair, keypair_pool.key_agreement, PRI_KEY_SIZE + PUB_KEY_SIZE);
+    memzero(keypair_pool.key_agreement, sizeof(keypair_pool.key_agreement));
+    keypair_pool.has_key_agreement = 0;
+    return 0;
+  }
+  return ecc_generate(ECC_SECP256R1, keypair, keypair + PRI_KEY_SIZE);
+}
+
 int generate_key_handle(CredentialId *kh, uint8_t *pubkey, int32_t alg_type) {
-  int ret = read_kh_key(pubkey); // use pubkey as key buffer
-  if (ret < 0) return ret;
+  const hmac_sha256_ctx_t *kh_ctx = load_kh_ctx();
+  if (kh_ctx == NULL) return -1;
 
   if (alg_type == COSE_ALG_ES256) {
     kh->alg_type = COSE_ALG_ES256;
+    if (take_pooled_credential(kh_ctx, kh, pubkey)) return 0;
     do {
-      generate_credential_id_nonce_tag(kh, pubkey);
+      generate_credential_id_nonce_tag(kh_ctx, kh, pubkey);
     } while (ecc_get_public_key(ECC_SECP256R1, pubkey, pubkey) < 0);
     return 0;
   } else if (alg_type == COSE_ALG_EDDSA) {
     kh->alg_type = COSE_ALG_EDDSA;
-    generate_credential_id_nonce_tag(kh, pubkey);
+    generate_credential_id_nonce_tag(kh_ctx, kh, pubkey);
     ed25519_publickey(pubkey, pubkey);
     return 0;
   } else {
@@ -67,18 +194,18 @@ int generate_key_handle(CredentialId *kh, uint8_t *pubkey, int32_t alg_type) {
 }
 
 int verify_key_handle(const CredentialId *kh, uint8_t *pri_key) {
-  uint8_t kh_key[KH_KEY_SIZE];
-  int ret = read_kh_key(kh_key);
-  if (ret < 0) return ret;
+  uint8_t tag[SHA256_DIGEST_LENGTH];
+  const hmac_sha256_ctx_t *kh_ctx = load_kh_ctx();
+  if (kh_ctx == NULL) return -1;
   // get private key
-  hmac_sha256(kh_key, KH_KEY_SIZE, kh->nonce, sizeof(kh->nonce), pri_key);
-  // get tag, store in kh_key, which should be verified first outside of this function
-  hmac_sha256(pri_key, KH_KEY_SIZE, kh->rpIdHash, sizeof(kh->rpIdHash), kh_key);
-  if (memcmp(kh_key, kh->tag, sizeof(kh->tag)) == 0) {
-    memzero(kh_key, sizeof(kh_key));
+  hmac_sha256_ctx_compute(kh_ctx, kh->nonce, sizeof(kh->nonce), pri_key);
+  // get tag, which should be verified first outside of this function
+  hmac_sha256(pri_key, KH_KEY_SIZE, kh->rpIdHash, sizeof(kh->rpIdHash), tag);
+  if (memcmp(tag, kh->tag, sizeof(kh->tag)) == 0) {
+    memzero(tag, sizeof(tag));
     return 0;
   }
-  memzero(kh_key, sizeof(kh_key));
+  memzero(tag, sizeof(tag));
   return 1;
 }
 
@@ -109,7 +236,18 @@ size_t sign_with_ed25519_private_key(const uint8_t *key, const uint8_t *data, si
   return sizeof(ed25519_signature);
 }
 
-int get_cert(uint8_t *buf) { return read_file(CTAP_CERT_FILE, buf, 0, MAX_CERT_SIZE); }
+int get_cert(const uint8_t **cert) {
+  if (!cert_cache.loaded) {
+    int len = read_file(CTAP_CERT_FILE, cert_cache.cert, 0, MAX_CERT_SIZE);
+    if (len < 0) return len;
+    cert_cache.len = len;
+    cert_cache.loaded = 1;
+  }
+  *cert = cert_cache.cert;
+  return cert_cache.len;
+}
+
+void clear_cert_cache(void) { cert_cache.loaded = 0; }
 
 int has_pin(void) {
   uint8_t tmp;
@@ -117,16 +255,14 @@ int has_pin(void) {
 }
 
 int set_pin(uint8_t *buf, uint8_t length) {
-  int err;
-  if (length == 0) {
-    err = write_attr(CTAP_CERT_FILE, PIN_ATTR, NULL, 0);
-  } else {
+  uint8_t ctr = 8;
+  struct lfs_attr attrs[] = {{PIN_ATTR, buf, 0}, {PIN_CTR_ATTR, &ctr, 1}};
+  if (length != 0) {
     sha256_raw(buf, length, buf);
-    err = write_attr(CTAP_CERT_FILE, PIN_ATTR, buf, PIN_HASH_SIZE);
+    attrs[0].size = PIN_HASH_SIZE;
   }
-  if (err < 0) return err;
-  uint8_t ctr = 8;
-  return write_attr(CTAP_CERT_FILE, PIN_CTR_ATTR, &ctr, 1);
+  // the pin hash and its retry counter are committed at once
+  return write_attrs(CTAP_CERT_FILE, attrs, 2);
 }
 
 int verify_pin_hash(uint8_t *buf) {
@@ -155,5 +291,6 @@ int make_hmac_secret_output(uint8_t *nonce, uint8_t *salt, uint8_t len, uint8_t
   hmac_sha256(hmac_buf, HE_KEY_SIZE, nonce, CREDENTIAL_NONCE_SIZE, hmac_buf);
   hmac_sha256(hmac_buf, HE_KEY_SIZE, salt, 32, output);
   if (len == 64) hmac_sha256(hmac_buf, HE_KEY_SIZE, salt + 32, 32, output + 32);
+  memzero(hmac_buf, sizeof(hmac_buf));
   return 0;
 }
@@ -5,13 +5,20 @@
 #include "ctap-internal.h"
 #include <ctap.h>
 
-int increase_counter(uint32_t *counter);
+void clear_key_cache(void);
+void clear_keypair_pool(void);
+void precompute_keypairs(void);
+int generate_key_agreement_keypair(uint8_t *keypair);
+int reset_counter(void);
+int install_counter(void);
+int increase_counter(const uint8_t *rpIdHash, uint32_t *counter);
 int generate_key_handle(CredentialId *kh, uint8_t *pubkey, int32_t alg_type);
 size_t sign_with_device_key(const uint8_t *digest, uint8_t *sig);
 size_t sign_with_ecdsa_private_key(const uint8_t *key, const uint8_t *digest, uint8_t *sig);
 size_t sign_with_ed25519_private_key(const uint8_t *key, const uint8_t *digest, size_t digest_len, uint8_t *sig);
 int verify_key_handle(const CredentialId *kh, uint8_t *pri_key);
-int get_cert(uint8_t *buf);
+int get_cert(const uint8_t **cert);
+void clear_cert_cache(void);
 int has_pin(void);
 int set_pin(uint8_t *buf, uint8_t length);
 int verify_pin_hash(uint8_t *buf);
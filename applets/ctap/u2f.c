@@ -49,8 +49,11 @@ int u2f_register(const CAPDU *capdu, RAPDU *rapdu) {
   // KEY HANDLE (128)
   memcpy(resp->keyHandleCertSig, &kh, sizeof(CredentialId));
   // CERTIFICATE (var)
-  int cert_len = read_file(CTAP_CERT_FILE, resp->keyHandleCertSig + sizeof(CredentialId), 0, U2F_MAX_ATT_CERT_SIZE);
+  const uint8_t *cert;
+  int cert_len = get_cert(&cert);
   if (cert_len < 0) return cert_len;
+  if (cert_len > U2F_MAX_ATT_CERT_SIZE) EXCEPT(SW_UNABLE_TO_PROCESS);
+  memcpy(resp->keyHandleCertSig + sizeof(CredentialId), cert, cert_len);
   // SIG (var)
   sha256_update((const uint8_t *)&kh, sizeof(CredentialId));
   sha256_update((const uint8_t *)&resp->pubKey, U2F_EC_PUB_KEY_SIZE + 1);
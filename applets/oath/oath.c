@@ -2,15 +2,55 @@
 #include <apdu.h>
 #include <device.h>
 #include <fs.h>
+#include <hmac-ctx.h>
 #include <hmac.h>
 #include <inttypes.h>
 #include <memzero.h>
 #include <oath.h>
 #include <rand.h>
+#include <stddef.h>
 #include <string.h>
 
-#define OATH_FILE "oath"
-#define MAX_RECORDS 100
+#define OATH_FILE "oath"          // the attributes, and the fixed-size records of earlier versions
+#define OATH_DATA_FILE "oath_rec" // the records, and the default record attribute
+#define OATH_TEMP_FILE "oath_tmp" // a data file being rebuilt by compaction, renaming or migration
+#define OATH_JOURNAL_FILE "oath_jnl" // challenges accepted by the records with OATH_PROP_INC
+#define OATH_NO_RECORD 0xffffffff
+#define OATH_RECORD_DELETED 0x01
+#define OATH_MAX_RECORD_SIZE (sizeof(oath_record_header_t) + MAX_NAME_LEN + MAX_KEY_LEN)
+#ifndef OATH_INDEX_NUM
+#define OATH_INDEX_NUM 128
+#endif
+#ifndef OATH_JOURNAL_NUM
+#define OATH_JOURNAL_NUM 32
+#endif
+#ifndef OATH_JOURNAL_MAX_SIZE
+#define OATH_JOURNAL_MAX_SIZE 4096
+#endif
+#ifndef OATH_HMAC_CACHE_NUM
+#define OATH_HMAC_CACHE_NUM 16
+#endif
+#ifndef OATH_HMAC_BATCH_NUM
+#define OATH_HMAC_BATCH_NUM 8
+#endif
+
+// A record is stored as this header followed by the name and the key. Records are appended to the data file, and a
+// deleted one is only flagged until the file is compacted.
+typedef struct {
+  uint8_t flags;
+  uint8_t name_len;
+  uint8_t key_len;
+  uint8_t prop;
+  uint8_t challenge[MAX_CHALLENGE_LEN];
+} __packed oath_record_header_t;
+
+// a challenge accepted by the record at offset, which overrides the one stored in the record when greater;
+// an entry is ignored once the record at offset is not of the same name any more
+typedef struct {
+  uint32_t offset;
+  uint32_t name_hash;
+  uint8_t challenge[MAX_CHALLENGE_LEN];
+} __packed oath_journal_entry_t;
 
 static enum {
   REMAINING_NONE,
@@ -18,19 +58,415 @@ static enum {
   REMAINING_LIST,
 } oath_remaining_type;
 
-static uint8_t challenge[MAX_CHALLENGE_LEN], challenge_len, record_idx, is_validated;
+static uint8_t challenge[MAX_CHALLENGE_LEN], challenge_len, is_validated;
+static uint32_t record_offset; // where LIST and CALCULATE ALL continue
+
+// HMAC contexts of the records, slot i caches the first record whose offset hashes to i,
+// so that a full CALCULATE ALL pass keeps hitting the same records instead of evicting them in turn
+typedef union {
+  hmac_sha1_ctx_t sha1;
+  hmac_sha256_ctx_t sha256;
+  hmac_sha512_ctx_t sha512;
+} oath_hmac_ctx_t;
+typedef struct {
+  uint8_t valid;
+  uint32_t offset;
+  oath_hmac_ctx_t ctx;
+} oath_hmac_cache_t;
+static oath_hmac_cache_t hmac_cache[OATH_HMAC_CACHE_NUM];
+
+// SHA-1 and SHA-256 codes of a CALCULATE ALL response are computed in batches of the same algorithm
+static struct {
+  uint8_t alg, n;
+  uint16_t out_offset[OATH_HMAC_BATCH_NUM];
+  union {
+    hmac_sha1_ctx_t sha1[OATH_HMAC_BATCH_NUM];
+    hmac_sha256_ctx_t sha256[OATH_HMAC_BATCH_NUM];
+  } ctx;
+  uint8_t hmac[OATH_HMAC_BATCH_NUM * SHA256_DIGEST_LENGTH];
+} batch;
+
+// offsets and name hashes of the live records in file order, built by one pass over the data file on first use, so
+// that a lookup by name only reads the records whose hash matches. The records that do not fit in the index are
+// found by scanning the file from scan_from.
+static struct {
+  uint8_t loaded;
+  uint8_t complete; // every live record is in the index
+  uint16_t n;
+  uint32_t end;       // size of the data file
+  uint32_t scan_from; // the first record left out of the index
+  uint32_t garbage;   // bytes taken by deleted records
+  struct {
+    uint32_t offset;
+    uint32_t hash;
+  } entry[OATH_INDEX_NUM];
+} name_index;
+
+// The challenges accepted by TOTP records with OATH_PROP_INC are appended to a journal in one write per response,
+// instead of being written into each record every time step. The journal is checkpointed into the records once it
+// grows too large or covers too many records, and before the records move or get renamed.
+static struct {
+  uint8_t loaded;
+  uint8_t n, n_pending;
+  uint32_t size; // of the journal file
+  oath_journal_entry_t latest[OATH_JOURNAL_NUM];  // the greatest challenge of each record in the journal
+  oath_journal_entry_t pending[OATH_JOURNAL_NUM]; // accepted but not in the journal yet
+} journal;
+
+static void oath_clear_hmac_cache(void) { memzero(hmac_cache, sizeof(hmac_cache)); }
+
+static uint32_t oath_name_hash(const uint8_t *name, uint8_t name_len) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (uint8_t i = 0; i < name_len; ++i)
+    hash = (hash ^ name[i]) * 16777619u;
+  return hash;
+}
+
+static size_t oath_record_size(uint8_t name_len, uint8_t key_len) {
+  return sizeof(oath_record_header_t) + name_len + key_len;
+}
+
+static size_t oath_encode_record(const OATH_RECORD *record, uint8_t buf[OATH_MAX_RECORD_SIZE]) {
+  oath_record_header_t *header = (oath_record_header_t *)buf;
+  header->flags = 0;
+  header->name_len = record->name_len;
+  header->key_len = record->key_len;
+  header->prop = record->prop;
+  memcpy(header->challenge, record->challenge, MAX_CHALLENGE_LEN);
+  memcpy(buf + sizeof(*header), record->name, record->name_len);
+  memcpy(buf + sizeof(*header) + record->name_len, record->key, record->key_len);
+  return oath_record_size(record->name_len, record->key_len);
+}
+
+static int oath_write_challenge(uint32_t offset, const uint8_t challenge[MAX_CHALLENGE_LEN]) {
+  return write_file(OATH_DATA_FILE, challenge, offset + offsetof(oath_record_header_t, challenge), MAX_CHALLENGE_LEN,
+                    0);
+}
+
+// Reads the stored record at offset into buf. Returns its size, 0 at the end of the file, or -1 on error.
+static int oath_read_raw(uint32_t offset, uint8_t buf[OATH_MAX_RECORD_SIZE]) {
+  const oath_record_header_t *header = (const oath_record_header_t *)buf;
+  int len = read_file(OATH_DATA_FILE, buf, offset, OATH_MAX_RECORD_SIZE);
+  if (len <= 0) return len < 0 ? -1 : 0;
+  if (len < (int)sizeof(*header) || header->name_len > MAX_NAME_LEN || header->key_len > MAX_KEY_LEN) return -1;
+  size_t size = oath_record_size(header->name_len, header->key_len);
+  if (size > (size_t)len) return -1;
+  return size;
+}
+
+static oath_journal_entry_t *oath_journal_find(uint32_t offset, uint32_t name_hash) {
+  for (uint8_t i = 0; i != journal.n; ++i)
+    if (journal.latest[i].offset == offset && journal.latest[i].name_hash == name_hash) return &journal.latest[i];
+  return NULL;
+}
+
+// Keeps the greatest challenge of each record. Returns -1 if there is no room for another record.
+static int oath_journal_track(const oath_journal_entry_t *accepted) {
+  oath_journal_entry_t *entry = oath_journal_find(accepted->offset, accepted->name_hash);
+  if (entry == NULL) {
+    if (journal.n == OATH_JOURNAL_NUM) return -1;
+    memcpy(&journal.latest[journal.n++], accepted, sizeof(oath_journal_entry_t));
+  } else if (memcmp(accepted->challenge, entry->challenge, MAX_CHALLENGE_LEN) > 0) {
+    memcpy(entry->challenge, accepted->challenge, MAX_CHALLENGE_LEN);
+  }
+  return 0;
+}
+
+// Writes the challenge of an entry into its record if it is greater, unless the record has been deleted or the offset
+// now belongs to another record.
+static int oath_journal_apply(const oath_journal_entry_t *entry) {
+  uint8_t buf[OATH_MAX_RECORD_SIZE];
+  const oath_record_header_t *header = (const oath_record_header_t *)buf;
+  int ret = 0, size = oath_read_raw(entry->offset, buf);
+  if (size < 0)
+    ret = -1;
+  else if (size > 0 && !(header->flags & OATH_RECORD_DELETED) &&
+           oath_name_hash(buf + sizeof(*header), header->name_len) == entry->name_hash &&
+           memcmp(entry->challenge, header->challenge, MAX_CHALLENGE_LEN) > 0)
+    ret = oath_write_challenge(entry->offset, entry->challenge);
+  memzero(buf, sizeof(buf));
+  return ret;
+}
+
+// Writes the latest challenges into the records, then empties the journal.
+static int oath_journal_checkpoint(void) {
+  DBG_MSG("checkpoint: %u records, %" PRIu32 " bytes\n", journal.n, journal.size);
+  for (uint8_t i = 0; i != journal.n; ++i)
+    if (oath_journal_apply(&journal.latest[i]) < 0) return -1;
+  if (write_file(OATH_JOURNAL_FILE, NULL, 0, 0, 1) < 0) return -1;
+  journal.n = 0;
+  journal.n_pending = 0;
+  journal.size = 0;
+  return 0;
+}
+
+static int oath_journal_load(void) {
+  if (journal.loaded) return 0;
+  oath_journal_entry_t entry;
+  uint8_t overflow = 0;
+  int size = get_file_size(OATH_JOURNAL_FILE);
+
+  journal.n = 0;
+  journal.n_pending = 0;
+  journal.size = size < 0 ? 0 : size - size % sizeof(entry);
+  for (uint32_t off = 0; off < journal.size; off += sizeof(entry)) {
+    if (read_file(OATH_JOURNAL_FILE, &entry, off, sizeof(entry)) != sizeof(entry)) return -1;
+    if (oath_journal_track(&entry) == 0) continue;
+    // more records than RAM can track, bring this one up to date at once
+    if (oath_journal_apply(&entry) < 0) return -1;
+    overflow = 1;
+  }
+  journal.loaded = 1;
+  if (overflow || journal.size >= OATH_JOURNAL_MAX_SIZE) return oath_journal_checkpoint();
+  return 0;
+}
+
+// Appends the pending challenges to the journal. A code must not be sent until its challenge is flushed.
+static int oath_journal_flush(void) {
+  if (journal.n_pending == 0) return 0;
+  size_t len = journal.n_pending * sizeof(oath_journal_entry_t);
+  if (write_file(OATH_JOURNAL_FILE, journal.pending, journal.size, len, 0) < 0) return -1;
+  journal.size += len;
+  journal.n_pending = 0;
+  if (journal.size >= OATH_JOURNAL_MAX_SIZE) return oath_journal_checkpoint();
+  return 0;
+}
+
+static int oath_journal_add(uint32_t offset, const OATH_RECORD *record) {
+  if (journal.n_pending == OATH_JOURNAL_NUM && oath_journal_flush() < 0) return -1;
+  oath_journal_entry_t entry = {.offset = offset, .name_hash = oath_name_hash(record->name, record->name_len)};
+  memcpy(entry.challenge, record->challenge, MAX_CHALLENGE_LEN);
+  if (oath_journal_track(&entry) < 0) {
+    // the checkpoint persists the pending challenges as well
+    if (oath_journal_checkpoint() < 0) return -1;
+    oath_journal_track(&entry);
+  }
+  memcpy(&journal.pending[journal.n_pending++], &entry, sizeof(entry));
+  return 0;
+}
+
+// Reads and decodes the record at offset. Returns its size, 0 at the end of the file, or -1 on error.
+static int oath_read_record(uint32_t offset, OATH_RECORD *record, uint8_t *flags) {
+  uint8_t buf[OATH_MAX_RECORD_SIZE];
+  const oath_record_header_t *header = (const oath_record_header_t *)buf;
+  if (oath_journal_load() < 0) return -1;
+  int size = oath_read_raw(offset, buf);
+  if (size > 0) {
+    *flags = header->flags;
+    record->name_len = header->name_len;
+    memcpy(record->name, buf + sizeof(*header), header->name_len);
+    record->key_len = header->key_len;
+    memcpy(record->key, buf + sizeof(*header) + header->name_len, header->key_len);
+    record->prop = header->prop;
+    memcpy(record->challenge, header->challenge, MAX_CHALLENGE_LEN);
+    const oath_journal_entry_t *entry = oath_journal_find(offset, oath_name_hash(record->name, record->name_len));
+    if (entry != NULL && memcmp(entry->challenge, record->challenge, MAX_CHALLENGE_LEN) > 0)
+      memcpy(record->challenge, entry->challenge, MAX_CHALLENGE_LEN);
+  }
+  memzero(buf, sizeof(buf));
+  return size;
+}
+
+static void oath_index_append(uint32_t offset, uint32_t hash) {
+  if (!name_index.complete) return; // the record is beyond scan_from already
+  if (name_index.n == OATH_INDEX_NUM) {
+    name_index.complete = 0;
+    name_index.scan_from = offset;
+    return;
+  }
+  name_index.entry[name_index.n].offset = offset;
+  name_index.entry[name_index.n++].hash = hash;
+}
+
+static void oath_index_remove(uint32_t offset) {
+  for (uint16_t i = 0; i != name_index.n; ++i) {
+    if (name_index.entry[i].offset != offset) continue;
+    memmove(&name_index.entry[i], &name_index.entry[i + 1], (name_index.n - i - 1) * sizeof(name_index.entry[0]));
+    --name_index.n;
+    return;
+  }
+}
+
+static int oath_load_index(void) {
+  if (name_index.loaded) return 0;
+  uint8_t buf[OATH_MAX_RECORD_SIZE];
+  const oath_record_header_t *header = (const oath_record_header_t *)buf;
+  uint32_t offset = 0;
+  int size;
+
+  name_index.n = 0;
+  name_index.complete = 1;
+  name_index.garbage = 0;
+  while ((size = oath_read_raw(offset, buf)) > 0) {
+    if (header->flags & OATH_RECORD_DELETED)
+      name_index.garbage += size;
+    else
+      oath_index_append(offset, oath_name_hash(buf + sizeof(*header), header->name_len));
+    offset += size;
+  }
+  memzero(buf, sizeof(buf));
+  if (size < 0) return -1;
+  name_index.end = offset;
+  name_index.loaded = 1;
+  return 0;
+}
+
+static int oath_name_matches(const OATH_RECORD *record, const uint8_t *name, uint8_t name_len) {
+  return record->name_len == name_len && memcmp(record->name, name, name_len) == 0;
+}
+
+// Finds the live record by its name. Returns its offset, -1 on error, or -2 if not found.
+static int oath_find_record(const uint8_t *name, uint8_t name_len, OATH_RECORD *record) {
+  if (oath_load_index() < 0) return -1;
+  uint32_t hash = oath_name_hash(name, name_len);
+  uint8_t flags;
+  for (uint16_t i = 0; i != name_index.n; ++i) {
+    if (name_index.entry[i].hash != hash) continue;
+    if (oath_read_record(name_index.entry[i].offset, record, &flags) <= 0) return -1;
+    if (oath_name_matches(record, name, name_len)) return name_index.entry[i].offset;
+  }
+  if (name_index.complete) return -2;
+  for (uint32_t offset = name_index.scan_from; offset < name_index.end;) {
+    int size = oath_read_record(offset, record, &flags);
+    if (size <= 0) return -1;
+    if (!(flags & OATH_RECORD_DELETED) && oath_name_matches(record, name, name_len)) return offset;
+    offset += size;
+  }
+  return -2;
+}
+
+// Appends a record to the data file. Returns its offset, or a negative error code.
+static int oath_append_record(const OATH_RECORD *record) {
+  uint8_t buf[OATH_MAX_RECORD_SIZE];
+  uint32_t offset = name_index.end;
+  size_t size = oath_encode_record(record, buf);
+  int err = write_file(OATH_DATA_FILE, buf, offset, size, 0);
+  memzero(buf, sizeof(buf));
+  if (err < 0) {
+    name_index.loaded = 0;
+    return err;
+  }
+  name_index.end += size;
+  oath_index_append(offset, oath_name_hash(record->name, record->name_len));
+  return offset;
+}
+
+static int oath_delete_record(uint32_t offset, const OATH_RECORD *record) {
+  uint8_t flags = OATH_RECORD_DELETED;
+  if (write_file(OATH_DATA_FILE, &flags, offset + offsetof(oath_record_header_t, flags), 1, 0) < 0) {
+    name_index.loaded = 0;
+    return -1;
+  }
+  oath_index_remove(offset);
+  name_index.garbage += oath_record_size(record->name_len, record->key_len);
+  return 0;
+}
+
+// Rewrites the data file without the deleted records, with the record at replace_offset (if any) replaced by
+// another one. The new file replaces the old one by a rename, which carries the remapped default record attribute
+// along, so a power loss leaves one of them intact. Returns 0, or a negative error code.
+static int oath_rebuild(uint32_t replace_offset, const OATH_RECORD *replacement) {
+  uint8_t buf[OATH_MAX_RECORD_SIZE];
+  const oath_record_header_t *header = (const oath_record_header_t *)buf;
+  uint32_t default_offset = OATH_NO_RECORD, new_default = OATH_NO_RECORD, in = 0, out = 0;
+  lfs_file_t tmp;
+  int size, ret = -1, err, close_err;
+
+  DBG_MSG("compact: %" PRIu32 " of %" PRIu32 " bytes deleted\n", name_index.garbage, name_index.end);
+  // the journal refers to the records by offset
+  if (oath_journal_load() < 0 || oath_journal_checkpoint() < 0) return -1;
+  if (read_attr(OATH_DATA_FILE, ATTR_DEFAULT_RECORD, &default_offset, sizeof(default_offset)) < 0) return -1;
+  // the records are streamed through one handle, and reach the metadata with a single commit
+  if (create_file(&tmp, OATH_TEMP_FILE) < 0) return -1;
+  err = 0;
+  while ((size = oath_read_raw(in, buf)) > 0) {
+    if (!(header->flags & OATH_RECORD_DELETED)) {
+      size_t len = in == replace_offset ? oath_encode_record(replacement, buf) : (size_t)size;
+      if ((err = append_file(&tmp, buf, len)) < 0) break;
+      if (in == default_offset) new_default = out;
+      out += len;
+    }
+    in += size;
+  }
+  close_err = close_file(&tmp);
+  if (err < 0 || (err = close_err) < 0) {
+    ret = err;
+    goto cleanup;
+  }
+  if (size < 0) goto cleanup;
+  if (write_attr(OATH_TEMP_FILE, ATTR_DEFAULT_RECORD, &new_default, sizeof(new_default)) < 0) goto cleanup;
+  if (rename_file(OATH_TEMP_FILE, OATH_DATA_FILE) < 0) goto cleanup;
+  ret = 0;
+
+cleanup:
+  memzero(buf, sizeof(buf));
+  // offsets have changed, and a LIST or CALCULATE ALL in progress can not be continued
+  name_index.loaded = 0;
+  oath_remaining_type = REMAINING_NONE;
+  record_offset = 0;
+  oath_clear_hmac_cache();
+  return ret;
+}
+
+static int oath_compact(void) { return oath_rebuild(OATH_NO_RECORD, NULL); }
+
+// Converts the fixed-size records of earlier versions in OATH_FILE to a data file.
+static int oath_migrate(void) {
+  // a data file left by an interrupted compaction holds copies of the keys
+  remove_file(OATH_TEMP_FILE);
+  if (get_file_size(OATH_DATA_FILE) >= 0) {
+    // the migration might have been interrupted after the data file was in place
+    return get_file_size(OATH_FILE) > 0 ? truncate_file(OATH_FILE, 0) : 0;
+  }
+  int size = get_file_size(OATH_FILE);
+  if (size < 0) return -1;
+
+  OATH_RECORD record;
+  uint8_t buf[OATH_MAX_RECORD_SIZE];
+  uint32_t default_offset = OATH_NO_RECORD, new_default = OATH_NO_RECORD, out = 0;
+  lfs_file_t tmp;
+  int ret = -1, err = 0;
+  read_attr(OATH_FILE, ATTR_DEFAULT_RECORD, &default_offset, sizeof(default_offset));
+  if (create_file(&tmp, OATH_TEMP_FILE) < 0) return -1;
+  for (uint32_t in = 0; in + sizeof(OATH_RECORD) <= (uint32_t)size; in += sizeof(OATH_RECORD)) {
+    if ((err = read_file(OATH_FILE, &record, in, sizeof(OATH_RECORD))) < 0) break;
+    if (record.name_len == 0 || record.name_len > MAX_NAME_LEN || record.key_len > MAX_KEY_LEN) continue;
+    size_t len = oath_encode_record(&record, buf);
+    if ((err = append_file(&tmp, buf, len)) < 0) break;
+    if (in == default_offset) new_default = out;
+    out += len;
+  }
+  if (close_file(&tmp) < 0 || err < 0) goto cleanup;
+  if (write_attr(OATH_TEMP_FILE, ATTR_DEFAULT_RECORD, &new_default, sizeof(new_default)) < 0) goto cleanup;
+  if (rename_file(OATH_TEMP_FILE, OATH_DATA_FILE) < 0) goto cleanup;
+  // drop the old records, the keys in them included
+  ret = truncate_file(OATH_FILE, 0);
+
+cleanup:
+  memzero(&record, sizeof(record));
+  memzero(buf, sizeof(buf));
+  return ret;
+}
 
 void oath_poweroff(void) {
   oath_remaining_type = REMAINING_NONE;
   is_validated = false;
+  oath_clear_hmac_cache();
 }
 
+void oath_deselect(void) { oath_remaining_type = REMAINING_NONE; }
+
 int oath_install(uint8_t reset) {
   oath_poweroff();
-  if (!reset && get_file_size(OATH_FILE) >= 0) return 0;
+  name_index.loaded = 0;
+  journal.loaded = 0;
+  if (!reset && get_file_size(OATH_FILE) >= 0) return oath_migrate();
+  if (write_file(OATH_JOURNAL_FILE, NULL, 0, 0, 1) < 0) return -1;
+  // the records go first, so that an interrupted reset never leaves them behind
+  if (write_file(OATH_DATA_FILE, NULL, 0, 0, 1) < 0) return -1;
+  uint32_t default_item = OATH_NO_RECORD;
+  if (write_attr(OATH_DATA_FILE, ATTR_DEFAULT_RECORD, &default_item, sizeof(default_item)) < 0) return -1;
   if (write_file(OATH_FILE, NULL, 0, 0, 1) < 0) return -1;
-  uint32_t default_item = 0xffffffff;
-  if (write_attr(OATH_FILE, ATTR_DEFAULT_RECORD, &default_item, sizeof(default_item)) < 0) return -1;
   if (write_attr(OATH_FILE, ATTR_KEY, NULL, 0) < 0) return -1;
   uint8_t handle[HANDLE_LEN];
   random_buffer(handle, sizeof(handle));
@@ -115,34 +551,31 @@ static int oath_put(const CAPDU *capdu, RAPDU *rapdu) {
 
   if (LC != offset) EXCEPT(SW_WRONG_LENGTH);
 
-  // find an empty slot to save the record
-  int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-  size_t nRecords = size / sizeof(OATH_RECORD), unoccupied;
   OATH_RECORD record;
-  unoccupied = nRecords; // append by default
-  for (size_t i = 0; i != nRecords; ++i) {
-    if (read_file(OATH_FILE, &record, i * sizeof(OATH_RECORD), sizeof(OATH_RECORD)) < 0) return -1;
-    // duplicated name found
-    if (record.name_len == name_len && memcmp(record.name, name_ptr, name_len) == 0) {
-      DBG_MSG("dup name\n");
-      EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
-    }
-    // empty slot found
-    if (record.name_len == 0 && unoccupied == nRecords) unoccupied = i;
+  int ret = oath_find_record(name_ptr, name_len, &record);
+  if (ret == -1) return -1;
+  if (ret >= 0) {
+    DBG_MSG("dup name\n");
+    EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
   }
-  DBG_MSG("unoccupied=%zu nRecords=%zu\n", unoccupied, nRecords);
-  if (unoccupied == nRecords &&  // empty slot not found
-      unoccupied >= MAX_RECORDS) // number of records exceeded the limit
-    EXCEPT(SW_NOT_ENOUGH_SPACE);
 
+  memset(&record, 0, sizeof(record));
   record.name_len = name_len;
   memcpy(record.name, name_ptr, name_len);
   record.key_len = key_len;
   memcpy(record.key, key_ptr, key_len);
   record.prop = prop;
   memcpy(record.challenge, chal, MAX_CHALLENGE_LEN);
-  return write_file(OATH_FILE, &record, unoccupied * sizeof(OATH_RECORD), sizeof(OATH_RECORD), 0);
+  oath_clear_hmac_cache();
+  ret = oath_append_record(&record);
+  // make room by dropping the deleted records
+  if (ret == LFS_ERR_NOSPC && name_index.garbage > 0) {
+    if (oath_compact() < 0 || oath_load_index() < 0) ret = -1;
+    else ret = oath_append_record(&record);
+  }
+  memzero(&record, sizeof(record));
+  if (ret == LFS_ERR_NOSPC) EXCEPT(SW_NOT_ENOUGH_SPACE);
+  return ret < 0 ? -1 : 0;
 }
 
 static int oath_delete(const CAPDU *capdu, RAPDU *rapdu) {
@@ -158,18 +591,18 @@ static int oath_delete(const CAPDU *capdu, RAPDU *rapdu) {
   if (LC < offset) EXCEPT(SW_WRONG_LENGTH);
 
   // find and delete the record
-  int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-  size_t nRecords = size / sizeof(OATH_RECORD);
   OATH_RECORD record;
-  for (size_t i = 0; i != nRecords; ++i) {
-    if (read_file(OATH_FILE, &record, i * sizeof(OATH_RECORD), sizeof(OATH_RECORD)) < 0) return -1;
-    if (record.name_len == name_len && memcmp(record.name, name_ptr, name_len) == 0) {
-      record.name_len = 0;
-      return write_file(OATH_FILE, &record, i * sizeof(OATH_RECORD), sizeof(OATH_RECORD), 0);
-    }
-  }
-  EXCEPT(SW_DATA_INVALID);
+  int i = oath_find_record(name_ptr, name_len, &record);
+  if (i == -1) return -1;
+  if (i < 0) EXCEPT(SW_DATA_INVALID);
+  oath_clear_hmac_cache();
+  int ret = oath_delete_record(i, &record);
+  memzero(&record, sizeof(record));
+  if (ret < 0) return -1;
+  // compact once the deleted records take half of the file; the record is gone either way, and a failed
+  // compaction leaves the data file as it was, to be compacted by a later delete
+  if (name_index.garbage * 2 >= name_index.end && oath_compact() < 0) DBG_MSG("compaction failed\n");
+  return 0;
 }
 
 static int oath_rename(const CAPDU *capdu, RAPDU *rapdu) {
@@ -191,22 +624,32 @@ static int oath_rename(const CAPDU *capdu, RAPDU *rapdu) {
   if (LC < offset) EXCEPT(SW_WRONG_LENGTH);
 
   // find the record
-  int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-  uint32_t nRecords = size / sizeof(OATH_RECORD), i;
-  uint32_t file_offset;
   OATH_RECORD record;
-  for (i = 0; i != nRecords; ++i) {
-    file_offset = i * sizeof(OATH_RECORD);
-    if (read_file(OATH_FILE, &record, file_offset, sizeof(OATH_RECORD)) < 0) return -1;
-    if (record.name_len == old_name_len && memcmp(record.name, old_name_ptr, old_name_len) == 0) break;
+  int i = oath_find_record(old_name_ptr, old_name_len, &record);
+  if (i == -1) return -1;
+  if (i < 0) EXCEPT(SW_DATA_INVALID);
+
+  // a name of the same length is updated in place, after the journal entries made under the old name are applied
+  if (new_name_len == record.name_len) {
+    memzero(&record, sizeof(record));
+    if (oath_journal_checkpoint() < 0) return -1;
+    if (write_file(OATH_DATA_FILE, new_name_ptr, i + sizeof(oath_record_header_t), new_name_len, 0) < 0) {
+      name_index.loaded = 0;
+      return -1;
+    }
+    uint32_t hash = oath_name_hash(new_name_ptr, new_name_len);
+    for (uint16_t j = 0; j != name_index.n; ++j)
+      if (name_index.entry[j].offset == (uint32_t)i) name_index.entry[j].hash = hash;
+    return 0;
   }
-  if (i == nRecords) EXCEPT(SW_DATA_INVALID);
 
-  // update the name
+  // otherwise the file is rebuilt with the renamed record in its place, so that no power loss leaves both names
   record.name_len = new_name_len;
   memcpy(record.name, new_name_ptr, new_name_len);
-  return write_file(OATH_FILE, &record, i * sizeof(OATH_RECORD), sizeof(OATH_RECORD), 0);
+  int ret = oath_rebuild(i, &record);
+  memzero(&record, sizeof(record));
+  if (ret == LFS_ERR_NOSPC) EXCEPT(SW_NOT_ENOUGH_SPACE);
+  return ret < 0 ? -1 : 0;
 }
 
 static int oath_set_code(const CAPDU *capdu, RAPDU *rapdu) {
@@ -288,24 +731,24 @@ static int oath_list(const CAPDU *capdu, RAPDU *rapdu) {
   if (P1 != 0x00 || P2 != 0x00) EXCEPT(SW_WRONG_P1P2);
 
   oath_remaining_type = REMAINING_LIST;
-  int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
   OATH_RECORD record;
-  size_t nRecords = size / sizeof(OATH_RECORD), off = 0;
+  uint8_t flags;
+  size_t off = 0;
 
-  while (off < LE) {
-    if (record_idx >= nRecords) {
+  while (true) {
+    int size = oath_read_record(record_offset, &record, &flags);
+    if (size < 0) return -1;
+    if (size == 0) {
       oath_remaining_type = REMAINING_NONE;
       break;
     }
-    if (read_file(OATH_FILE, &record, record_idx * sizeof(OATH_RECORD), sizeof(OATH_RECORD)) < 0) return -1;
     if (off + 3 + record.name_len > LE) { // tag (1) + name_len (1) + algo (1) + name
-      // shouldn't increase the record_idx in this case
+      // shouldn't move the record_offset in this case
       SW = 0x61FF;
       break;
     }
-    record_idx++;
-    if (record.name_len == 0) continue;
+    record_offset += size;
+    if (flags & OATH_RECORD_DELETED) continue;
 
     RDATA[off++] = OATH_TAG_NAME_LIST;
     RDATA[off++] = record.name_len + 1;
@@ -313,24 +756,25 @@ static int oath_list(const CAPDU *capdu, RAPDU *rapdu) {
     memcpy(RDATA + off, record.name, record.name_len);
     off += record.name_len;
   }
+  memzero(&record, sizeof(record));
   LL = off;
 
   return 0;
 }
 
 static int oath_update_challenge_field(OATH_RECORD *record, size_t file_offset) {
-  return write_file(OATH_FILE, record->challenge, file_offset + (size_t) & ((OATH_RECORD *)0)->challenge,
-                    sizeof(record->challenge), 0);
+  return oath_write_challenge(file_offset, record->challenge);
 }
 
 static int oath_enforce_increasing(OATH_RECORD *record, size_t file_offset) {
   if ((record->prop & OATH_PROP_INC)) {
     if (challenge_len != sizeof(record->challenge)) return -1;
     DBG_MSG("challenge_len=%u %hhu %hhu\n", challenge_len, record->challenge[7], challenge[7]);
-    if (memcmp(record->challenge, challenge, sizeof(record->challenge)) > 0) return -2;
+    int cmp = memcmp(record->challenge, challenge, sizeof(record->challenge));
+    if (cmp > 0) return -2;
+    if (cmp == 0) return 0; // accepted before
     memcpy(record->challenge, challenge, sizeof(record->challenge));
-    oath_update_challenge_field(record, file_offset);
-    return 0;
+    return oath_journal_add(file_offset, record);
   }
   return 0;
 }
@@ -344,32 +788,96 @@ static int oath_increase_counter(OATH_RECORD *record) {
   return i >= 0 ? 0 : -1;
 }
 
-static uint8_t *oath_digest(OATH_RECORD *record, uint8_t buffer[SHA512_DIGEST_LENGTH]) {
-  uint8_t digest_length;
-  if ((record->key[0] & OATH_ALG_MASK) == OATH_ALG_SHA1) {
-    hmac_sha1(record->key + 2, record->key_len - 2, challenge, challenge_len, buffer);
+// returns the cached HMAC context of a record, or builds it in ctx
+static const oath_hmac_ctx_t *oath_hmac_ctx(const OATH_RECORD *record, uint32_t offset, oath_hmac_ctx_t *ctx) {
+  uint8_t alg = record->key[0] & OATH_ALG_MASK;
+  const uint8_t *key = record->key + 2;
+  uint8_t key_len = record->key_len - 2;
+  // records differ in size, so spread their offsets over the slots
+  oath_hmac_cache_t *cached = &hmac_cache[(offset * 2654435761u >> 16) % OATH_HMAC_CACHE_NUM];
+
+  if (cached->valid && cached->offset == offset) return &cached->ctx;
+  // only cache the keys of a validated session, and leave a slot taken by another record alone
+  if (is_validated && !cached->valid) ctx = &cached->ctx;
+  if (alg == OATH_ALG_SHA1)
+    hmac_sha1_ctx_init(&ctx->sha1, key, key_len);
+  else if (alg == OATH_ALG_SHA256)
+    hmac_sha256_ctx_init(&ctx->sha256, key, key_len);
+  else
+    hmac_sha512_ctx_init(&ctx->sha512, key, key_len);
+  if (ctx == &cached->ctx) {
+    cached->offset = offset;
+    cached->valid = 1;
+  }
+  return ctx;
+}
+
+static uint8_t *oath_truncate(uint8_t *digest, uint8_t digest_length) {
+  uint8_t offset = digest[digest_length - 1] & 0xF;
+  digest[offset] &= 0x7F;
+  return digest + offset;
+}
+
+static uint8_t *oath_digest(OATH_RECORD *record, uint32_t offset, uint8_t buffer[SHA512_DIGEST_LENGTH]) {
+  uint8_t digest_length, alg = record->key[0] & OATH_ALG_MASK;
+  oath_hmac_ctx_t tmp;
+  const oath_hmac_ctx_t *ctx = oath_hmac_ctx(record, offset, &tmp);
+
+  if (alg == OATH_ALG_SHA1) {
+    hmac_sha1_ctx_compute(&ctx->sha1, challenge, challenge_len, buffer);
     digest_length = SHA1_DIGEST_LENGTH;
-  } else if ((record->key[0] & OATH_ALG_MASK) == OATH_ALG_SHA256) {
-    hmac_sha256(record->key + 2, record->key_len - 2, challenge, challenge_len, buffer);
+  } else if (alg == OATH_ALG_SHA256) {
+    hmac_sha256_ctx_compute(&ctx->sha256, challenge, challenge_len, buffer);
     digest_length = SHA256_DIGEST_LENGTH;
   } else {
-    hmac_sha512(record->key + 2, record->key_len - 2, challenge, challenge_len, buffer);
+    hmac_sha512_ctx_compute(&ctx->sha512, challenge, challenge_len, buffer);
     digest_length = SHA512_DIGEST_LENGTH;
   }
+  memzero(&tmp, sizeof(tmp));
 
-  uint8_t offset = buffer[digest_length - 1] & 0xF;
-  buffer[offset] &= 0x7F;
-  return buffer + offset;
+  return oath_truncate(buffer, digest_length);
 }
 
-static int oath_calculate_by_offset(size_t file_offset, uint8_t result[4]) {
-  if (file_offset % sizeof(OATH_RECORD) != 0) return -2;
-  int size = get_file_size(OATH_FILE);
-  if (size < 0 || file_offset >= size) return -2;
+static void oath_flush_batch(RAPDU *rapdu) {
+  if (batch.n == 0) return;
+  uint8_t digest_length;
+  if (batch.alg == OATH_ALG_SHA1) {
+    hmac_sha1_batch(batch.ctx.sha1, batch.n, challenge, challenge_len, batch.hmac);
+    digest_length = SHA1_DIGEST_LENGTH;
+  } else {
+    hmac_sha256_batch(batch.ctx.sha256, batch.n, challenge, challenge_len, batch.hmac);
+    digest_length = SHA256_DIGEST_LENGTH;
+  }
+  for (uint8_t i = 0; i < batch.n; ++i)
+    memcpy(RDATA + batch.out_offset[i], oath_truncate(batch.hmac + i * digest_length, digest_length), 4);
+  memzero(&batch, sizeof(batch));
+}
+
+// queues the code of a SHA-1 or SHA-256 record, which is written to RDATA + out_offset by oath_flush_batch
+static void oath_batch_add(const OATH_RECORD *record, uint32_t offset, uint16_t out_offset, RAPDU *rapdu) {
+  uint8_t alg = record->key[0] & OATH_ALG_MASK;
+  oath_hmac_ctx_t tmp;
+
+  if (batch.n == OATH_HMAC_BATCH_NUM || (batch.n > 0 && batch.alg != alg)) oath_flush_batch(rapdu);
+  const oath_hmac_ctx_t *ctx = oath_hmac_ctx(record, offset, &tmp);
+  if (alg == OATH_ALG_SHA1)
+    memcpy(&batch.ctx.sha1[batch.n], &ctx->sha1, sizeof(hmac_sha1_ctx_t));
+  else
+    memcpy(&batch.ctx.sha256[batch.n], &ctx->sha256, sizeof(hmac_sha256_ctx_t));
+  memzero(&tmp, sizeof(tmp));
+  batch.alg = alg;
+  batch.out_offset[batch.n++] = out_offset;
+}
+
+static int oath_calculate_by_offset(uint32_t file_offset, uint8_t result[4]) {
+  if (file_offset == OATH_NO_RECORD) return -2;
   OATH_RECORD record;
-  if (read_file(OATH_FILE, &record, file_offset, sizeof(OATH_RECORD)) < 0) return -1;
+  uint8_t flags;
+  int size = oath_read_record(file_offset, &record, &flags);
+  if (size < 0) return -1;
+  if (size == 0) return -2;
 
-  if (record.name_len == 0) {
+  if (flags & OATH_RECORD_DELETED) {
     ERR_MSG("Record deleted\n");
     return -2;
   }
@@ -386,7 +894,7 @@ static int oath_calculate_by_offset(size_t file_offset, uint8_t result[4]) {
   }
 
   uint8_t hash[SHA512_DIGEST_LENGTH];
-  memcpy(result, oath_digest(&record, hash), 4);
+  memcpy(result, oath_digest(&record, file_offset, hash), 4);
   return record.key[1]; // the number of digits
 }
 
@@ -403,20 +911,14 @@ static int oath_set_default(const CAPDU *capdu, RAPDU *rapdu) {
   if (offset > LC) EXCEPT(SW_WRONG_LENGTH);
 
   // find the record
-  int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-  uint32_t nRecords = size / sizeof(OATH_RECORD), i;
-  uint32_t file_offset;
   OATH_RECORD record;
-  for (i = 0; i != nRecords; ++i) {
-    file_offset = i * sizeof(OATH_RECORD);
-    if (read_file(OATH_FILE, &record, file_offset, sizeof(OATH_RECORD)) < 0) return -1;
-    if (record.name_len == name_len && memcmp(record.name, name_ptr, name_len) == 0) break;
-  }
-  if (i == nRecords) EXCEPT(SW_DATA_INVALID);
+  int i = oath_find_record(name_ptr, name_len, &record);
+  if (i == -1) return -1;
+  if (i < 0) EXCEPT(SW_DATA_INVALID);
+  uint32_t file_offset = i;
   if ((record.key[0] & OATH_TYPE_MASK) == OATH_TYPE_TOTP) EXCEPT(SW_CONDITIONS_NOT_SATISFIED);
 
-  if (write_attr(OATH_FILE, ATTR_DEFAULT_RECORD, &file_offset, sizeof(file_offset)) < 0) return -1;
+  if (write_attr(OATH_DATA_FILE, ATTR_DEFAULT_RECORD, &file_offset, sizeof(file_offset)) < 0) return -1;
   return 0;
 }
 
@@ -432,17 +934,11 @@ static int oath_calculate(const CAPDU *capdu, RAPDU *rapdu) {
   if (LC < offset) EXCEPT(SW_WRONG_LENGTH);
 
   // find the record
-  int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
-  size_t nRecords = size / sizeof(OATH_RECORD), i;
-  size_t file_offset;
   OATH_RECORD record;
-  for (i = 0; i != nRecords; ++i) {
-    file_offset = i * sizeof(OATH_RECORD);
-    if (read_file(OATH_FILE, &record, file_offset, sizeof(OATH_RECORD)) < 0) return -1;
-    if (record.name_len == name_len && memcmp(record.name, DATA + 2, name_len) == 0) break;
-  }
-  if (i == nRecords) EXCEPT(SW_DATA_INVALID);
+  int i = oath_find_record(DATA + 2, name_len, &record);
+  if (i == -1) return -1;
+  if (i < 0) EXCEPT(SW_DATA_INVALID);
+  size_t file_offset = i;
 
   if ((record.prop & OATH_PROP_TOUCH)) {
     if (!is_nfc()) {
@@ -477,13 +973,14 @@ static int oath_calculate(const CAPDU *capdu, RAPDU *rapdu) {
     challenge_len = sizeof(record.challenge);
     memcpy(challenge, record.challenge, challenge_len);
   }
+  if (oath_journal_flush() < 0) return -1;
 
   RDATA[0] = OATH_TAG_RESPONSE;
   RDATA[1] = 5;
   RDATA[2] = record.key[1];
 
   uint8_t hash[SHA512_DIGEST_LENGTH];
-  memcpy(RDATA + 3, oath_digest(&record, hash), 4);
+  memcpy(RDATA + 3, oath_digest(&record, file_offset, hash), 4);
   LL = 7;
   return 0;
 }
@@ -492,11 +989,9 @@ static int oath_calculate_all(const CAPDU *capdu, RAPDU *rapdu) {
   if (P2 != 0x00 && P2 != 0x01) EXCEPT(SW_WRONG_P1P2);
 
   oath_remaining_type = REMAINING_CALC;
-  int size = get_file_size(OATH_FILE);
-  if (size < 0) return -1;
 
   // store challenge in the first call
-  if (record_idx == 0) {
+  if (record_offset == 0) {
     uint16_t off_in = 0;
     if (off_in + 1 >= LC) EXCEPT(SW_WRONG_LENGTH);
     if (DATA[off_in++] != OATH_TAG_CHALLENGE) EXCEPT(SW_WRONG_DATA);
@@ -512,22 +1007,27 @@ static int oath_calculate_all(const CAPDU *capdu, RAPDU *rapdu) {
   }
 
   OATH_RECORD record;
-  size_t nRecords = size / sizeof(OATH_RECORD), off_out = 0;
-  while (off_out < LE) {
-    if (record_idx >= nRecords) {
+  uint8_t flags;
+  size_t off_out = 0;
+  while (true) {
+    uint32_t file_offset = record_offset;
+    int size = oath_read_record(file_offset, &record, &flags);
+    if (size < 0) {
+      memzero(&batch, sizeof(batch));
+      return -1;
+    }
+    if (size == 0) {
       oath_remaining_type = REMAINING_NONE;
       break;
     }
-    size_t file_offset = record_idx * sizeof(OATH_RECORD);
-    if (read_file(OATH_FILE, &record, file_offset, sizeof(OATH_RECORD)) < 0) return -1;
     size_t estimated_len = 2 + record.name_len + 2 + 5;
     if (estimated_len + off_out > LE) {
-      // shouldn't increase the record_idx in this case
+      // shouldn't move the record_offset in this case
       SW = 0x61FF; // more data available
       break;
     }
-    record_idx++;
-    if (record.name_len == 0) continue;
+    record_offset += size;
+    if (flags & OATH_RECORD_DELETED) continue;
 
     RDATA[off_out++] = OATH_TAG_NAME;
     RDATA[off_out++] = record.name_len;
@@ -547,16 +1047,29 @@ static int oath_calculate_all(const CAPDU *capdu, RAPDU *rapdu) {
       continue;
     }
 
-    if (oath_enforce_increasing(&record, file_offset) < 0) EXCEPT(SW_SECURITY_STATUS_NOT_SATISFIED);
+    if (oath_enforce_increasing(&record, file_offset) < 0) {
+      memzero(&batch, sizeof(batch));
+      EXCEPT(SW_SECURITY_STATUS_NOT_SATISFIED);
+    }
 
     RDATA[off_out++] = OATH_TAG_RESPONSE;
     RDATA[off_out++] = 5;
     RDATA[off_out++] = record.key[1];
 
-    uint8_t hash[SHA512_DIGEST_LENGTH];
-    memmove(RDATA + off_out, oath_digest(&record, hash), 4);
+    if ((record.key[0] & OATH_ALG_MASK) == OATH_ALG_SHA512) {
+      uint8_t hash[SHA512_DIGEST_LENGTH];
+      memmove(RDATA + off_out, oath_digest(&record, file_offset, hash), 4);
+    } else {
+      oath_batch_add(&record, file_offset, off_out, rapdu);
+    }
     off_out += 4;
   }
+  if (oath_journal_flush() < 0) {
+    memzero(&batch, sizeof(batch));
+    return -1;
+  }
+  oath_flush_batch(rapdu);
+  memzero(&record, sizeof(record));
   LL = off_out;
 
   return 0;
@@ -570,7 +1083,7 @@ static int oath_send_remaining(const CAPDU *capdu, RAPDU *rapdu) {
 
 int oath_process_one_touch(char *output, size_t maxlen) {
   uint32_t offset = 0xffffffff, otp_code;
-  if (read_attr(OATH_FILE, ATTR_DEFAULT_RECORD, &offset, sizeof(offset)) < 0) return -2;
+  if (read_attr(OATH_DATA_FILE, ATTR_DEFAULT_RECORD, &offset, sizeof(offset)) < 0) return -2;
   int ret = oath_calculate_by_offset(offset, (uint8_t *)&otp_code);
   if (ret < 0) return ret;
   if (ret + 1 > maxlen) return -1;
@@ -604,7 +1117,7 @@ int oath_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
     ret = oath_rename(capdu, rapdu);
     break;
   case OATH_INS_LIST:
-    record_idx = 0;
+    record_offset = 0;
     ret = oath_list(capdu, rapdu);
     break;
   case OATH_INS_CALCULATE:
@@ -618,7 +1131,7 @@ int oath_process_apdu(const CAPDU *capdu, RAPDU *rapdu) {
       ret = oath_select(capdu, rapdu);
     } else if (P1 == 0x00) {
       if (!is_validated) EXCEPT(SW_SECURITY_STATUS_NOT_SATISFIED);
-      record_idx = 0;
+      record_offset = 0;
       ret = oath_calculate_all(capdu, rapdu);
     } else {
       EXCEPT(SW_WRONG_P1P2);
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: Apache-2.0
 #include "key.h"
 #include <common.h>
+#include <counter.h>
 #include <device.h>
 #include <ecc.h>
 #include <ed25519.h>
@@ -126,6 +127,8 @@ static uint8_t pw1_mode, current_occurrence, state;
 static pin_t pw1 = {.min_length = 6, .max_length = MAX_PIN_LENGTH, .is_validated = 0, .path = "pgp-pw1"};
 static pin_t pw3 = {.min_length = 8, .max_length = MAX_PIN_LENGTH, .is_validated = 0, .path = "pgp-pw3"};
 static pin_t rc = {.min_length = 8, .max_length = MAX_PIN_LENGTH, .is_validated = 0, .path = "pgp-rc"};
+// the counter is shown to the user, so it is persisted on every signature instead of reserving ranges
+static counter_t sig_counter = COUNTER_INIT(DATA_PATH, TAG_DIGITAL_SIG_COUNTER, 1);
 static uint8_t touch_policy[4]; // SIG DEC AUT, time
 static uint32_t last_touch = UINT32_MAX;
 
@@ -177,8 +180,17 @@ static const char *get_key_path(uint8_t tag) {
 }
 
 static int reset_sig_counter(void) {
-  uint8_t buf[3] = {0};
-  if (write_attr(DATA_PATH, TAG_DIGITAL_SIG_COUNTER, buf, DIGITAL_SIG_COUNTER_LENGTH) < 0) return -1;
+  if (counter_reset(&sig_counter, 0) < 0) return -1;
+  return 0;
+}
+
+// Old versions stored the counter as the 3-byte big-endian DO.
+static int migrate_sig_counter(void) {
+  uint8_t buf[sizeof(uint32_t)];
+  int len = read_attr(DATA_PATH, TAG_DIGITAL_SIG_COUNTER, buf, sizeof(buf));
+  if (len < 0) return -1;
+  if (len != DIGITAL_SIG_COUNTER_LENGTH) return 0;
+  if (counter_reset(&sig_counter, ((uint32_t)buf[0] << 16) | ((uint32_t)buf[1] << 8) | buf[2]) < 0) return -1;
   return 0;
 }
 
@@ -212,9 +224,12 @@ void openpgp_poweroff(void) {
   state = STATE_NORMAL;
 }
 
+void openpgp_deselect(void) { state = STATE_NORMAL; }
+
 int openpgp_install(uint8_t reset) {
   openpgp_poweroff();
-  if (!reset && get_file_size(DATA_PATH) >= 0) return 0;
+  counter_unload(&sig_counter);
+  if (!reset && get_file_size(DATA_PATH) >= 0) return migrate_sig_counter();
 
   // Cardholder Data
   if (write_file(DATA_PATH, NULL, 0, 0, 1) < 0) return -1;
@@ -476,13 +491,18 @@ static int openpgp_get_data(const CAPDU *capdu, RAPDU *rapdu) {
     LL = off;
     break;
 
-  case TAG_SECURITY_SUPPORT_TEMPLATE:
+  case TAG_SECURITY_SUPPORT_TEMPLATE: {
+    uint32_t ctr;
+    if (counter_read(&sig_counter, &ctr) < 0) return -1;
+    if (ctr > 0xFFFFFF) ctr = 0xFFFFFF;
     RDATA[0] = TAG_DIGITAL_SIG_COUNTER;
     RDATA[1] = DIGITAL_SIG_COUNTER_LENGTH;
-    len = read_attr(DATA_PATH, TAG_DIGITAL_SIG_COUNTER, RDATA + 2, DIGITAL_SIG_COUNTER_LENGTH);
-    if (len < 0) return -1;
+    RDATA[2] = ctr >> 16;
+    RDATA[3] = ctr >> 8;
+    RDATA[4] = ctr;
     LL = 2 + DIGITAL_SIG_COUNTER_LENGTH;
     break;
+  }
 
   case TAG_CARDHOLDER_CERTIFICATE:
     if (current_occurrence == 0)
@@ -896,12 +916,8 @@ static int openpgp_compute_digital_signature(const CAPDU *capdu, RAPDU *rapdu) {
     }
   }
 
-  uint8_t ctr[3];
-  if (read_attr(DATA_PATH, TAG_DIGITAL_SIG_COUNTER, ctr, DIGITAL_SIG_COUNTER_LENGTH) < 0) return -1;
-
-  for (int i = 3; i > 0; --i)
-    if (++ctr[i - 1] != 0) break;
-  if (write_attr(DATA_PATH, TAG_DIGITAL_SIG_COUNTER, ctr, DIGITAL_SIG_COUNTER_LENGTH) < 0) return -1;
+  uint32_t ctr;
+  if (counter_increase(&sig_counter, &ctr) < 0) return -1;
 
   return 0;
 }
@@ -27,6 +27,7 @@
 #define ADMIN_P1_CFG_KBDIFACE 0x03
 #define ADMIN_P1_CFG_NDEF 0x04
 #define ADMIN_P1_CFG_WEBUSB_LANDING 0x05
+#define ADMIN_P1_CFG_SESSION_RETENTION 0x06
 
 typedef struct {
     uint32_t reserved;
@@ -35,6 +36,7 @@ typedef struct {
     uint32_t kbd_interface_en : 1;
     uint32_t ndef_en : 1;
     uint32_t webusb_landing_en : 1;
+    uint32_t session_retention_en : 1;
 } __packed admin_device_config_t;
 
 void admin_poweroff(void);
@@ -49,5 +51,6 @@ uint8_t cfg_is_led_normally_on(void);
 uint8_t cfg_is_kbd_interface_enable(void);
 uint8_t cfg_is_ndef_enable(void);
 uint8_t cfg_is_webusb_landing_enable(void);
+uint8_t cfg_is_session_retention_enable(void);
 
 #endif // CANOKEY_CORE_ADMIN_ADMIN_H_
@@ -26,6 +26,7 @@ typedef struct {
 #define SW_TERMINATED 0x6285
 #define SW_PIN_RETRIES 0x63C0
 #define SW_WRONG_LENGTH 0x6700
+#define SW_LOGICAL_CHANNEL_NOT_SUPPORTED 0x6881
 #define SW_UNABLE_TO_PROCESS 0x6900
 #define SW_SECURITY_STATUS_NOT_SATISFIED 0x6982
 #define SW_AUTHENTICATION_BLOCKED 0x6983
@@ -75,8 +76,12 @@ typedef struct {
 typedef struct {
   RAPDU rapdu;
   uint16_t sent;
+  uint8_t tail[2]; // the bytes after the last window, which the status word is written over
 } RAPDU_CHAINING;
 
+// room in front of the chaining buffer, where a transport may put its header before a response window
+#define APDU_RESPONSE_HEADROOM 10
+
 extern uint8_t *global_buffer;
 
 enum {
@@ -86,11 +91,20 @@ enum {
 };
 
 void init_apdu_buffer(void); // implement in ccid.c for reusing the ccid buffer
+// capdu->data is pointed into cmd, which must stay writable until the command is processed
 int build_capdu(CAPDU *capdu, const uint8_t *cmd, uint16_t len);
 int apdu_input(CAPDU_CHAINING *ex, const CAPDU *sh);
+// sh->data is pointed at the next window of ex->rapdu.data, which the transport sends in place.
+// ex->rapdu.data must have room for the status word after the whole response.
 int apdu_output(RAPDU_CHAINING *ex, RAPDU *sh);
 void process_apdu(CAPDU *capdu, RAPDU *rapdu);
+// close the logical channels and deselect every applet, as the card is reset or powered off
+void apdu_reset(void);
 int acquire_global_buffer(uint8_t owner);
 int release_global_buffer(uint8_t owner);
 
+#ifdef TEST
+extern uint32_t apdu_copied_bytes; // command data copied into the chaining buffer
+#endif
+
 #endif // CANOKEY_CORE__APDU_H
@@ -2,6 +2,44 @@
 #ifndef APPLETS_H_
 #define APPLETS_H_
 
+#include <apdu.h>
+
+enum {
+  APPLET_NULL,
+  APPLET_OPENPGP,
+  APPLET_PIV,
+  APPLET_OATH,
+  APPLET_FIDO,
+  APPLET_ADMIN,
+  APPLET_NDEF,
+  APPLET_META,
+  APPLET_ENUM_END,
+};
+
+// where an applet writes its response
+enum {
+  APPLET_RESPONSE_DIRECT,   // the buffer of the transport, at most one window long
+  APPLET_RESPONSE_CHAINING, // the chaining buffer, sent in windows of Le
+  APPLET_RESPONSE_FILL,     // the chaining buffer, filled up regardless of Le
+};
+
+typedef struct {
+  const uint8_t *aid;
+  uint8_t aid_len;
+  uint8_t response;
+  int (*process_apdu)(const CAPDU *capdu, RAPDU *rapdu);
+  int (*install)(uint8_t reset); // optional
+  void (*poweroff)(void);        // optional
+  uint8_t (*enabled)(void);      // optional, the applet can not be selected while it returns 0
+  // optional, called instead of poweroff when the session is retained: drops the state of a pending
+  // command sequence, but keeps the security state until the card is powered off
+  void (*deselect)(void);
+} applet_t;
+
+extern const applet_t applets[APPLET_ENUM_END];
+
+// the applet whose AID the data of a SELECT starts with, or NULL
+const applet_t *applet_find(const uint8_t *aid, uint16_t len);
 void applets_install(void);
 void applets_poweroff(void);
 
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef CANOKEY_CORE_INCLUDE_COUNTER_H
+#define CANOKEY_CORE_INCLUDE_COUNTER_H
+
+#include <stdint.h>
+
+// A monotonic counter stored as a native uint32 attribute of a file.
+// The attribute holds a ceiling rather than the value: increasing reserves the next `reserve` values
+// in RAM with one write, and after a power loss counting restarts from the ceiling, so a value is
+// never handed out twice. A reserve of 1 keeps the attribute equal to the value.
+typedef struct {
+  const char *path;
+  uint8_t attr;
+  uint8_t loaded;
+  uint16_t reserve;
+  uint32_t value;
+  uint32_t ceiling;
+} counter_t;
+
+#define COUNTER_INIT(p, a, r) {.path = (p), .attr = (a), .reserve = (r)}
+
+#define COUNTER_IO_FAIL -1
+#define COUNTER_EXHAUSTED -2
+
+// the size of the keys of a counter set
+#define COUNTER_KEY_SIZE 8
+
+int counter_reset(counter_t *ctr, uint32_t value);
+int counter_read(counter_t *ctr, uint32_t *value);
+int counter_increase(counter_t *ctr, uint32_t *value);
+void counter_unload(counter_t *ctr);
+
+// A set of counters sharing one file, each one addressed by a key.
+// The file keeps the ceilings of at most COUNTER_SET_SLOTS keys. When it is full, the key with
+// the lowest ceiling is dropped and that ceiling becomes the floor every unknown key starts from.
+// The floor only goes down when the set is reset, which callers only do along with whatever the values were
+// handed out for.
+int counter_set_increase(const char *path, const uint8_t *key, uint16_t reserve, uint32_t *value);
+int counter_set_reset(const char *path, uint32_t floor);
+// Create the set with the given floor, unless it has been created already.
+int counter_set_init(const char *path, uint32_t floor);
+
+#endif // CANOKEY_CORE_INCLUDE_COUNTER_H
@@ -6,6 +6,7 @@
 #include <stdint.h>
 
 uint8_t ctap_install(uint8_t reset);
+void ctap_precompute(void);
 int ctap_install_private_key(const CAPDU *capdu, RAPDU *rapdu);
 int ctap_install_cert(const CAPDU *capdu, RAPDU *rapdu);
 int ctap_process_cbor(uint8_t *req, size_t req_len, uint8_t *resp, size_t *resp_len);
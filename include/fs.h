@@ -4,15 +4,84 @@
 
 #include <lfs.h>
 
+typedef struct {
+  uint32_t handle_hits;
+  uint32_t handle_misses;
+  uint32_t attr_hits;
+  uint32_t attr_misses;
+} fs_cache_stats_t;
+
 int fs_format(const struct lfs_config *cfg);
 int fs_mount(const struct lfs_config *cfg);
 int read_file(const char *path, void *buf, lfs_soff_t off, lfs_size_t len);
 int write_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len, uint8_t trunc);
 int truncate_file(const char *path, lfs_size_t len);
+
+/**
+ * Insert data into a file, moving the content after the offset forward.
+ * The file is updated atomically.
+ *
+ * @param path The file.
+ * @param buf  The data to insert.
+ * @param off  Where to insert, no more than the file size.
+ * @param len  Length of the data.
+ * @return 0 on success, or a negative error code.
+ */
+int insert_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len);
+
+/**
+ * Create a file, truncating it if it exists, and keep it open for append_file.
+ * The data is committed once, by close_file, so a power loss before that leaves the old content.
+ *
+ * @param f    The handle to open.
+ * @param path The file.
+ * @return 0 on success, or a negative error code.
+ */
+int create_file(lfs_file_t *f, const char *path);
+
+/**
+ * Write data at the end of a file opened by create_file, without committing it.
+ *
+ * @param f   The handle.
+ * @param buf The data.
+ * @param len Length of the data.
+ * @return 0 on success, or a negative error code.
+ */
+int append_file(lfs_file_t *f, const void *buf, lfs_size_t len);
+
+/**
+ * Commit and close a file opened by create_file. The handle must be closed after an error as well.
+ *
+ * @param f The handle.
+ * @return 0 on success, or a negative error code.
+ */
+int close_file(lfs_file_t *f);
+int remove_file(const char *path);
+
+/**
+ * Rename a file, replacing the file at the new path if there is one.
+ * The file is moved atomically along with its attributes.
+ *
+ * @param old_path The file.
+ * @param new_path The new path.
+ * @return 0 on success, or a negative error code.
+ */
+int rename_file(const char *old_path, const char *new_path);
 int read_attr(const char *path, uint8_t attr, void *buf, lfs_size_t len);
 int write_attr(const char *path, uint8_t attr, const void *buf, lfs_size_t len);
 int get_file_size(const char *path);
 
+/**
+ * Write several attributes of an existing file in a single metadata commit,
+ * so that either all or none of them are updated.
+ *
+ * @param path  The file.
+ * @param attrs The attributes to write.
+ * @param count Number of attributes.
+ * @return 0 on success, or a negative error code.
+ */
+int write_attrs(const char *path, const struct lfs_attr *attrs, lfs_size_t count);
+
 /**
  * Get the total size (in KiB) of the file system.
  *
@@ -27,4 +96,25 @@ int get_fs_size(void);
  */
 int get_fs_usage(void);
 
+/**
+ * Close all cached file handles and wipe their buffers.
+ */
+void fs_drop_caches(void);
+
+/**
+ * Enable or disable the open file handle and attribute caches. Disabling them also drops the caches.
+ *
+ * @param enabled 0 to disable, otherwise enable.
+ */
+void fs_set_cache_enabled(uint8_t enabled);
+
+/**
+ * Get the hit/miss counters of the fs caches.
+ *
+ * @param stats Where to store the counters.
+ */
+void fs_get_cache_stats(fs_cache_stats_t *stats);
+
+void fs_reset_cache_stats(void);
+
 #endif // CANOKEY_CORE_INCLUDE_FS_H
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef CANOKEY_CORE_INCLUDE_HMAC_CTX_H
+#define CANOKEY_CORE_INCLUDE_HMAC_CTX_H
+
+#include <sha.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * HMAC with a fixed key. The key-derived inner and outer pad blocks are
+ * prepared once by the init function and reused by every computation.
+ */
+typedef struct {
+  uint8_t ipad[SHA1_BLOCK_SIZE];
+  uint8_t opad[SHA1_BLOCK_SIZE];
+} hmac_sha1_ctx_t;
+
+typedef struct {
+  uint8_t ipad[SHA256_BLOCK_SIZE];
+  uint8_t opad[SHA256_BLOCK_SIZE];
+} hmac_sha256_ctx_t;
+
+typedef struct {
+  uint8_t ipad[SHA512_BLOCK_SIZE];
+  uint8_t opad[SHA512_BLOCK_SIZE];
+} hmac_sha512_ctx_t;
+
+void hmac_sha1_ctx_init(hmac_sha1_ctx_t *ctx, const uint8_t *key, size_t key_len);
+void hmac_sha1_ctx_compute(const hmac_sha1_ctx_t *ctx, const uint8_t *msg, size_t msg_len, uint8_t *hmac);
+void hmac_sha1_ctx_clear(hmac_sha1_ctx_t *ctx);
+
+void hmac_sha256_ctx_init(hmac_sha256_ctx_t *ctx, const uint8_t *key, size_t key_len);
+void hmac_sha256_ctx_compute(const hmac_sha256_ctx_t *ctx, const uint8_t *msg, size_t msg_len, uint8_t *hmac);
+void hmac_sha256_ctx_clear(hmac_sha256_ctx_t *ctx);
+
+void hmac_sha512_ctx_init(hmac_sha512_ctx_t *ctx, const uint8_t *key, size_t key_len);
+void hmac_sha512_ctx_compute(const hmac_sha512_ctx_t *ctx, const uint8_t *msg, size_t msg_len, uint8_t *hmac);
+void hmac_sha512_ctx_clear(hmac_sha512_ctx_t *ctx);
+
+/*
+ * HMAC of one message under n keys, the results are stored back to back in hmacs.
+ * The default implementation computes them one by one; hosted builds may override
+ * these weak functions with faster kernels.
+ */
+void hmac_sha1_batch(const hmac_sha1_ctx_t *ctxs, size_t n, const uint8_t *msg, size_t msg_len, uint8_t *hmacs);
+void hmac_sha256_batch(const hmac_sha256_ctx_t *ctxs, size_t n, const uint8_t *msg, size_t msg_len, uint8_t *hmacs);
+
+#endif // CANOKEY_CORE_INCLUDE_HMAC_CTX_H
@@ -51,6 +51,7 @@
 #define HANDLE_LEN 8
 #define KEY_LEN 16
 
+// A record as the applet handles it, which was also the fixed-size slot on flash in earlier versions
 typedef struct {
   uint8_t name_len;
   uint8_t name[MAX_NAME_LEN];
@@ -64,6 +65,7 @@ typedef struct {
 } __packed OATH_RECORD;
 
 void oath_poweroff(void);
+void oath_deselect(void);
 int oath_install(uint8_t reset);
 int oath_process_apdu(const CAPDU *capdu, RAPDU *rapdu);
 int oath_process_one_touch(char *output, size_t maxlen);
@@ -59,6 +59,7 @@
 #define TAG_UIF_CACHE_TIME 0x0102
 
 void openpgp_poweroff(void);
+void openpgp_deselect(void);
 int openpgp_install(uint8_t reset);
 int openpgp_process_apdu(const CAPDU *capdu, RAPDU *rapdu);
 
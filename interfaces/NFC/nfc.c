@@ -25,6 +25,7 @@ void nfc_init(void) {
   apdu_cmd.data = global_buffer;
   apdu_resp.data = global_buffer;
   fm_write_reg(REG_FIFO_FLUSH, &inf_sending, 1); // writing anything to this reg will flush FIFO buffer
+  apdu_reset(); // a new field starts a new session
 }
 
 static void nfc_error_handler(int code) {
@@ -74,7 +75,7 @@ static void send_apdu_buffer(uint8_t resend) {
   if (last_sent > 29) last_sent = 29;
   uint8_t prologue = block_number | 0x02;
   if (apdu_buffer_tx_size - apdu_buffer_sent > last_sent) prologue |= PCB_I_CHAINING;
-  nfc_send_frame(prologue, global_buffer + apdu_buffer_sent, last_sent);
+  nfc_send_frame(prologue, apdu_resp.data + apdu_buffer_sent, last_sent);
   apdu_buffer_sent += last_sent;
   if (apdu_buffer_tx_size == apdu_buffer_sent) inf_sending = 0;
 }
@@ -115,6 +116,7 @@ void nfc_loop(void) {
       CAPDU *capdu = &apdu_cmd;
       RAPDU *rapdu = &apdu_resp;
 
+      RDATA = global_buffer;
       if (build_capdu(&apdu_cmd, global_buffer, apdu_buffer_rx_size) < 0) {
         LL = 0;
         SW = SW_WRONG_LENGTH;
@@ -125,8 +127,8 @@ void nfc_loop(void) {
       }
 
       apdu_buffer_tx_size = LL + 2;
-      global_buffer[LL] = HI(SW);
-      global_buffer[LL + 1] = LO(SW);
+      RDATA[LL] = HI(SW);
+      RDATA[LL + 1] = LO(SW);
 
       apdu_buffer_rx_size = 0;
       apdu_buffer_sent = 0;
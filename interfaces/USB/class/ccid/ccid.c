@@ -7,6 +7,10 @@
 #include <usb_device.h>
 #include <usbd_ccid.h>
 
+#if CCID_CMD_HEADER_SIZE > APDU_RESPONSE_HEADROOM
+#error "no room for the CCID header in front of a response window"
+#endif
+
 #define CCID_UpdateCommandStatus(cmd_status, icc_status) bulkin_data.bStatus = (cmd_status | icc_status)
 
 static uint8_t CCID_CheckCommandParams(uint32_t param_type);
@@ -102,6 +106,7 @@ static uint8_t PC_to_RDR_IccPowerOn(void) {
   }
 
   applets_poweroff();
+  apdu_reset();
   memcpy(bulkin_data.abData, atr_ccid, sizeof(atr_ccid));
   bulkin_data.dwLength = sizeof(atr_ccid);
   CCID_UpdateCommandStatus(BM_COMMAND_STATUS_NO_ERROR, BM_ICC_PRESENT_ACTIVE);
@@ -119,6 +124,7 @@ static uint8_t PC_to_RDR_IccPowerOff(void) {
   if (error != 0) return error;
 
   applets_poweroff();
+  apdu_reset();
   release_global_buffer(BUFFER_OWNER_CCID);
   CCID_UpdateCommandStatus(BM_COMMAND_STATUS_NO_ERROR, BM_ICC_PRESENT_INACTIVE);
   return SLOT_NO_ERROR;
@@ -145,6 +151,7 @@ static uint8_t PC_to_RDR_GetSlotStatus(void) {
  * @retval uint8_t status of the command execution
  */
 uint8_t PC_to_RDR_XfrBlock(void) {
+  apdu_resp.data = bulkin_data.abData;
   uint8_t error = CCID_CheckCommandParams(CHK_PARAM_SLOT);
   if (error != 0) return error;
 
@@ -165,14 +172,16 @@ uint8_t PC_to_RDR_XfrBlock(void) {
   }
 
   bulkin_data.dwLength = LL + 2;
-  bulkin_data.abData[LL] = HI(SW);
-  bulkin_data.abData[LL + 1] = LO(SW);
+  RDATA[LL] = HI(SW);
+  RDATA[LL + 1] = LO(SW);
   DBG_MSG("I: ");
-  PRINT_HEX(bulkin_data.abData, bulkin_data.dwLength);
+  PRINT_HEX(RDATA, bulkin_data.dwLength);
   CCID_UpdateCommandStatus(BM_COMMAND_STATUS_NO_ERROR, BM_ICC_PRESENT_ACTIVE);
   return SLOT_NO_ERROR;
 }
 
+const uint8_t *CCID_XfrBlockResponse(void) { return apdu_resp.data; }
+
 /**
  * @brief  PC_to_RDR_GetParameters
  *         Provides the ICC parameters to the host
@@ -323,8 +332,14 @@ void CCID_Loop(void) {
 
   uint16_t len = bulkin_data.dwLength;
   bulkin_data.dwLength = htole32(bulkin_data.dwLength);
+  uint8_t *msg = (uint8_t *)&bulkin_data;
+  if (bulkout_data.bMessageType == PC_TO_RDR_XFRBLOCK && apdu_resp.data != bulkin_data.abData) {
+    // a window of the chaining buffer is sent in place, with the header in the room in front of it
+    msg = apdu_resp.data - CCID_CMD_HEADER_SIZE;
+    memcpy(msg, &bulkin_data, CCID_CMD_HEADER_SIZE);
+  }
   device_spinlock_lock(&send_data_spinlock, true);
-  CCID_Response_SendData(&usb_device, (uint8_t *)&bulkin_data, len + CCID_CMD_HEADER_SIZE, 0);
+  CCID_Response_SendData(&usb_device, msg, len + CCID_CMD_HEADER_SIZE, 0);
   device_spinlock_unlock(&send_data_spinlock);
 }
 
@@ -132,5 +132,6 @@ uint8_t CCID_OutEvent(uint8_t *data, uint8_t len);
 void CCID_Loop(void);
 void CCID_TimeExtensionLoop(void);
 uint8_t PC_to_RDR_XfrBlock(void); // Exported for test purposes
+const uint8_t *CCID_XfrBlockResponse(void); // the data of the last XfrBlock, either abData or a response window
 
 #endif //_CCID_H_
@@ -222,6 +222,8 @@ uint8_t CTAPHID_Loop(uint8_t wait_for_user) {
   return ret;
 }
 
+uint8_t CTAPHID_IsIdle(void) { return !has_frame && channel.state == CTAPHID_IDLE; }
+
 void CTAPHID_SendKeepAlive(uint8_t status) {
   memset(&frame, 0, sizeof(frame));
   frame.cid = channel.cid;
@@ -45,7 +45,7 @@ uint8_t USBD_WEBUSB_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req) {
   case WEBUSB_REQ_RESP:
     if (state == STATE_SENDING_RESP) {
       uint16_t len = MIN(apdu_buffer_size, req->wLength);
-      USBD_CtlSendData(pdev, global_buffer, len, WEBUSB_EP0_SENDER);
+      USBD_CtlSendData(pdev, apdu_resp.data, len, WEBUSB_EP0_SENDER);
       state = STATE_SENT_RESP;
     } else {
       USBD_CtlError(pdev, req);
@@ -74,6 +74,7 @@ void WebUSB_Loop(void) {
   CAPDU *capdu = &apdu_cmd;
   RAPDU *rapdu = &apdu_resp;
 
+  RDATA = global_buffer;
   if (build_capdu(&apdu_cmd, global_buffer, apdu_buffer_size) < 0) {
     // abandon malformed apdu
     LL = 0;
@@ -83,10 +84,10 @@ void WebUSB_Loop(void) {
   }
 
   apdu_buffer_size = LL + 2;
-  global_buffer[LL] = HI(SW);
-  global_buffer[LL + 1] = LO(SW);
+  RDATA[LL] = HI(SW);
+  RDATA[LL + 1] = LO(SW);
   DBG_MSG("R: ");
-  PRINT_HEX(global_buffer, apdu_buffer_size);
+  PRINT_HEX(RDATA, apdu_buffer_size);
   state = STATE_SENDING_RESP;
   release_global_buffer(BUFFER_OWNER_WEBUSB);
 }
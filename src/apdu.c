@@ -4,57 +4,32 @@
 #include <applets.h>
 #include <ctap.h>
 #include <device.h>
-#include <meta.h>
-#include <ndef.h>
 #include <oath.h>
-#include <openpgp.h>
-#include <piv.h>
 #include <string.h>
 
-enum APPLET {
-  APPLET_NULL,
-  APPLET_PIV,
-  APPLET_FIDO,
-  APPLET_OATH,
-  APPLET_ADMIN,
-  APPLET_OPENPGP,
-  APPLET_NDEF,
-  APPLET_META,
-  APPLET_ENUM_END,
-} current_applet;
-
-static const uint8_t PIV_AID[] = {0xA0, 0x00, 0x00, 0x03, 0x08};
-static const uint8_t OATH_AID[] = {0xA0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
-static const uint8_t ADMIN_AID[] = {0xF0, 0x00, 0x00, 0x00, 0x00};
-static const uint8_t OPENPGP_AID[] = {0xD2, 0x76, 0x00, 0x01, 0x24, 0x01};
-static const uint8_t FIDO_AID[] = {0xA0, 0x00, 0x00, 0x06, 0x47, 0x2F, 0x00, 0x01};
-static const uint8_t NDEF_AID[] = {0xD2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01};
-static const uint8_t META_AID[] = {0xA0, 0x00, 0x00, 0x05, 0x27, 0x47, 0x11, 0x17};
-
-static const uint8_t *const AID[] = {
-    [APPLET_NULL] = NULL,       [APPLET_PIV] = PIV_AID,         [APPLET_FIDO] = FIDO_AID, [APPLET_OATH] = OATH_AID,
-    [APPLET_ADMIN] = ADMIN_AID, [APPLET_OPENPGP] = OPENPGP_AID, [APPLET_NDEF] = NDEF_AID, [APPLET_META] = META_AID,
-};
+#ifndef APDU_CHANNEL_NUM
+#define APDU_CHANNEL_NUM 4 // the basic channel and three logical ones, at most 8
+#endif
 
-static const uint8_t AID_Size[] = {
-    [APPLET_NULL] = 0,
-    [APPLET_PIV] = sizeof(PIV_AID),
-    [APPLET_FIDO] = sizeof(FIDO_AID),
-    [APPLET_OATH] = sizeof(OATH_AID),
-    [APPLET_ADMIN] = sizeof(ADMIN_AID),
-    [APPLET_OPENPGP] = sizeof(OPENPGP_AID),
-    [APPLET_NDEF] = sizeof(NDEF_AID),
-    [APPLET_META] = sizeof(META_AID),
-};
+#define INS_MANAGE_CHANNEL 0x70
+
+// the applet selected on each logical channel, an applet is selected on one channel at most and keeps its state
+// while selected
+static const applet_t *current_applet[APDU_CHANNEL_NUM];
+static uint8_t channel_open = 0x01; // bitmap, the basic channel is always open
+static uint8_t response_channel;    // the channel of the response in rapdu_chaining
 
 static volatile uint32_t buffer_owner = BUFFER_OWNER_NONE;
-static uint8_t chaining_buffer[APDU_BUFFER_SIZE];
+static uint8_t chaining_buffer[APDU_RESPONSE_HEADROOM + APDU_BUFFER_SIZE + 2];
 static CAPDU_CHAINING capdu_chaining = {
-    .capdu.data = chaining_buffer,
+    .capdu.data = chaining_buffer + APDU_RESPONSE_HEADROOM,
 };
 static RAPDU_CHAINING rapdu_chaining = {
-    .rapdu.data = chaining_buffer,
+    .rapdu.data = chaining_buffer + APDU_RESPONSE_HEADROOM,
 };
+#ifdef TEST
+uint32_t apdu_copied_bytes;
+#endif
 
 int build_capdu(CAPDU *capdu, const uint8_t *cmd, uint16_t len) {
   if (len < 4) return -1;
@@ -73,10 +48,10 @@ int build_capdu(CAPDU *capdu, const uint8_t *cmd, uint16_t len) {
     LC = 0;
     if (LE == 0) LE = 0x100;
   } else if (LC > 0 && len == 5 + LC) { // Case 3S
-    memmove(DATA, cmd + 5, LC);
+    DATA = (uint8_t *)cmd + 5;
     LE = 0x100;
   } else if (LC > 0 && len == 6 + LC) { // Case 4S
-    memmove(DATA, cmd + 5, LC);
+    DATA = (uint8_t *)cmd + 5;
     LE = cmd[5 + LC];
     if (LE == 0) LE = 0x100;
   } else if (len == 7) { // Case 2E
@@ -88,11 +63,11 @@ int build_capdu(CAPDU *capdu, const uint8_t *cmd, uint16_t len) {
     LC = (cmd[5] << 8) | cmd[6];
     if (LC == 0) return -1;
     if (len == 7 + LC) { // Case 3E
-      memmove(DATA, cmd + 7, LC);
+      DATA = (uint8_t *)cmd + 7;
       LE = 0x10000;
       return 0;
     } else if (len == 9 + LC) { // Case 4E
-      memmove(DATA, cmd + 7, LC);
+      DATA = (uint8_t *)cmd + 7;
       LE = (cmd[7 + LC] << 8) | cmd[8 + LC];
       if (LE == 0) LE = 0x10000;
     } else
@@ -118,6 +93,9 @@ restart:
   if (ex->capdu.lc + sh->lc > APDU_BUFFER_SIZE) return APDU_CHAINING_OVERFLOW;
   memcpy(ex->capdu.data + ex->capdu.lc, sh->data, sh->lc);
   ex->capdu.lc += sh->lc;
+#ifdef TEST
+  apdu_copied_bytes += sh->lc;
+#endif
 
   if (sh->cla & 0x10) // not last block
     return APDU_CHAINING_NOT_LAST_BLOCK;
@@ -129,11 +107,14 @@ restart:
 }
 
 int apdu_output(RAPDU_CHAINING *ex, RAPDU *sh) {
+  // the status word of the last window was written over the start of this one
+  if (ex->sent > 0) memcpy(ex->rapdu.data + ex->sent, ex->tail, sizeof(ex->tail));
   uint16_t to_send = ex->rapdu.len - ex->sent;
   if (to_send > sh->len) to_send = sh->len;
-  memcpy(sh->data, ex->rapdu.data + ex->sent, to_send);
+  sh->data = ex->rapdu.data + ex->sent;
   sh->len = to_send;
   ex->sent += to_send;
+  memcpy(ex->tail, ex->rapdu.data + ex->sent, sizeof(ex->tail));
   if (ex->sent < ex->rapdu.len) {
     if (ex->rapdu.len - ex->sent > 0xFF)
       sh->sw = 0x61FF;
@@ -144,90 +125,182 @@ int apdu_output(RAPDU_CHAINING *ex, RAPDU *sh) {
   return 0;
 }
 
+// Return the logical channel of the command, and clear it from the CLA.
+static uint8_t take_channel(CAPDU *capdu) {
+  uint8_t channel;
+  if (CLA & 0x40) { // further interindustry
+    channel = 4 + (CLA & 0x0F);
+    CLA &= 0xB0;
+  } else {
+    channel = CLA & 0x03;
+    CLA &= 0xFC;
+  }
+  return channel;
+}
+
+static uint8_t is_selected(const applet_t *applet) {
+  for (uint8_t i = 0; i < APDU_CHANNEL_NUM; ++i)
+    if ((channel_open & (1 << i)) && current_applet[i] == applet) return 1;
+  return 0;
+}
+
+static void select_applet(uint8_t channel, const applet_t *applet) {
+  const applet_t *last = current_applet[channel];
+  current_applet[channel] = applet;
+  if (last == NULL || last == applet || is_selected(last)) return;
+  // deselected on every channel: the applet either keeps its security state until the card is
+  // powered off, or loses it now as if the card were powered off
+  if (cfg_is_session_retention_enable()) {
+    if (last->deselect) last->deselect();
+  } else if (last->poweroff)
+    last->poweroff();
+}
+
+static int manage_channel(uint8_t channel, const CAPDU *capdu, RAPDU *rapdu) {
+  LL = 0;
+  SW = SW_NO_ERROR;
+  if (P1 == 0x00) { // open
+    uint8_t target = P2;
+    if (target == 0) {
+      for (target = 1; target < APDU_CHANNEL_NUM && (channel_open & (1 << target)); ++target)
+        ;
+      if (target == APDU_CHANNEL_NUM) EXCEPT(SW_LOGICAL_CHANNEL_NOT_SUPPORTED);
+      RDATA[0] = target;
+      LL = 1;
+    } else if (target >= APDU_CHANNEL_NUM || (channel_open & (1 << target)))
+      EXCEPT(SW_WRONG_P1P2);
+    channel_open |= 1 << target;
+    // an applet has one session to share, so the new channel starts with nothing selected even when it is opened
+    // from a logical channel
+    current_applet[target] = NULL;
+  } else if (P1 == 0x80) { // close
+    uint8_t target = P2 == 0 ? channel : P2;
+    if (target == 0 || target >= APDU_CHANNEL_NUM || !(channel_open & (1 << target))) EXCEPT(SW_WRONG_P1P2);
+    channel_open &= ~(1 << target);
+    select_applet(target, NULL);
+  } else
+    EXCEPT(SW_WRONG_P1P2);
+  return 0;
+}
+
 void process_apdu(CAPDU *capdu, RAPDU *rapdu) {
-  int ret = apdu_input(&capdu_chaining, capdu);
+  CAPDU single, *whole = &capdu_chaining.capdu;
+  int ret;
+  if (!capdu_chaining.in_chaining && !(CLA & 0x10)) {
+    // a command without chaining stays where the transport left it, only the header is copied
+    single = *capdu;
+    whole = &single;
+    ret = APDU_CHAINING_LAST_BLOCK;
+  } else
+    ret = apdu_input(&capdu_chaining, capdu);
   if (ret == APDU_CHAINING_NOT_LAST_BLOCK) {
     LL = 0;
     SW = SW_NO_ERROR;
   } else if (ret == APDU_CHAINING_LAST_BLOCK) {
-    capdu = &capdu_chaining.capdu;
+    capdu = whole;
     LE = MIN(LE, APDU_BUFFER_SIZE);
+    uint8_t channel = take_channel(capdu);
+    if (channel >= APDU_CHANNEL_NUM || !(channel_open & (1 << channel))) {
+      LL = 0;
+      SW = SW_LOGICAL_CHANNEL_NOT_SUPPORTED;
+      return;
+    }
+    const applet_t *current = current_applet[channel];
     if ((CLA == 0x80 || CLA == 0x00) && INS == 0xC0) { // GET RESPONSE
+      // the response is only handed out on the channel it was made for
+      if (channel != response_channel) {
+        LL = 0;
+        SW = SW_CONDITIONS_NOT_SATISFIED;
+        return;
+      }
+      rapdu->len = LE;
+      apdu_output(&rapdu_chaining, rapdu);
+      return;
+    }
+    // OATH hosts ask for the rest of a response with SEND REMAINING instead
+    if (current == &applets[APPLET_OATH] && INS == OATH_INS_SEND_REMAINING && channel == response_channel &&
+        rapdu_chaining.sent < rapdu_chaining.rapdu.len) {
       rapdu->len = LE;
       apdu_output(&rapdu_chaining, rapdu);
       return;
     }
+    if (CLA == 0x00 && INS == INS_MANAGE_CHANNEL) {
+      manage_channel(channel, capdu, rapdu);
+      return;
+    }
     rapdu_chaining.sent = 0;
+    response_channel = channel;
     if (CLA == 0x00 && INS == 0xA4 && P1 == 0x04 && P2 == 0x00) {
-      uint8_t i, end = APPLET_ENUM_END;
-      for (i = APPLET_NULL + 1; i != end; ++i) {
-        if (LC >= AID_Size[i] && memcmp(DATA, AID[i], AID_Size[i]) == 0) {
-          if (i == APPLET_NDEF && !cfg_is_ndef_enable()) {
-            LL = 0;
-            SW = SW_FILE_NOT_FOUND;
-            DBG_MSG("NDEF is disable\n");
-            return;
-          }
-          if (i != current_applet) applets_poweroff();
-          current_applet = i;
-          DBG_MSG("applet switched to: %d\n", current_applet);
-          break;
-        }
-      }
-      if (i == end) {
+      const applet_t *applet = applet_find(DATA, LC);
+      if (applet == NULL) {
         LL = 0;
         SW = SW_FILE_NOT_FOUND;
         DBG_MSG("applet not found\n");
         return;
       }
-    }
-    switch (current_applet) {
-    case APPLET_OPENPGP:
-      openpgp_process_apdu(capdu, &rapdu_chaining.rapdu);
-      rapdu->len = LE;
-      apdu_output(&rapdu_chaining, rapdu);
-      break;
-    case APPLET_PIV:
-      piv_process_apdu(capdu, &rapdu_chaining.rapdu);
-      rapdu->len = LE;
-      apdu_output(&rapdu_chaining, rapdu);
-      break;
-    case APPLET_FIDO:
-#ifdef TEST
-      if (CLA == 0x00 && INS == 0xEE && LC == 0x04 && memcmp(DATA, "\x12\x56\xAB\xF0", 4) == 0) {
-        printf("MAGIC REBOOT command received!\r\n");
-        ctap_install(0);
-        SW = 0x9000;
+      if (applet->enabled && !applet->enabled()) {
         LL = 0;
-        break;
+        SW = SW_FILE_NOT_FOUND;
+        DBG_MSG("applet %d is disabled\n", (int)(applet - applets));
+        return;
       }
-#endif
-      ctap_process_apdu(capdu, &rapdu_chaining.rapdu);
-      rapdu->len = LE;
-      apdu_output(&rapdu_chaining, rapdu);
-      break;
-    case APPLET_OATH:
-      oath_process_apdu(capdu, rapdu);
-      break;
-    case APPLET_ADMIN:
-      admin_process_apdu(capdu, rapdu);
-      break;
-    case APPLET_NDEF:
-      ndef_process_apdu(capdu, rapdu);
-      break;
-    case APPLET_META:
-      meta_process_apdu(capdu, rapdu);
-      break;
-    default:
+      if (applet != current && is_selected(applet)) {
+        LL = 0;
+        SW = SW_CONDITIONS_NOT_SATISFIED;
+        DBG_MSG("applet %d is selected on another channel\n", (int)(applet - applets));
+        return;
+      }
+      select_applet(channel, applet);
+      current = applet;
+      DBG_MSG("applet switched to: %d on channel %d\n", (int)(applet - applets), channel);
+    }
+    if (current == NULL) {
       LL = 0;
       SW = SW_FILE_NOT_FOUND;
+      return;
+    }
+#ifdef TEST
+    if (current == &applets[APPLET_FIDO] && CLA == 0x00 && INS == 0xEE && LC == 0x04 &&
+        memcmp(DATA, "\x12\x56\xAB\xF0", 4) == 0) {
+      printf("MAGIC REBOOT command received!\r\n");
+      ctap_install(0);
+      SW = 0x9000;
+      LL = 0;
+      return;
     }
+#endif
+    if (current->response == APPLET_RESPONSE_DIRECT) {
+      // CCID, NFC and WebUSB receive the command in the buffer the response goes to, move the data out of its way
+      if (LC > 0 && DATA < RDATA + APDU_BUFFER_SIZE + 2 && RDATA < DATA + LC) {
+        memcpy(capdu_chaining.capdu.data, DATA, LC);
+        DATA = capdu_chaining.capdu.data;
+#ifdef TEST
+        apdu_copied_bytes += LC;
+#endif
+      }
+      current->process_apdu(capdu, rapdu);
+      return;
+    }
+    uint32_t le = LE;
+    if (current->response == APPLET_RESPONSE_FILL) LE = APDU_BUFFER_SIZE;
+    current->process_apdu(capdu, &rapdu_chaining.rapdu);
+    rapdu->len = le;
+    apdu_output(&rapdu_chaining, rapdu);
   } else {
     LL = 0;
     SW = SW_CHECKING_ERROR;
   }
 }
 
+void apdu_reset(void) {
+  memset(current_applet, 0, sizeof(current_applet));
+  channel_open = 0x01;
+  response_channel = 0;
+  capdu_chaining.in_chaining = 0;
+  rapdu_chaining.rapdu.len = 0;
+  rapdu_chaining.sent = 0;
+}
+
 int acquire_global_buffer(uint8_t owner) {
   device_atomic_compare_and_swap(&buffer_owner, BUFFER_OWNER_NONE, owner);
   return buffer_owner == owner ? 0 : -1;
@@ -2,24 +2,57 @@
 #include <admin.h>
 #include <applets.h>
 #include <ctap.h>
+#include <meta.h>
 #include <ndef.h>
 #include <oath.h>
 #include <openpgp.h>
 #include <piv.h>
+#include <string.h>
+
+static const uint8_t PIV_AID[] = {0xA0, 0x00, 0x00, 0x03, 0x08};
+static const uint8_t OATH_AID[] = {0xA0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
+static const uint8_t ADMIN_AID[] = {0xF0, 0x00, 0x00, 0x00, 0x00};
+static const uint8_t OPENPGP_AID[] = {0xD2, 0x76, 0x00, 0x01, 0x24, 0x01};
+static const uint8_t FIDO_AID[] = {0xA0, 0x00, 0x00, 0x06, 0x47, 0x2F, 0x00, 0x01};
+static const uint8_t NDEF_AID[] = {0xD2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01};
+static const uint8_t META_AID[] = {0xA0, 0x00, 0x00, 0x05, 0x27, 0x47, 0x11, 0x17};
+
+static int fido_install(uint8_t reset) { return ctap_install(reset); }
+
+// in the order of installation
+const applet_t applets[APPLET_ENUM_END] = {
+    [APPLET_OPENPGP] = {OPENPGP_AID, sizeof(OPENPGP_AID), APPLET_RESPONSE_CHAINING, openpgp_process_apdu,
+                        openpgp_install, openpgp_poweroff, .deselect = openpgp_deselect},
+    [APPLET_PIV] = {PIV_AID, sizeof(PIV_AID), APPLET_RESPONSE_CHAINING, piv_process_apdu, piv_install, piv_poweroff},
+    // OATH fills the whole chaining buffer at once, so that the codes are computed in as few passes as possible
+    [APPLET_OATH] = {OATH_AID, sizeof(OATH_AID), APPLET_RESPONSE_FILL, oath_process_apdu, oath_install, oath_poweroff,
+                     .deselect = oath_deselect},
+    // the caches of CTAP are shared with CTAPHID, so they outlive the power cycles of the smart card
+    [APPLET_FIDO] = {FIDO_AID, sizeof(FIDO_AID), APPLET_RESPONSE_CHAINING, ctap_process_apdu, fido_install},
+    [APPLET_ADMIN] = {ADMIN_AID, sizeof(ADMIN_AID), APPLET_RESPONSE_DIRECT, admin_process_apdu, admin_install,
+                      admin_poweroff},
+    [APPLET_NDEF] = {NDEF_AID, sizeof(NDEF_AID), APPLET_RESPONSE_DIRECT, ndef_process_apdu, ndef_install,
+                     ndef_poweroff, cfg_is_ndef_enable},
+    [APPLET_META] = {META_AID, sizeof(META_AID), APPLET_RESPONSE_DIRECT, meta_process_apdu},
+};
+
+const applet_t *applet_find(const uint8_t *aid, uint16_t len) {
+  if (len == 0) return NULL;
+  for (uint8_t i = APPLET_NULL + 1; i != APPLET_ENUM_END; ++i) {
+    const applet_t *applet = &applets[i];
+    // the first byte tells most AIDs apart before any memcmp
+    if (applet->aid[0] != aid[0] || len < applet->aid_len) continue;
+    if (memcmp(aid, applet->aid, applet->aid_len) == 0) return applet;
+  }
+  return NULL;
+}
 
 void applets_install(void) {
-  openpgp_install(0);
-  piv_install(0);
-  oath_install(0);
-  ctap_install(0);
-  admin_install(0);
-  ndef_install(0);
+  for (uint8_t i = APPLET_NULL + 1; i != APPLET_ENUM_END; ++i)
+    if (applets[i].install) applets[i].install(0);
 }
 
 void applets_poweroff(void) {
-  piv_poweroff();
-  oath_poweroff();
-  admin_poweroff();
-  openpgp_poweroff();
-  ndef_poweroff();
+  for (uint8_t i = APPLET_NULL + 1; i != APPLET_ENUM_END; ++i)
+    if (applets[i].poweroff) applets[i].poweroff();
 }
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <common.h>
+#include <counter.h>
+#include <fs.h>
+#include <memzero.h>
+#include <string.h>
+
+#ifndef COUNTER_SET_SLOTS
+#define COUNTER_SET_SLOTS 64
+#endif
+
+#ifndef COUNTER_SET_CACHE_NUM
+#define COUNTER_SET_CACHE_NUM 4
+#endif
+
+// slots read from the set file at once
+#define COUNTER_SET_CHUNK 8
+#define FLOOR_ATTR 0
+
+typedef struct {
+  uint8_t key[COUNTER_KEY_SIZE];
+  uint32_t ceiling;
+} __packed counter_slot_t;
+
+// the reserved ranges of the recently used keys
+typedef struct {
+  const char *path; // NULL if the entry is unused
+  uint8_t key[COUNTER_KEY_SIZE];
+  uint16_t slot;
+  uint32_t value;
+  uint32_t ceiling;
+  uint32_t last_used;
+} counter_set_cache_t;
+
+static counter_set_cache_t set_cache[COUNTER_SET_CACHE_NUM];
+static uint32_t set_cache_clock;
+
+static uint32_t next_ceiling(uint32_t value, uint16_t reserve) {
+  if (reserve == 0) reserve = 1;
+  return value > UINT32_MAX - reserve ? UINT32_MAX : value + reserve;
+}
+
+static int counter_load(counter_t *ctr) {
+  if (ctr->loaded) return 0;
+  uint32_t ceiling;
+  int size = read_attr(ctr->path, ctr->attr, &ceiling, sizeof(ceiling));
+  if (size != sizeof(ceiling)) return COUNTER_IO_FAIL;
+  // values up to the ceiling may have been handed out before a power loss
+  ctr->value = ctr->ceiling = ceiling;
+  ctr->loaded = 1;
+  return 0;
+}
+
+int counter_reset(counter_t *ctr, uint32_t value) {
+  ctr->loaded = 0;
+  if (write_attr(ctr->path, ctr->attr, &value, sizeof(value)) < 0) return COUNTER_IO_FAIL;
+  ctr->value = ctr->ceiling = value;
+  ctr->loaded = 1;
+  return 0;
+}
+
+int counter_read(counter_t *ctr, uint32_t *value) {
+  if (counter_load(ctr) < 0) return COUNTER_IO_FAIL;
+  *value = ctr->value;
+  return 0;
+}
+
+int counter_increase(counter_t *ctr, uint32_t *value) {
+  if (counter_load(ctr) < 0) return COUNTER_IO_FAIL;
+  if (ctr->value == UINT32_MAX) return COUNTER_EXHAUSTED;
+  if (ctr->value == ctr->ceiling) {
+    // the range is committed before any value of it is handed out
+    uint32_t ceiling = next_ceiling(ctr->value, ctr->reserve);
+    if (write_attr(ctr->path, ctr->attr, &ceiling, sizeof(ceiling)) < 0) {
+      ctr->loaded = 0;
+      return COUNTER_IO_FAIL;
+    }
+    ctr->ceiling = ceiling;
+  }
+  *value = ++ctr->value;
+  return 0;
+}
+
+void counter_unload(counter_t *ctr) { ctr->loaded = 0; }
+
+static counter_set_cache_t *set_cache_get(const char *path, const uint8_t *key) {
+  counter_set_cache_t *victim = &set_cache[0];
+  for (int i = 0; i < COUNTER_SET_CACHE_NUM; ++i) {
+    if (set_cache[i].path != NULL && strcmp(set_cache[i].path, path) == 0 &&
+        memcmp(set_cache[i].key, key, COUNTER_KEY_SIZE) == 0)
+      return &set_cache[i];
+    if (set_cache[i].path == NULL)
+      victim = &set_cache[i];
+    else if (victim->path != NULL && set_cache[i].last_used < victim->last_used)
+      victim = &set_cache[i];
+  }
+  // the unused part of the range of the victim is given up
+  memzero(victim, sizeof(counter_set_cache_t));
+  return victim;
+}
+
+static void set_cache_drop(const char *path, int slot) {
+  for (int i = 0; i < COUNTER_SET_CACHE_NUM; ++i)
+    if (set_cache[i].path != NULL && strcmp(set_cache[i].path, path) == 0 && (slot < 0 || set_cache[i].slot == slot))
+      memzero(&set_cache[i], sizeof(counter_set_cache_t));
+}
+
+// Look the key up in the file, or pick a slot for it starting from the floor.
+static int set_load(const char *path, const uint8_t *key, counter_set_cache_t *entry) {
+  counter_slot_t slots[COUNTER_SET_CHUNK];
+  uint32_t floor = 0, victim_ceiling = 0;
+  int n = 0, victim = -1;
+
+  while (n < COUNTER_SET_SLOTS) {
+    int size = read_file(path, slots, n * sizeof(counter_slot_t), sizeof(slots));
+    if (size == LFS_ERR_NOENT) break;
+    if (size < 0) return COUNTER_IO_FAIL;
+    int count = size / sizeof(counter_slot_t);
+    for (int i = 0; i < count && n < COUNTER_SET_SLOTS; ++i, ++n) {
+      if (memcmp(slots[i].key, key, COUNTER_KEY_SIZE) == 0) {
+        entry->slot = n;
+        entry->value = entry->ceiling = slots[i].ceiling;
+        return 0;
+      }
+      if (victim < 0 || slots[i].ceiling < victim_ceiling) {
+        victim = n;
+        victim_ceiling = slots[i].ceiling;
+      }
+    }
+    if (count < COUNTER_SET_CHUNK) break;
+  }
+
+  int err = read_attr(path, FLOOR_ATTR, &floor, sizeof(floor));
+  if (err < 0 && err != LFS_ERR_NOATTR && err != LFS_ERR_NOENT) return COUNTER_IO_FAIL;
+  if (n == COUNTER_SET_SLOTS) {
+    // every value the victim has handed out is now below the floor
+    if (victim_ceiling > floor) {
+      floor = victim_ceiling;
+      if (write_attr(path, FLOOR_ATTR, &floor, sizeof(floor)) < 0) return COUNTER_IO_FAIL;
+    }
+    set_cache_drop(path, victim);
+    n = victim;
+  }
+  // the slot is written along with the first reservation
+  entry->slot = n;
+  entry->value = entry->ceiling = floor;
+  return 0;
+}
+
+int counter_set_increase(const char *path, const uint8_t *key, uint16_t reserve, uint32_t *value) {
+  counter_set_cache_t *entry = set_cache_get(path, key);
+  if (entry->path == NULL) {
+    if (set_load(path, key, entry) < 0) return COUNTER_IO_FAIL;
+    entry->path = path;
+    memcpy(entry->key, key, COUNTER_KEY_SIZE);
+  }
+  entry->last_used = ++set_cache_clock;
+  if (entry->value == UINT32_MAX) return COUNTER_EXHAUSTED;
+  if (entry->value == entry->ceiling) {
+    counter_slot_t slot;
+    memcpy(slot.key, key, COUNTER_KEY_SIZE);
+    slot.ceiling = next_ceiling(entry->value, reserve);
+    if (write_file(path, &slot, entry->slot * sizeof(slot), sizeof(slot), 0) < 0) {
+      memzero(entry, sizeof(counter_set_cache_t));
+      return COUNTER_IO_FAIL;
+    }
+    entry->ceiling = slot.ceiling;
+  }
+  *value = ++entry->value;
+  return 0;
+}
+
+int counter_set_reset(const char *path, uint32_t floor) {
+  set_cache_drop(path, -1);
+  if (write_file(path, NULL, 0, 0, 1) < 0) return COUNTER_IO_FAIL;
+  // written last, it marks the set as created
+  if (write_attr(path, FLOOR_ATTR, &floor, sizeof(floor)) < 0) return COUNTER_IO_FAIL;
+  return 0;
+}
+
+int counter_set_init(const char *path, uint32_t floor) {
+  uint32_t stored;
+  int err = read_attr(path, FLOOR_ATTR, &stored, sizeof(stored));
+  if (err == sizeof(stored)) return 0;
+  if (err >= 0 || err == LFS_ERR_NOATTR || err == LFS_ERR_NOENT) return counter_set_reset(path, floor);
+  return COUNTER_IO_FAIL;
+}
@@ -2,6 +2,7 @@
 #include "common.h"
 #include <admin.h>
 #include <ccid.h>
+#include <ctap.h>
 #include <ctaphid.h>
 #include <device.h>
 #include <kbdhid.h>
@@ -25,6 +26,8 @@ void device_loop(uint8_t has_touch) {
       cfg_is_kbd_interface_enable() // keyboard emulation enabled
   )
     KBDHID_Loop();
+  // one step of precomputation at a time, so that a new CTAPHID message waits for one key pair at most
+  if (CTAPHID_IsIdle()) ctap_precompute();
 }
 
 uint8_t get_touch_result(void) {
@@ -1,16 +1,181 @@
 // SPDX-License-Identifier: Apache-2.0
+#include <common.h>
 #include <fs.h>
+#include <memzero.h>
+#include <string.h>
+
+#ifndef FS_FILE_CACHE_NUM
+#define FS_FILE_CACHE_NUM 3
+#endif
+
+#ifndef FS_FILE_CACHE_BUFFER_SIZE
+#define FS_FILE_CACHE_BUFFER_SIZE 512
+#endif
+
+#ifndef FS_ATTR_CACHE_NUM
+#define FS_ATTR_CACHE_NUM 16
+#endif
+
+#ifndef FS_ATTR_CACHE_DATA_LEN
+#define FS_ATTR_CACHE_DATA_LEN 32
+#endif
+
+#define FS_FILE_CACHE_PATH_LEN 16
+
+typedef struct {
+  lfs_file_t file;
+  struct lfs_file_config cfg;
+  char path[FS_FILE_CACHE_PATH_LEN];
+  uint32_t last_used;
+  uint8_t in_use;
+} fs_file_cache_t;
+
+typedef struct {
+  char path[FS_FILE_CACHE_PATH_LEN];
+  uint8_t attr;
+  uint8_t in_use;
+  int16_t size; // the stored size of the attribute, or LFS_ERR_NOATTR
+  uint32_t last_used;
+  uint8_t data[FS_ATTR_CACHE_DATA_LEN];
+} fs_attr_cache_t;
 
 static lfs_t lfs;
+static fs_file_cache_t file_cache[FS_FILE_CACHE_NUM];
+static uint8_t file_cache_buffer[FS_FILE_CACHE_NUM][FS_FILE_CACHE_BUFFER_SIZE];
+static fs_attr_cache_t attr_cache[FS_ATTR_CACHE_NUM];
+static uint32_t file_cache_clock, attr_cache_clock;
+static uint8_t file_cache_enabled = 1;
+static fs_cache_stats_t cache_stats;
+
+static void file_cache_evict(fs_file_cache_t *entry) {
+  if (!entry->in_use) return;
+  lfs_file_close(&lfs, &entry->file);
+  memzero(file_cache_buffer[entry - file_cache], FS_FILE_CACHE_BUFFER_SIZE);
+  memzero(entry, sizeof(fs_file_cache_t));
+}
+
+static void file_cache_evict_path(const char *path) {
+  for (int i = 0; i < FS_FILE_CACHE_NUM; ++i)
+    if (file_cache[i].in_use && strcmp(file_cache[i].path, path) == 0) file_cache_evict(&file_cache[i]);
+}
+
+// Return an open handle of the path from the pool, opening it (and evicting the LRU entry) on a miss.
+// NULL means the path can not be cached, and the caller should fall back to a one-shot open.
+static lfs_file_t *file_cache_get(const char *path, int flags, int *err) {
+  fs_file_cache_t *victim = &file_cache[0];
+
+  *err = 0;
+  if (!file_cache_enabled || strlen(path) >= FS_FILE_CACHE_PATH_LEN) return NULL;
+  for (int i = 0; i < FS_FILE_CACHE_NUM; ++i) {
+    if (file_cache[i].in_use && strcmp(file_cache[i].path, path) == 0) {
+      file_cache[i].last_used = ++file_cache_clock;
+      ++cache_stats.handle_hits;
+      return &file_cache[i].file;
+    }
+    if (!file_cache[i].in_use)
+      victim = &file_cache[i];
+    else if (victim->in_use && file_cache[i].last_used < victim->last_used)
+      victim = &file_cache[i];
+  }
+
+  ++cache_stats.handle_misses;
+  file_cache_evict(victim);
+  // littlefs keeps a reference to the config until the file is closed
+  if (lfs.cfg->cache_size <= FS_FILE_CACHE_BUFFER_SIZE) victim->cfg.buffer = file_cache_buffer[victim - file_cache];
+  *err = lfs_file_opencfg(&lfs, &victim->file, path, flags, &victim->cfg);
+  if (*err < 0) return NULL;
+  strcpy(victim->path, path);
+  victim->last_used = ++file_cache_clock;
+  victim->in_use = 1;
+  return &victim->file;
+}
+
+static fs_attr_cache_t *attr_cache_find(const char *path, uint8_t attr) {
+  for (int i = 0; i < FS_ATTR_CACHE_NUM; ++i)
+    if (attr_cache[i].in_use && attr_cache[i].attr == attr && strcmp(attr_cache[i].path, path) == 0)
+      return &attr_cache[i];
+  return NULL;
+}
 
-int fs_format(const struct lfs_config *cfg) { return lfs_format(&lfs, cfg); }
+static void attr_cache_invalidate(const char *path, uint8_t attr) {
+  fs_attr_cache_t *entry = attr_cache_find(path, attr);
+  if (entry != NULL) memzero(entry, sizeof(fs_attr_cache_t));
+}
 
-int fs_mount(const struct lfs_config *cfg) { return lfs_mount(&lfs, cfg); }
+static void attr_cache_evict_path(const char *path) {
+  for (int i = 0; i < FS_ATTR_CACHE_NUM; ++i)
+    if (attr_cache[i].in_use && strcmp(attr_cache[i].path, path) == 0)
+      memzero(&attr_cache[i], sizeof(fs_attr_cache_t));
+}
+
+// Store the value of an attribute, size being the stored size or LFS_ERR_NOATTR.
+// Values that do not fit into an entry just invalidate the stale one.
+static void attr_cache_put(const char *path, uint8_t attr, const void *buf, int size) {
+  if (!file_cache_enabled || strlen(path) >= FS_FILE_CACHE_PATH_LEN || size > FS_ATTR_CACHE_DATA_LEN) {
+    attr_cache_invalidate(path, attr);
+    return;
+  }
+  fs_attr_cache_t *entry = attr_cache_find(path, attr);
+  if (entry == NULL) {
+    entry = &attr_cache[0];
+    for (int i = 0; i < FS_ATTR_CACHE_NUM; ++i) {
+      if (!attr_cache[i].in_use) {
+        entry = &attr_cache[i];
+        break;
+      }
+      if (attr_cache[i].last_used < entry->last_used) entry = &attr_cache[i];
+    }
+    memzero(entry, sizeof(fs_attr_cache_t));
+    strcpy(entry->path, path);
+    entry->attr = attr;
+    entry->in_use = 1;
+  }
+  entry->size = (int16_t)size;
+  if (size > 0) memcpy(entry->data, buf, size);
+  entry->last_used = ++attr_cache_clock;
+}
+
+void fs_drop_caches(void) {
+  for (int i = 0; i < FS_FILE_CACHE_NUM; ++i)
+    file_cache_evict(&file_cache[i]);
+  memzero(attr_cache, sizeof(attr_cache));
+}
+
+void fs_set_cache_enabled(uint8_t enabled) {
+  if (!enabled) fs_drop_caches();
+  file_cache_enabled = enabled;
+}
+
+void fs_get_cache_stats(fs_cache_stats_t *stats) { memcpy(stats, &cache_stats, sizeof(cache_stats)); }
+
+void fs_reset_cache_stats(void) { memzero(&cache_stats, sizeof(cache_stats)); }
+
+int fs_format(const struct lfs_config *cfg) {
+  fs_drop_caches();
+  return lfs_format(&lfs, cfg);
+}
+
+int fs_mount(const struct lfs_config *cfg) {
+  fs_drop_caches();
+  return lfs_mount(&lfs, cfg);
+}
 
 int read_file(const char *path, void *buf, lfs_soff_t off, lfs_size_t len) {
-  lfs_file_t f;
+  lfs_file_t f, *fp;
   lfs_ssize_t read_length;
-  int err = lfs_file_open(&lfs, &f, path, LFS_O_RDONLY);
+  int err;
+  fp = file_cache_get(path, LFS_O_RDWR, &err);
+  if (fp != NULL) {
+    err = lfs_file_seek(&lfs, fp, off, LFS_SEEK_SET);
+    if (err >= 0) err = read_length = lfs_file_read(&lfs, fp, buf, len);
+    if (err < 0) {
+      file_cache_evict_path(path);
+      return err;
+    }
+    return read_length;
+  }
+  if (err < 0) return err;
+  err = lfs_file_open(&lfs, &f, path, LFS_O_RDONLY);
   if (err < 0) return err;
   err = lfs_file_seek(&lfs, &f, off, LFS_SEEK_SET);
   if (err < 0) goto err_close;
@@ -28,10 +193,29 @@ err_close:
 }
 
 int write_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len, uint8_t trunc) {
-  lfs_file_t f;
+  lfs_file_t f, *fp;
   int flags = LFS_O_WRONLY | LFS_O_CREAT;
-  if (trunc) flags |= LFS_O_TRUNC;
-  int err = lfs_file_open(&lfs, &f, path, flags);
+  int err;
+  if (trunc) {
+    // the file is recreated, do not let a cached handle write back the stale content
+    file_cache_evict_path(path);
+    attr_cache_evict_path(path);
+    flags |= LFS_O_TRUNC;
+  } else {
+    fp = file_cache_get(path, LFS_O_RDWR | LFS_O_CREAT, &err);
+    if (fp != NULL) {
+      err = lfs_file_seek(&lfs, fp, off, LFS_SEEK_SET);
+      if (err >= 0 && len > 0) err = lfs_file_write(&lfs, fp, buf, len);
+      if (err >= 0) err = lfs_file_sync(&lfs, fp);
+      if (err < 0) {
+        file_cache_evict_path(path);
+        return err;
+      }
+      return 0;
+    }
+    if (err < 0) return err;
+  }
+  err = lfs_file_open(&lfs, &f, path, flags);
   if (err < 0) return err;
   err = lfs_file_seek(&lfs, &f, off, LFS_SEEK_SET);
   if (err < 0) goto err_close;
@@ -50,6 +234,7 @@ err_close:
 int truncate_file(const char *path, lfs_size_t len) {
   lfs_file_t f;
   int flags = LFS_O_WRONLY | LFS_O_CREAT;
+  file_cache_evict_path(path);
   int err = lfs_file_open(&lfs, &f, path, flags);
   if (err < 0) return err;
   err = lfs_file_truncate(&lfs, &f, len);
@@ -62,17 +247,122 @@ err_close:
   return err;
 }
 
+int insert_file(const char *path, const void *buf, lfs_soff_t off, lfs_size_t len) {
+  lfs_file_t f, *fp;
+  uint8_t chunk[64];
+  int err;
+  fp = file_cache_get(path, LFS_O_RDWR | LFS_O_CREAT, &err);
+  if (fp == NULL) {
+    if (err < 0) return err;
+    err = lfs_file_open(&lfs, &f, path, LFS_O_RDWR | LFS_O_CREAT);
+    if (err < 0) return err;
+    fp = &f;
+  }
+  lfs_soff_t pos = lfs_file_size(&lfs, fp);
+  if (pos < 0) err = pos;
+  if (err >= 0 && off > pos) err = LFS_ERR_INVAL;
+  // move the tail backwards chunk by chunk, nothing reaches flash metadata before the final sync
+  while (err >= 0 && pos > off) {
+    lfs_size_t n = MIN(sizeof(chunk), (lfs_size_t)(pos - off));
+    pos -= n;
+    err = lfs_file_seek(&lfs, fp, pos, LFS_SEEK_SET);
+    if (err >= 0) err = lfs_file_read(&lfs, fp, chunk, n);
+    if (err >= 0) err = lfs_file_seek(&lfs, fp, pos + len, LFS_SEEK_SET);
+    if (err >= 0) err = lfs_file_write(&lfs, fp, chunk, n);
+  }
+  if (err >= 0) err = lfs_file_seek(&lfs, fp, off, LFS_SEEK_SET);
+  if (err >= 0) err = lfs_file_write(&lfs, fp, buf, len);
+  if (fp == &f) {
+    int close_err = lfs_file_close(&lfs, &f);
+    return err < 0 ? err : close_err;
+  }
+  if (err >= 0) err = lfs_file_sync(&lfs, fp);
+  if (err < 0) {
+    file_cache_evict_path(path);
+    return err;
+  }
+  return 0;
+}
+
+int create_file(lfs_file_t *f, const char *path) {
+  // the file is recreated, do not let a cached handle write back the stale content
+  file_cache_evict_path(path);
+  attr_cache_evict_path(path);
+  return lfs_file_open(&lfs, f, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+}
+
+int append_file(lfs_file_t *f, const void *buf, lfs_size_t len) {
+  lfs_ssize_t written = lfs_file_write(&lfs, f, buf, len);
+  return written < 0 ? (int)written : 0;
+}
+
+int close_file(lfs_file_t *f) { return lfs_file_close(&lfs, f); }
+
+int remove_file(const char *path) {
+  file_cache_evict_path(path);
+  attr_cache_evict_path(path);
+  return lfs_remove(&lfs, path);
+}
+
+int rename_file(const char *old_path, const char *new_path) {
+  file_cache_evict_path(old_path);
+  attr_cache_evict_path(old_path);
+  file_cache_evict_path(new_path);
+  attr_cache_evict_path(new_path);
+  return lfs_rename(&lfs, old_path, new_path);
+}
+
 int read_attr(const char *path, uint8_t attr, void *buf, lfs_size_t len) {
-  return lfs_getattr(&lfs, path, attr, buf, len);
+  fs_attr_cache_t *entry = file_cache_enabled ? attr_cache_find(path, attr) : NULL;
+  if (entry != NULL) {
+    ++cache_stats.attr_hits;
+    entry->last_used = ++attr_cache_clock;
+    if (entry->size > 0) memcpy(buf, entry->data, MIN(len, (lfs_size_t)entry->size));
+    return entry->size;
+  }
+  ++cache_stats.attr_misses;
+  int size = lfs_getattr(&lfs, path, attr, buf, len);
+  // only cache what has been read completely
+  if (size == LFS_ERR_NOATTR || (size >= 0 && (lfs_size_t)size <= len)) attr_cache_put(path, attr, buf, size);
+  return size;
 }
 
 int write_attr(const char *path, uint8_t attr, const void *buf, lfs_size_t len) {
-  return lfs_setattr(&lfs, path, attr, buf, len);
+  int err = lfs_setattr(&lfs, path, attr, buf, len);
+  if (err < 0)
+    attr_cache_invalidate(path, attr);
+  else
+    attr_cache_put(path, attr, buf, (int)len);
+  return err;
 }
 
-int get_file_size(const char *path) {
+int write_attrs(const char *path, const struct lfs_attr *attrs, lfs_size_t count) {
   lfs_file_t f;
-  int err = lfs_file_open(&lfs, &f, path, LFS_O_RDONLY);
+  // attributes given to a writable file are committed together with it when the file is closed,
+  // littlefs only reads them on open if the file is readable
+  struct lfs_file_config file_cfg = {.attrs = (struct lfs_attr *)attrs, .attr_count = count};
+  int err = lfs_file_opencfg(&lfs, &f, path, LFS_O_WRONLY, &file_cfg);
+  if (err >= 0) err = lfs_file_close(&lfs, &f);
+  for (lfs_size_t i = 0; i < count; ++i) {
+    if (err < 0)
+      attr_cache_invalidate(path, attrs[i].type);
+    else
+      attr_cache_put(path, attrs[i].type, attrs[i].buffer, (int)attrs[i].size);
+  }
+  return err;
+}
+
+int get_file_size(const char *path) {
+  lfs_file_t f, *fp;
+  int err;
+  fp = file_cache_get(path, LFS_O_RDWR, &err);
+  if (fp != NULL) {
+    int size = lfs_file_size(&lfs, fp);
+    if (size < 0) file_cache_evict_path(path);
+    return size;
+  }
+  if (err < 0) return err;
+  err = lfs_file_open(&lfs, &f, path, LFS_O_RDONLY);
   if (err < 0) return err;
   int size = lfs_file_size(&lfs, &f);
   if (size < 0) {
@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <common.h>
+#include <hmac-ctx.h>
+#include <memzero.h>
+#include <string.h>
+
+#define HMAC_IPAD 0x36
+#define HMAC_OPAD 0x5C
+
+// keys longer than a block are hashed first, as defined by RFC 2104
+static void prepare_pads(const uint8_t *key, size_t key_len, uint8_t *ipad, uint8_t *opad, size_t block_size,
+                         void (*hash)(const uint8_t *, size_t, uint8_t *)) {
+  memset(ipad, 0, block_size);
+  if (key_len > block_size) {
+    hash(key, key_len, ipad);
+  } else {
+    memcpy(ipad, key, key_len);
+  }
+  for (size_t i = 0; i < block_size; ++i) {
+    opad[i] = ipad[i] ^ HMAC_OPAD;
+    ipad[i] ^= HMAC_IPAD;
+  }
+}
+
+void hmac_sha1_ctx_init(hmac_sha1_ctx_t *ctx, const uint8_t *key, size_t key_len) {
+  prepare_pads(key, key_len, ctx->ipad, ctx->opad, SHA1_BLOCK_SIZE, sha1_raw);
+}
+
+void hmac_sha1_ctx_compute(const hmac_sha1_ctx_t *ctx, const uint8_t *msg, size_t msg_len, uint8_t *hmac) {
+  uint8_t inner[SHA1_DIGEST_LENGTH];
+  sha1_init();
+  sha1_update(ctx->ipad, sizeof(ctx->ipad));
+  sha1_update(msg, msg_len);
+  sha1_final(inner);
+  sha1_init();
+  sha1_update(ctx->opad, sizeof(ctx->opad));
+  sha1_update(inner, sizeof(inner));
+  sha1_final(hmac);
+  memzero(inner, sizeof(inner));
+}
+
+void hmac_sha1_ctx_clear(hmac_sha1_ctx_t *ctx) { memzero(ctx, sizeof(*ctx)); }
+
+void hmac_sha256_ctx_init(hmac_sha256_ctx_t *ctx, const uint8_t *key, size_t key_len) {
+  prepare_pads(key, key_len, ctx->ipad, ctx->opad, SHA256_BLOCK_SIZE, sha256_raw);
+}
+
+void hmac_sha256_ctx_compute(const hmac_sha256_ctx_t *ctx, const uint8_t *msg, size_t msg_len, uint8_t *hmac) {
+  uint8_t inner[SHA256_DIGEST_LENGTH];
+  sha256_init();
+  sha256_update(ctx->ipad, sizeof(ctx->ipad));
+  sha256_update(msg, msg_len);
+  sha256_final(inner);
+  sha256_init();
+  sha256_update(ctx->opad, sizeof(ctx->opad));
+  sha256_update(inner, sizeof(inner));
+  sha256_final(hmac);
+  memzero(inner, sizeof(inner));
+}
+
+void hmac_sha256_ctx_clear(hmac_sha256_ctx_t *ctx) { memzero(ctx, sizeof(*ctx)); }
+
+void hmac_sha512_ctx_init(hmac_sha512_ctx_t *ctx, const uint8_t *key, size_t key_len) {
+  prepare_pads(key, key_len, ctx->ipad, ctx->opad, SHA512_BLOCK_SIZE, sha512_raw);
+}
+
+void hmac_sha512_ctx_compute(const hmac_sha512_ctx_t *ctx, const uint8_t *msg, size_t msg_len, uint8_t *hmac) {
+  uint8_t inner[SHA512_DIGEST_LENGTH];
+  sha512_init();
+  sha512_update(ctx->ipad, sizeof(ctx->ipad));
+  sha512_update(msg, msg_len);
+  sha512_final(inner);
+  sha512_init();
+  sha512_update(ctx->opad, sizeof(ctx->opad));
+  sha512_update(inner, sizeof(inner));
+  sha512_final(hmac);
+  memzero(inner, sizeof(inner));
+}
+
+void hmac_sha512_ctx_clear(hmac_sha512_ctx_t *ctx) { memzero(ctx, sizeof(*ctx)); }
+
+__weak void hmac_sha1_batch(const hmac_sha1_ctx_t *ctxs, size_t n, const uint8_t *msg, size_t msg_len,
+                            uint8_t *hmacs) {
+  for (size_t i = 0; i < n; ++i)
+    hmac_sha1_ctx_compute(&ctxs[i], msg, msg_len, hmacs + i * SHA1_DIGEST_LENGTH);
+}
+
+__weak void hmac_sha256_batch(const hmac_sha256_ctx_t *ctxs, size_t n, const uint8_t *msg, size_t msg_len,
+                              uint8_t *hmacs) {
+  for (size_t i = 0; i < n; ++i)
+    hmac_sha256_ctx_compute(&ctxs[i], msg, msg_len, hmacs + i * SHA256_DIGEST_LENGTH);
+}
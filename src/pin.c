@@ -8,12 +8,23 @@
 #define RETRY_ATTR 0
 #define DEFAULT_RETRY_ATTR 1
 
+// Reset the retry counter to its default value, skipping the metadata commit if it is already there.
+static int pin_reset_retries(const pin_t *pin, uint8_t current) {
+  uint8_t ctr;
+  int err = read_attr(pin->path, DEFAULT_RETRY_ATTR, &ctr, sizeof(ctr));
+  if (err < 0) return PIN_IO_FAIL;
+  if (ctr == current) return 0;
+  err = write_attr(pin->path, RETRY_ATTR, &ctr, sizeof(ctr));
+  if (err < 0) return PIN_IO_FAIL;
+  return 0;
+}
+
 int pin_create(const pin_t *pin, const void *buf, uint8_t len, uint8_t max_retries) {
   int err = write_file(pin->path, buf, 0, len, 1);
   if (err < 0) return PIN_IO_FAIL;
-  err = write_attr(pin->path, RETRY_ATTR, &max_retries, sizeof(max_retries));
-  if (err < 0) return PIN_IO_FAIL;
-  err = write_attr(pin->path, DEFAULT_RETRY_ATTR, &max_retries, sizeof(max_retries));
+  struct lfs_attr attrs[] = {{RETRY_ATTR, &max_retries, sizeof(max_retries)},
+                             {DEFAULT_RETRY_ATTR, &max_retries, sizeof(max_retries)}};
+  err = write_attrs(pin->path, attrs, 2);
   if (err < 0) return PIN_IO_FAIL;
   return 0;
 }
@@ -43,31 +54,19 @@ int pin_verify(pin_t *pin, const void *buf, uint8_t len, uint8_t *retries) {
 #endif
   }
   pin->is_validated = 1;
-  err = read_attr(pin->path, DEFAULT_RETRY_ATTR, &ctr, sizeof(ctr));
-  if (err < 0) {
-    memzero(pin_buf, sizeof(pin_buf));
-    return PIN_IO_FAIL;
-  }
-  err = write_attr(pin->path, RETRY_ATTR, &ctr, sizeof(ctr));
-  if (err < 0) {
-    memzero(pin_buf, sizeof(pin_buf));
-    return PIN_IO_FAIL;
-  }
   memzero(pin_buf, sizeof(pin_buf));
-  return 0;
+  return pin_reset_retries(pin, ctr);
 }
 
 int pin_update(pin_t *pin, const void *buf, uint8_t len) {
   if (len < pin->min_length || len > pin->max_length) return PIN_LENGTH_INVALID;
   pin->is_validated = 0;
-  int err = write_file(pin->path, buf, 0, len, 1);
-  if (err < 0) return PIN_IO_FAIL;
   uint8_t ctr;
-  err = read_attr(pin->path, DEFAULT_RETRY_ATTR, &ctr, sizeof(ctr));
+  int err = read_attr(pin->path, RETRY_ATTR, &ctr, sizeof(ctr));
   if (err < 0) return PIN_IO_FAIL;
-  err = write_attr(pin->path, RETRY_ATTR, &ctr, sizeof(ctr));
+  err = write_file(pin->path, buf, 0, len, 1);
   if (err < 0) return PIN_IO_FAIL;
-  return 0;
+  return pin_reset_retries(pin, ctr);
 }
 
 int pin_get_size(const pin_t *pin) { return get_file_size(pin->path); }
@@ -81,12 +80,10 @@ int pin_get_retries(const pin_t *pin) {
 }
 
 int pin_clear(const pin_t *pin) {
-  int err = write_file(pin->path, NULL, 0, 0, 1);
-  if (err < 0) return PIN_IO_FAIL;
   uint8_t ctr;
-  err = read_attr(pin->path, DEFAULT_RETRY_ATTR, &ctr, sizeof(ctr));
+  int err = read_attr(pin->path, RETRY_ATTR, &ctr, sizeof(ctr));
   if (err < 0) return PIN_IO_FAIL;
-  err = write_attr(pin->path, RETRY_ATTR, &ctr, sizeof(ctr));
+  err = write_file(pin->path, NULL, 0, 0, 1);
   if (err < 0) return PIN_IO_FAIL;
-  return 0;
+  return pin_reset_retries(pin, ctr);
 }
@@ -4,9 +4,19 @@
 #include <stddef.h>
 #include <cmocka.h>
 
+#include <admin.h>
 #include <apdu.h>
+#include <applets.h>
+#include <bd/lfs_filebd.h>
+#include <fs.h>
+#include <lfs.h>
+#include <openpgp.h>
+#include <piv.h>
 #include <string.h>
 
+#define TEST_COMMANDS 100
+#define TEST_LC 200
+
 static void test_input_chaining(void **state) {
   (void)state;
 
@@ -71,33 +81,288 @@ static void test_input_chaining(void **state) {
 static void test_output_chaining(void **state) {
   (void)state;
 
-  uint8_t r_buf[1024], total_buf[2048];
+  uint8_t r_buf[1024], total_buf[2048], expected[512];
   RAPDU R = {.data = r_buf, .len = 254};
   RAPDU_CHAINING RC = {.rapdu.data = total_buf, .rapdu.len = 512, .rapdu.sw = 0x9000, .sent = 0};
 
+  for (int i = 0; i < 512; ++i)
+    total_buf[i] = expected[i] = i * 7;
+
+  // every window is sent from where the applet wrote it
   int ret = apdu_output(&RC, &R);
   assert_int_equal(ret, 0);
+  assert_ptr_equal(R.data, total_buf);
   assert_int_equal(R.len, 254);
   assert_int_equal(R.sw, 0x61FF);
+  // as the transports do, put the status word right after the window
+  R.data[R.len] = HI(R.sw);
+  R.data[R.len + 1] = LO(R.sw);
 
+  R.len = 254;
   ret = apdu_output(&RC, &R);
   assert_int_equal(ret, 0);
+  assert_ptr_equal(R.data, total_buf + 254);
   assert_int_equal(R.len, 254);
   assert_int_equal(R.sw, 0x6104);
+  assert_memory_equal(R.data, expected + 254, R.len);
+  R.data[R.len] = HI(R.sw);
+  R.data[R.len + 1] = LO(R.sw);
 
+  R.len = 254;
   ret = apdu_output(&RC, &R);
   assert_int_equal(ret, 0);
+  assert_ptr_equal(R.data, total_buf + 508);
   assert_int_equal(R.len, 4);
   assert_int_equal(R.sw, 0x9000);
+  assert_memory_equal(R.data, expected + 508, R.len);
+}
+
+static void test_build_capdu(void **state) {
+  (void)state;
+
+  uint8_t cmd[9 + TEST_LC] = {0x00, 0xDA, 0x01, 0x02, TEST_LC};
+  CAPDU C;
+
+  // the data stays in the command buffer
+  assert_int_equal(build_capdu(&C, cmd, 5 + TEST_LC), 0);
+  assert_ptr_equal(C.data, cmd + 5);
+  assert_int_equal(C.lc, TEST_LC);
+  assert_int_equal(C.le, 0x100);
+  cmd[5 + TEST_LC] = 0x10;
+  assert_int_equal(build_capdu(&C, cmd, 6 + TEST_LC), 0);
+  assert_ptr_equal(C.data, cmd + 5);
+  assert_int_equal(C.le, 0x10);
+
+  cmd[4] = 0x00;
+  cmd[5] = 0x00;
+  cmd[6] = TEST_LC;
+  cmd[7 + TEST_LC] = 0x01;
+  cmd[8 + TEST_LC] = 0x00;
+  assert_int_equal(build_capdu(&C, cmd, 9 + TEST_LC), 0);
+  assert_ptr_equal(C.data, cmd + 7);
+  assert_int_equal(C.lc, TEST_LC);
+  assert_int_equal(C.le, 0x100);
+}
+
+static void test_process_copies(void **state) {
+  (void)state;
+
+  // no applet is selected, so every command ends at the dispatcher
+  uint8_t cmd[5 + TEST_LC] = {0x00, 0xDA, 0x01, 0x02, TEST_LC}, r_buf[64];
+  CAPDU C;
+  RAPDU R = {.data = r_buf};
+  uint32_t single, chained;
+
+  apdu_copied_bytes = 0;
+  for (int i = 0; i < TEST_COMMANDS; ++i) {
+    assert_int_equal(build_capdu(&C, cmd, sizeof(cmd)), 0);
+    process_apdu(&C, &R);
+    assert_int_equal(R.sw, SW_FILE_NOT_FOUND);
+  }
+  single = apdu_copied_bytes;
+
+  apdu_copied_bytes = 0;
+  for (int i = 0; i < TEST_COMMANDS; ++i) {
+    cmd[0] = 0x10;
+    assert_int_equal(build_capdu(&C, cmd, sizeof(cmd)), 0);
+    process_apdu(&C, &R);
+    assert_int_equal(R.sw, SW_NO_ERROR);
+    cmd[0] = 0x00;
+    assert_int_equal(build_capdu(&C, cmd, sizeof(cmd)), 0);
+    process_apdu(&C, &R);
+    assert_int_equal(R.sw, SW_FILE_NOT_FOUND);
+  }
+  chained = apdu_copied_bytes;
+
+  assert_int_equal(single, 0);
+  assert_int_equal(chained, TEST_COMMANDS * 2 * TEST_LC);
+}
+
+static void test_applet_find(void **state) {
+  (void)state;
+
+  uint8_t aid[32];
+
+  for (int i = APPLET_NULL + 1; i != APPLET_ENUM_END; ++i) {
+    // a SELECT may carry more than the AID
+    memcpy(aid, applets[i].aid, applets[i].aid_len);
+    memset(aid + applets[i].aid_len, 0xFF, sizeof(aid) - applets[i].aid_len);
+    assert_ptr_equal(applet_find(aid, applets[i].aid_len), &applets[i]);
+    assert_ptr_equal(applet_find(aid, sizeof(aid)), &applets[i]);
+    assert_null(applet_find(aid, applets[i].aid_len - 1));
+    aid[applets[i].aid_len - 1] ^= 0x80;
+    assert_null(applet_find(aid, sizeof(aid)));
+  }
+  assert_null(applet_find(aid, 0));
+}
+
+// send a short APDU through process_apdu, and return the status word
+static uint16_t send_apdu(uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, const void *data, uint8_t lc,
+                          uint8_t *resp) {
+  uint8_t cmd[6 + 255] = {cla, ins, p1, p2, lc}, r_buf[APDU_BUFFER_SIZE + 2];
+  CAPDU C;
+  RAPDU R = {.data = r_buf};
+
+  if (lc > 0) memcpy(cmd + 5, data, lc);
+  cmd[5 + lc] = 0x00;
+  assert_int_equal(build_capdu(&C, cmd, lc > 0 ? 6 + lc : 5), 0);
+  process_apdu(&C, &R);
+  if (resp != NULL) memcpy(resp, R.data, R.len);
+  return R.sw;
+}
+
+static void test_logical_channels(void **state) {
+  (void)state;
+
+  const uint8_t openpgp_aid[] = {0xD2, 0x76, 0x00, 0x01, 0x24, 0x01}, piv_aid[] = {0xA0, 0x00, 0x00, 0x03, 0x08};
+  const uint8_t piv_pin[] = {'1', '2', '3', '4', '5', '6', 0xFF, 0xFF};
+  uint8_t resp[APDU_BUFFER_SIZE];
+
+  openpgp_install(1);
+  piv_install(1);
+  // OpenPGP on the basic channel, PIV on a logical one
+  assert_int_equal(send_apdu(0x00, 0xA4, 0x04, 0x00, openpgp_aid, sizeof(openpgp_aid), NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x00, 0x20, 0x00, 0x81, "123456", 6, NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x00, 0x70, 0x00, 0x00, NULL, 0, resp), SW_NO_ERROR);
+  assert_int_equal(resp[0], 1);
+  assert_int_equal(send_apdu(0x01, 0xA4, 0x04, 0x00, piv_aid, sizeof(piv_aid), NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x01, 0x20, 0x00, 0x80, piv_pin, sizeof(piv_pin), NULL), SW_NO_ERROR);
+
+  // alternating between them needs neither SELECT nor VERIFY
+  for (int i = 0; i < 10; ++i) {
+    assert_int_equal(send_apdu(0x00, 0x20, 0x00, 0x81, NULL, 0, NULL), SW_NO_ERROR);
+    assert_int_equal(send_apdu(0x01, 0x20, 0x00, 0x80, NULL, 0, NULL), SW_NO_ERROR);
+  }
+
+  // a response is only handed out on its own channel
+  assert_int_equal(send_apdu(0x00, 0xC0, 0x00, 0x00, NULL, 0, NULL), SW_CONDITIONS_NOT_SATISFIED);
+
+  // an applet is not selected on two channels at once, not even through a channel opened from another
+  assert_int_equal(send_apdu(0x00, 0xA4, 0x04, 0x00, piv_aid, sizeof(piv_aid), NULL), SW_CONDITIONS_NOT_SATISFIED);
+  assert_int_equal(send_apdu(0x00, 0x20, 0x00, 0x81, NULL, 0, NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x01, 0xA4, 0x04, 0x00, piv_aid, sizeof(piv_aid), NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x01, 0x20, 0x00, 0x80, NULL, 0, NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x01, 0x70, 0x00, 0x02, NULL, 0, NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x02, 0x20, 0x00, 0x80, NULL, 0, NULL), SW_FILE_NOT_FOUND);
+  assert_int_equal(send_apdu(0x02, 0x70, 0x80, 0x00, NULL, 0, NULL), SW_NO_ERROR);
+
+  // closing
+  assert_int_equal(send_apdu(0x00, 0x70, 0x80, 0x00, NULL, 0, NULL), SW_WRONG_P1P2);
+  assert_int_equal(send_apdu(0x00, 0x70, 0x80, 0x01, NULL, 0, NULL), SW_NO_ERROR);
+
+  // OpenPGP loses its state once it is not selected on any channel
+  assert_int_equal(send_apdu(0x00, 0xA4, 0x04, 0x00, piv_aid, sizeof(piv_aid), NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x00, 0xA4, 0x04, 0x00, openpgp_aid, sizeof(openpgp_aid), NULL), SW_NO_ERROR);
+  assert_int_not_equal(send_apdu(0x00, 0x20, 0x00, 0x81, NULL, 0, NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x01, 0x20, 0x00, 0x80, NULL, 0, NULL), SW_LOGICAL_CHANNEL_NOT_SUPPORTED);
+  assert_int_equal(send_apdu(0x03, 0x20, 0x00, 0x80, NULL, 0, NULL), SW_LOGICAL_CHANNEL_NOT_SUPPORTED);
+  assert_int_equal(send_apdu(0x40, 0x20, 0x00, 0x80, NULL, 0, NULL), SW_LOGICAL_CHANNEL_NOT_SUPPORTED);
+
+  // a reset closes the logical channels and leaves nothing selected
+  assert_int_equal(send_apdu(0x00, 0x70, 0x00, 0x01, NULL, 0, NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x01, 0xA4, 0x04, 0x00, piv_aid, sizeof(piv_aid), NULL), SW_NO_ERROR);
+  apdu_reset();
+  assert_int_equal(send_apdu(0x01, 0x20, 0x00, 0x80, NULL, 0, NULL), SW_LOGICAL_CHANNEL_NOT_SUPPORTED);
+  assert_int_equal(send_apdu(0x00, 0x20, 0x00, 0x81, NULL, 0, NULL), SW_FILE_NOT_FOUND);
+}
+
+static void test_session_retention(void **state) {
+  (void)state;
+
+  const uint8_t openpgp_aid[] = {0xD2, 0x76, 0x00, 0x01, 0x24, 0x01}, piv_aid[] = {0xA0, 0x00, 0x00, 0x03, 0x08};
+  const uint8_t admin_aid[] = {0xF0, 0x00, 0x00, 0x00, 0x00};
+
+  admin_install(1);
+  openpgp_install(1);
+  assert_int_equal(send_apdu(0x00, 0xA4, 0x04, 0x00, admin_aid, sizeof(admin_aid), NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x00, 0x20, 0x00, 0x00, "123456", 6, NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x00, 0x40, ADMIN_P1_CFG_SESSION_RETENTION, 0x01, NULL, 0, NULL), SW_NO_ERROR);
+  assert_true(cfg_is_session_retention_enable());
+
+  // switching to PIV and back keeps PW1 verified
+  assert_int_equal(send_apdu(0x00, 0xA4, 0x04, 0x00, openpgp_aid, sizeof(openpgp_aid), NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x00, 0x20, 0x00, 0x81, "123456", 6, NULL), SW_NO_ERROR);
+  for (int i = 0; i < 10; ++i) {
+    assert_int_equal(send_apdu(0x00, 0xA4, 0x04, 0x00, piv_aid, sizeof(piv_aid), NULL), SW_NO_ERROR);
+    assert_int_equal(send_apdu(0x00, 0xA4, 0x04, 0x00, openpgp_aid, sizeof(openpgp_aid), NULL), SW_NO_ERROR);
+    assert_int_equal(send_apdu(0x00, 0x20, 0x00, 0x81, NULL, 0, NULL), SW_NO_ERROR);
+  }
+
+  // until the card is powered off
+  applets_poweroff();
+  assert_int_not_equal(send_apdu(0x00, 0x20, 0x00, 0x81, NULL, 0, NULL), SW_NO_ERROR);
+
+  assert_int_equal(send_apdu(0x00, 0xA4, 0x04, 0x00, admin_aid, sizeof(admin_aid), NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x00, 0x20, 0x00, 0x00, "123456", 6, NULL), SW_NO_ERROR);
+  assert_int_equal(send_apdu(0x00, 0x40, ADMIN_P1_CFG_SESSION_RETENTION, 0x00, NULL, 0, NULL), SW_NO_ERROR);
+  assert_false(cfg_is_session_retention_enable());
+}
+
+static void test_direct_shared_buffer(void **state) {
+  (void)state;
+
+  // CCID, NFC and WebUSB hand over one buffer for both the command and the response
+  const uint8_t admin_aid[] = {0xF0, 0x00, 0x00, 0x00, 0x00};
+  uint8_t buf[APDU_BUFFER_SIZE + 2] = {0x00, 0xA4, 0x04, 0x00, sizeof(admin_aid)};
+  CAPDU C;
+  RAPDU R = {.data = buf};
+
+  admin_install(1);
+  memcpy(buf + 5, admin_aid, sizeof(admin_aid));
+  assert_int_equal(build_capdu(&C, buf, 5 + sizeof(admin_aid)), 0);
+  process_apdu(&C, &R);
+  assert_int_equal(R.sw, SW_NO_ERROR);
+
+  // the data of a command to a direct applet is moved out of the way of its response
+  apdu_copied_bytes = 0;
+  memcpy(buf, "\x00\x20\x00\x00\x06" "123456", 11);
+  assert_int_equal(build_capdu(&C, buf, 11), 0);
+  R.data = buf;
+  process_apdu(&C, &R);
+  assert_int_equal(R.sw, SW_NO_ERROR);
+  assert_int_equal(apdu_copied_bytes, 6);
+
+  // but stays in place when the transport has a buffer for each
+  apdu_copied_bytes = 0;
+  assert_int_equal(send_apdu(0x00, 0x20, 0x00, 0x00, "123456", 6, NULL), SW_NO_ERROR);
+  assert_int_equal(apdu_copied_bytes, 0);
 }
 
 int main() {
+  struct lfs_config cfg;
+  lfs_filebd_t bd;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_filebd_read;
+  cfg.prog = &lfs_filebd_prog;
+  cfg.erase = &lfs_filebd_erase;
+  cfg.sync = &lfs_filebd_sync;
+  cfg.read_size = 16;
+  cfg.prog_size = 16;
+  cfg.block_size = 512;
+  cfg.block_count = 400;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 128;
+  cfg.lookahead_size = 16;
+  lfs_filebd_create(&cfg, "lfs-root");
+
+  fs_format(&cfg);
+  fs_mount(&cfg);
+
   const struct CMUnitTest tests[] = {
       cmocka_unit_test(test_input_chaining),
       cmocka_unit_test(test_output_chaining),
+      cmocka_unit_test(test_build_capdu),
+      cmocka_unit_test(test_process_copies),
+      cmocka_unit_test(test_applet_find),
+      cmocka_unit_test(test_logical_channels),
+      cmocka_unit_test(test_session_retention),
+      cmocka_unit_test(test_direct_shared_buffer),
   };
 
   int ret = cmocka_run_group_tests(tests, NULL, NULL);
 
+  lfs_filebd_destroy(&cfg);
+
   return ret;
 }
@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <bd/lfs_filebd.h>
+#include <counter.h>
+#include <fs.h>
+#include <lfs.h>
+#include <string.h>
+
+#define COUNTER_FILE "ctr-test"
+#define SET_FILE "ctr-set"
+#define TEST_INCREASES 100
+
+static uint32_t bd_progs;
+
+static int counting_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer,
+                         lfs_size_t size) {
+  ++bd_progs;
+  return lfs_filebd_prog(c, block, off, buffer, size);
+}
+
+static void test_reserve(void **state) {
+  (void)state;
+
+  counter_t ctr = COUNTER_INIT(COUNTER_FILE, 0, 16);
+  uint32_t value, stored;
+  assert_int_equal(write_file(COUNTER_FILE, NULL, 0, 0, 1), 0);
+  assert_int_equal(counter_reset(&ctr, 0), 0);
+  for (uint32_t i = 1; i <= 40; ++i) {
+    assert_int_equal(counter_increase(&ctr, &value), 0);
+    assert_int_equal(value, i);
+  }
+  assert_int_equal(counter_read(&ctr, &value), 0);
+  assert_int_equal(value, 40);
+  // only the ceiling of the reserved range is on flash
+  assert_int_equal(read_attr(COUNTER_FILE, 0, &stored, sizeof(stored)), sizeof(stored));
+  assert_int_equal(stored, 48);
+
+  // a power loss gives up the rest of the range, but never goes back
+  counter_unload(&ctr);
+  assert_int_equal(counter_increase(&ctr, &value), 0);
+  assert_int_equal(value, 49);
+  assert_int_equal(read_attr(COUNTER_FILE, 0, &stored, sizeof(stored)), sizeof(stored));
+  assert_int_equal(stored, 64);
+}
+
+static void test_exact(void **state) {
+  (void)state;
+
+  counter_t ctr = COUNTER_INIT(COUNTER_FILE, 1, 1);
+  uint32_t value;
+  assert_int_equal(write_file(COUNTER_FILE, NULL, 0, 0, 1), 0);
+  assert_int_equal(counter_reset(&ctr, 5), 0);
+  assert_int_equal(counter_increase(&ctr, &value), 0);
+  assert_int_equal(counter_increase(&ctr, &value), 0);
+  assert_int_equal(value, 7);
+  counter_unload(&ctr);
+  assert_int_equal(counter_read(&ctr, &value), 0);
+  assert_int_equal(value, 7);
+
+  // the counter stops instead of wrapping around
+  assert_int_equal(counter_reset(&ctr, UINT32_MAX - 1), 0);
+  assert_int_equal(counter_increase(&ctr, &value), 0);
+  assert_int_equal(value, UINT32_MAX);
+  assert_int_equal(counter_increase(&ctr, &value), COUNTER_EXHAUSTED);
+
+  // a missing attribute is an error, not zero
+  counter_t missing = COUNTER_INIT(COUNTER_FILE, 2, 1);
+  assert_int_equal(counter_read(&missing, &value), COUNTER_IO_FAIL);
+}
+
+static void test_set(void **state) {
+  (void)state;
+
+  uint8_t key[COUNTER_KEY_SIZE] = {0};
+  uint32_t value, last[80] = {0};
+  assert_int_equal(counter_set_reset(SET_FILE, 0), 0);
+
+  // the keys count independently
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 3; ++i) {
+      key[0] = i;
+      assert_int_equal(counter_set_increase(SET_FILE, key, 16, &value), 0);
+      assert_int_equal(value, round + 1);
+      last[i] = value;
+    }
+  }
+
+  // more keys than both the cache and the file hold: every key stays strictly increasing
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 80; ++i) {
+      key[0] = i;
+      assert_int_equal(counter_set_increase(SET_FILE, key, 16, &value), 0);
+      assert_true(value > last[i]);
+      last[i] = value;
+    }
+  }
+  assert_true(get_file_size(SET_FILE) <= 64 * (COUNTER_KEY_SIZE + 4));
+
+  // a reset starts every key from scratch
+  assert_int_equal(counter_set_reset(SET_FILE, 0), 0);
+  key[0] = 0;
+  assert_int_equal(counter_set_increase(SET_FILE, key, 16, &value), 0);
+  assert_int_equal(value, 1);
+}
+
+static void test_set_init(void **state) {
+  (void)state;
+
+  uint8_t key[COUNTER_KEY_SIZE] = {1};
+  uint32_t value;
+  remove_file(SET_FILE);
+
+  // a new set starts above the values handed out before it
+  assert_int_equal(counter_set_init(SET_FILE, 1000), 0);
+  assert_int_equal(counter_set_increase(SET_FILE, key, 16, &value), 0);
+  assert_int_equal(value, 1001);
+  // and is left alone once created
+  assert_int_equal(counter_set_init(SET_FILE, 0), 0);
+  key[0] = 2;
+  assert_int_equal(counter_set_increase(SET_FILE, key, 16, &value), 0);
+  assert_int_equal(value, 1001);
+  key[0] = 1;
+  assert_int_equal(counter_set_increase(SET_FILE, key, 16, &value), 0);
+  assert_int_equal(value, 1002);
+}
+
+static void test_reserved_progs(void **state) {
+  (void)state;
+
+  counter_t reserved = COUNTER_INIT(COUNTER_FILE, 0, 16), exact = COUNTER_INIT(COUNTER_FILE, 1, 1);
+  uint32_t value;
+  assert_int_equal(write_file(COUNTER_FILE, NULL, 0, 0, 1), 0);
+  assert_int_equal(counter_reset(&reserved, 0), 0);
+  assert_int_equal(counter_reset(&exact, 0), 0);
+
+  bd_progs = 0;
+  for (int i = 0; i < TEST_INCREASES; ++i)
+    assert_int_equal(counter_increase(&exact, &value), 0);
+  uint32_t every = bd_progs;
+  bd_progs = 0;
+  for (int i = 0; i < TEST_INCREASES; ++i)
+    assert_int_equal(counter_increase(&reserved, &value), 0);
+  uint32_t ranged = bd_progs;
+
+  assert_true(ranged * 4 < every);
+}
+
+int main() {
+  struct lfs_config cfg;
+  lfs_filebd_t bd;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_filebd_read;
+  cfg.prog = &counting_prog;
+  cfg.erase = &lfs_filebd_erase;
+  cfg.sync = &lfs_filebd_sync;
+  cfg.read_size = 16;
+  cfg.prog_size = 16;
+  cfg.block_size = 512;
+  cfg.block_count = 400;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 128;
+  cfg.lookahead_size = 16;
+  lfs_filebd_create(&cfg, "lfs-root");
+
+  fs_format(&cfg);
+  fs_mount(&cfg);
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_reserve),
+      cmocka_unit_test(test_exact),
+      cmocka_unit_test(test_set),
+      cmocka_unit_test(test_set_init),
+      cmocka_unit_test(test_reserved_progs),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  lfs_filebd_destroy(&cfg);
+
+  return ret;
+}
@@ -0,0 +1,710 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <aes.h>
+#include <apdu.h>
+#include <bd/lfs_filebd.h>
+#include <block-cipher.h>
+#include <cbor.h>
+#include <ctap.h>
+#include <fs.h>
+#include <hmac.h>
+#include <lfs.h>
+#include <string.h>
+
+#include "../applets/ctap/cose-key.h"
+#include "../applets/ctap/rk.h"
+#include "../applets/ctap/secret.h"
+
+#define CMD_MAKE_CREDENTIAL 0x01
+#define CMD_GET_ASSERTION 0x02
+#define CMD_GET_INFO 0x04
+#define CMD_CLIENT_PIN 0x06
+#define CMD_GET_NEXT_ASSERTION 0x08
+#define CTAP2_OK 0x00
+#define CTAP2_ERR_NO_CREDENTIALS 0x2E
+#define CTAP2_ERR_NOT_ALLOWED 0x30
+
+#define BENCH_RPS 25
+#define BENCH_RK_PER_RP 4
+#define BENCH_ALLOW_LIST 20
+#define BENCH_ROUNDS 20
+#define BENCH_POOL 4
+
+static uint32_t bd_reads;
+
+static int counting_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+  ++bd_reads;
+  return lfs_filebd_read(c, block, off, buffer, size);
+}
+
+// the response of the last MakeCredential
+static uint8_t mc_resp[1280];
+static size_t mc_resp_len;
+
+static uint8_t make_credential(const char *rp_id, uint8_t user_id) {
+  uint8_t req[512], client_data_hash[32] = {0}, uid[2] = {user_id, 0xAA};
+  CborEncoder encoder, map, sub_map, array;
+
+  req[0] = CMD_MAKE_CREDENTIAL;
+  cbor_encoder_init(&encoder, req + 1, sizeof(req) - 1, 0);
+  cbor_encoder_create_map(&encoder, &map, 5);
+  cbor_encode_int(&map, 1);
+  cbor_encode_byte_string(&map, client_data_hash, sizeof(client_data_hash));
+  cbor_encode_int(&map, 2);
+  cbor_encoder_create_map(&map, &sub_map, 1);
+  cbor_encode_text_stringz(&sub_map, "id");
+  cbor_encode_text_stringz(&sub_map, rp_id);
+  cbor_encoder_close_container(&map, &sub_map);
+  cbor_encode_int(&map, 3);
+  cbor_encoder_create_map(&map, &sub_map, 2);
+  cbor_encode_text_stringz(&sub_map, "id");
+  cbor_encode_byte_string(&sub_map, uid, sizeof(uid));
+  cbor_encode_text_stringz(&sub_map, "name");
+  cbor_encode_text_stringz(&sub_map, "user");
+  cbor_encoder_close_container(&map, &sub_map);
+  cbor_encode_int(&map, 4);
+  cbor_encoder_create_array(&map, &array, 1);
+  cbor_encoder_create_map(&array, &sub_map, 2);
+  cbor_encode_text_stringz(&sub_map, "alg");
+  cbor_encode_int(&sub_map, -7);
+  cbor_encode_text_stringz(&sub_map, "type");
+  cbor_encode_text_stringz(&sub_map, "public-key");
+  cbor_encoder_close_container(&array, &sub_map);
+  cbor_encoder_close_container(&map, &array);
+  cbor_encode_int(&map, 7);
+  cbor_encoder_create_map(&map, &sub_map, 1);
+  cbor_encode_text_stringz(&sub_map, "rk");
+  cbor_encode_boolean(&sub_map, true);
+  cbor_encoder_close_container(&map, &sub_map);
+  cbor_encoder_close_container(&encoder, &map);
+
+  mc_resp_len = sizeof(mc_resp);
+  ctap_process_cbor(req, 1 + cbor_encoder_get_buffer_size(&encoder, req + 1), mc_resp, &mc_resp_len);
+  return mc_resp[0];
+}
+
+// returns the CTAP status, and the number of credentials if there are more than one
+static uint8_t get_assertion(const char *rp_id, int *num_credentials) {
+  uint8_t req[128], resp[1280], client_data_hash[32] = {0};
+  CborEncoder encoder, map;
+  CborParser parser;
+  CborValue it, val;
+  size_t resp_len = sizeof(resp);
+
+  req[0] = CMD_GET_ASSERTION;
+  cbor_encoder_init(&encoder, req + 1, sizeof(req) - 1, 0);
+  cbor_encoder_create_map(&encoder, &map, 2);
+  cbor_encode_int(&map, 1);
+  cbor_encode_text_stringz(&map, rp_id);
+  cbor_encode_int(&map, 2);
+  cbor_encode_byte_string(&map, client_data_hash, sizeof(client_data_hash));
+  cbor_encoder_close_container(&encoder, &map);
+
+  ctap_process_cbor(req, 1 + cbor_encoder_get_buffer_size(&encoder, req + 1), resp, &resp_len);
+  *num_credentials = 1;
+  if (resp[0] == CTAP2_OK) {
+    assert_int_equal(cbor_parser_init(resp + 1, resp_len - 1, 0, &parser, &it), CborNoError);
+    cbor_value_enter_container(&it, &val);
+    while (!cbor_value_at_end(&val)) {
+      int key = 0;
+      cbor_value_get_int(&val, &key);
+      cbor_value_advance(&val);
+      if (key == 5) cbor_value_get_int(&val, num_credentials);
+      cbor_value_advance(&val);
+    }
+  }
+  return resp[0];
+}
+
+// none of the descriptors verifies, so every one of them goes through verify_key_handle
+static uint8_t get_assertion_allow_list(const char *rp_id, int allow_list_size) {
+  uint8_t req[2048], resp[1280], client_data_hash[32] = {0};
+  CborEncoder encoder, map, array, sub_map;
+  CredentialId id;
+  size_t resp_len = sizeof(resp);
+
+  memset(&id, 0x5A, sizeof(id));
+  sha256_raw((const uint8_t *)rp_id, strlen(rp_id), id.rpIdHash);
+  req[0] = CMD_GET_ASSERTION;
+  cbor_encoder_init(&encoder, req + 1, sizeof(req) - 1, 0);
+  cbor_encoder_create_map(&encoder, &map, 3);
+  cbor_encode_int(&map, 1);
+  cbor_encode_text_stringz(&map, rp_id);
+  cbor_encode_int(&map, 2);
+  cbor_encode_byte_string(&map, client_data_hash, sizeof(client_data_hash));
+  cbor_encode_int(&map, 3);
+  cbor_encoder_create_array(&map, &array, allow_list_size);
+  for (int i = 0; i < allow_list_size; ++i) {
+    id.nonce[0] = i;
+    cbor_encoder_create_map(&array, &sub_map, 2);
+    cbor_encode_text_stringz(&sub_map, "id");
+    cbor_encode_byte_string(&sub_map, (const uint8_t *)&id, sizeof(id));
+    cbor_encode_text_stringz(&sub_map, "type");
+    cbor_encode_text_stringz(&sub_map, "public-key");
+    cbor_encoder_close_container(&array, &sub_map);
+  }
+  cbor_encoder_close_container(&map, &array);
+  cbor_encoder_close_container(&encoder, &map);
+
+  ctap_process_cbor(req, 1 + cbor_encoder_get_buffer_size(&encoder, req + 1), resp, &resp_len);
+  return resp[0];
+}
+
+static uint8_t get_next_assertion(void) {
+  uint8_t req[1] = {CMD_GET_NEXT_ASSERTION}, resp[1280];
+  size_t resp_len = sizeof(resp);
+
+  ctap_process_cbor(req, sizeof(req), resp, &resp_len);
+  return resp[0];
+}
+
+// returns the first byte of the user id in the response of the next assertion, or -1 on errors
+static int get_next_assertion_user(void) {
+  uint8_t req[1] = {CMD_GET_NEXT_ASSERTION}, resp[1280], uid[USER_ID_MAX_SIZE];
+  size_t resp_len = sizeof(resp), uid_len = sizeof(uid);
+  CborParser parser;
+  CborValue it, val, user;
+
+  ctap_process_cbor(req, sizeof(req), resp, &resp_len);
+  if (resp[0] != CTAP2_OK) return -1;
+  assert_int_equal(cbor_parser_init(resp + 1, resp_len - 1, 0, &parser, &it), CborNoError);
+  cbor_value_enter_container(&it, &val);
+  while (!cbor_value_at_end(&val)) {
+    int key = 0;
+    cbor_value_get_int(&val, &key);
+    cbor_value_advance(&val);
+    if (key == 4) {
+      assert_int_equal(cbor_value_map_find_value(&val, "id", &user), CborNoError);
+      assert_int_equal(cbor_value_copy_byte_string(&user, uid, &uid_len, NULL), CborNoError);
+      return uid[0];
+    }
+    cbor_value_advance(&val);
+  }
+  return -1;
+}
+
+static uint8_t get_key_agreement(uint8_t *resp, size_t *resp_len) {
+  // {1: pinProtocol 1, 2: getKeyAgreement}
+  uint8_t req[] = {CMD_CLIENT_PIN, 0xA2, 0x01, 0x01, 0x02, 0x02};
+  ctap_process_cbor(req, sizeof(req), resp, resp_len);
+  return resp[0];
+}
+
+// a platform side of the PIN protocol, with the key pair used as the keyAgreement
+typedef struct {
+  uint8_t keypair[PRI_KEY_SIZE + PUB_KEY_SIZE];
+  uint8_t shared_secret[SHARED_SECRET_SIZE];
+} platform_t;
+
+static void platform_init(platform_t *platform) {
+  uint8_t resp[128], authenticator_key[PUB_KEY_SIZE];
+  size_t resp_len = sizeof(resp), len;
+  CborParser parser;
+  CborValue it, key, coord;
+
+  assert_int_equal(get_key_agreement(resp, &resp_len), CTAP2_OK);
+  assert_int_equal(cbor_parser_init(resp + 1, resp_len - 1, 0, &parser, &it), CborNoError);
+  assert_int_equal(cbor_value_enter_container(&it, &key), CborNoError);
+  assert_int_equal(cbor_value_advance(&key), CborNoError);
+  assert_int_equal(cbor_value_enter_container(&key, &coord), CborNoError);
+  // {1: 2, 3: -25, -1: 1, -2: x, -3: y}
+  for (int i = 0; i < 7; ++i)
+    assert_int_equal(cbor_value_advance(&coord), CborNoError);
+  len = PRI_KEY_SIZE;
+  assert_int_equal(cbor_value_copy_byte_string(&coord, authenticator_key, &len, &coord), CborNoError);
+  assert_int_equal(cbor_value_advance(&coord), CborNoError);
+  len = PRI_KEY_SIZE;
+  assert_int_equal(cbor_value_copy_byte_string(&coord, authenticator_key + PRI_KEY_SIZE, &len, &coord), CborNoError);
+
+  assert_int_equal(ecc_generate(ECC_SECP256R1, platform->keypair, platform->keypair + PRI_KEY_SIZE), 0);
+  assert_int_equal(ecdh_decrypt(ECC_SECP256R1, platform->keypair, authenticator_key, authenticator_key), 0);
+  sha256_raw(authenticator_key, PRI_KEY_SIZE, platform->shared_secret);
+}
+
+static void platform_encrypt(const platform_t *platform, uint8_t *buf, size_t len) {
+  uint8_t iv[16] = {0};
+  block_cipher_config cfg = {.block_size = 16, .mode = CBC, .iv = iv, .encrypt = aes256_enc, .decrypt = aes256_dec};
+  cfg.key = platform->shared_secret;
+  cfg.in_size = len;
+  cfg.in = buf;
+  cfg.out = buf;
+  block_cipher_enc(&cfg);
+}
+
+// sends {1: 1, 2: sub_command, 3: keyAgreement, param: value[, 4: pinAuth]}
+static uint8_t client_pin(const platform_t *platform, int sub_command, int param, const uint8_t *value, size_t len,
+                          const uint8_t *pin_auth) {
+  uint8_t req[256], resp[128];
+  size_t resp_len = sizeof(resp);
+  CborEncoder encoder, map, key;
+
+  req[0] = CMD_CLIENT_PIN;
+  cbor_encoder_init(&encoder, req + 1, sizeof(req) - 1, 0);
+  cbor_encoder_create_map(&encoder, &map, pin_auth ? 5 : 4);
+  cbor_encode_int(&map, 1);
+  cbor_encode_int(&map, 1);
+  cbor_encode_int(&map, 2);
+  cbor_encode_int(&map, sub_command);
+  cbor_encode_int(&map, 3);
+  cbor_encoder_create_map(&map, &key, 5);
+  cbor_encode_int(&key, 1);
+  cbor_encode_int(&key, 2);
+  cbor_encode_int(&key, 3);
+  cbor_encode_int(&key, -25);
+  cbor_encode_int(&key, -1);
+  cbor_encode_int(&key, 1);
+  cbor_encode_int(&key, -2);
+  cbor_encode_byte_string(&key, platform->keypair + PRI_KEY_SIZE, PRI_KEY_SIZE);
+  cbor_encode_int(&key, -3);
+  cbor_encode_byte_string(&key, platform->keypair + 2 * PRI_KEY_SIZE, PRI_KEY_SIZE);
+  cbor_encoder_close_container(&map, &key);
+  if (pin_auth) {
+    cbor_encode_int(&map, 4);
+    cbor_encode_byte_string(&map, pin_auth, PIN_AUTH_SIZE);
+  }
+  cbor_encode_int(&map, param);
+  cbor_encode_byte_string(&map, value, len);
+  cbor_encoder_close_container(&encoder, &map);
+
+  ctap_process_cbor(req, 1 + cbor_encoder_get_buffer_size(&encoder, req + 1), resp, &resp_len);
+  return resp[0];
+}
+
+static void test_install(void **state) {
+  (void)state;
+
+  uint8_t c_buf[64], r_buf[64], key[32], cert[] = {0x30, 0x03, 0x02, 0x01, 0x01};
+  CAPDU C = {.data = c_buf};
+  RAPDU R = {.data = r_buf};
+
+  assert_int_equal(ctap_install(1), 0);
+  memset(key, 0x11, sizeof(key));
+  memcpy(c_buf, key, sizeof(key));
+  C.lc = sizeof(key);
+  assert_int_equal(ctap_install_private_key(&C, &R), 0);
+  memcpy(c_buf, cert, sizeof(cert));
+  C.lc = sizeof(cert);
+  assert_int_equal(ctap_install_cert(&C, &R), 0);
+}
+
+static void test_resident_keys(void **state) {
+  (void)state;
+
+  char rp_id[] = "rp-00.example.com";
+  int n;
+
+  // more than the 64 credentials the fixed-record store used to hold
+  for (int rp = 0; rp < BENCH_RPS; ++rp) {
+    rp_id[3] = 'a' + rp;
+    for (int user = 0; user < BENCH_RK_PER_RP; ++user)
+      assert_int_equal(make_credential(rp_id, user), CTAP2_OK);
+  }
+  // the credential of an existing user is replaced
+  rp_id[3] = 'a';
+  int size = get_file_size("ctap_rki");
+  assert_int_equal(make_credential(rp_id, 0), CTAP2_OK);
+  assert_int_equal(get_file_size("ctap_rki"), size);
+  assert_int_equal(get_assertion(rp_id, &n), CTAP2_OK);
+  assert_int_equal(n, BENCH_RK_PER_RP);
+
+  assert_int_equal(get_assertion("unknown.example.com", &n), CTAP2_ERR_NO_CREDENTIALS);
+
+  // everything is found again after a power cycle
+  assert_int_equal(ctap_install(0), 0);
+  for (int rp = 0; rp < BENCH_RPS; ++rp) {
+    rp_id[3] = 'a' + rp;
+    assert_int_equal(get_assertion(rp_id, &n), CTAP2_OK);
+    assert_int_equal(n, BENCH_RK_PER_RP);
+    for (int i = 1; i < n; ++i)
+      assert_int_equal(get_next_assertion(), CTAP2_OK);
+  }
+
+  // the free extents lost to a power loss are found again, and the replaced credential takes one of them
+  rp_id[3] = 'a';
+  assert_int_equal(write_file("ctap_rkf", NULL, 0, 0, 1), 0);
+  assert_int_equal(ctap_install(0), 0);
+  size = get_file_size("ctap_rkd");
+  assert_int_equal(make_credential(rp_id, 0), CTAP2_OK);
+  assert_int_equal(get_file_size("ctap_rkd"), size);
+  assert_int_equal(get_assertion(rp_id, &n), CTAP2_OK);
+  assert_int_equal(n, BENCH_RK_PER_RP);
+}
+
+static void test_migration(void **state) {
+  (void)state;
+
+  char rp_id[] = "rp-c0.example.com";
+  uint8_t rp_id_hash[32];
+  uint16_t ids[MAX_RK_NUM];
+  CTAP_residentKey rk;
+  int n;
+
+  // rebuild the old fixed-record file from the credentials of one rp, oldest first
+  sha256_raw((uint8_t *)rp_id, strlen(rp_id), rp_id_hash);
+  n = rk_list(rp_id_hash, ids, MAX_RK_NUM);
+  assert_int_equal(n, BENCH_RK_PER_RP);
+  for (int i = 0; i < n; ++i) {
+    assert_int_equal(rk_read(ids[n - 1 - i], &rk), 0);
+    assert_int_equal(write_file(RK_FILE, &rk, i * sizeof(rk), sizeof(rk), 0), 0);
+  }
+  assert_int_equal(remove_file("ctap_rki"), 0);
+
+  assert_int_equal(ctap_install(0), 0);
+  assert_int_equal(get_file_size(RK_FILE), LFS_ERR_NOENT);
+  assert_int_equal(get_assertion(rp_id, &n), CTAP2_OK);
+  assert_int_equal(n, BENCH_RK_PER_RP);
+  rp_id[3] = 'a';
+  assert_int_equal(get_assertion(rp_id, &n), CTAP2_ERR_NO_CREDENTIALS);
+
+  // an interrupted migration is simply done again
+  rp_id[3] = 'c';
+  for (int i = 0; i < BENCH_RK_PER_RP; ++i) {
+    assert_int_equal(rk_read(i, &rk), 0);
+    assert_int_equal(write_file(RK_FILE, &rk, i * sizeof(rk), sizeof(rk), 0), 0);
+  }
+  assert_int_equal(ctap_install(0), 0);
+  assert_int_equal(get_assertion(rp_id, &n), CTAP2_OK);
+  assert_int_equal(n, BENCH_RK_PER_RP);
+}
+
+static void test_resident_key_lookup(void **state) {
+  (void)state;
+
+  char rp_id[] = "rp-00.example.com";
+  uint32_t total = 0;
+  int n;
+
+  for (int rp = 0; rp < BENCH_RPS; ++rp) {
+    rp_id[3] = 'a' + rp;
+    bd_reads = 0;
+    assert_int_equal(get_assertion(rp_id, &n), CTAP2_OK);
+    for (int i = 1; i < n; ++i)
+      assert_int_equal(get_next_assertion(), CTAP2_OK);
+    total += bd_reads;
+  }
+  // an unknown rp only costs the search of the index, no record is read
+  bd_reads = 0;
+  assert_int_equal(get_assertion("unknown.example.com", &n), CTAP2_ERR_NO_CREDENTIALS);
+  assert_true(bd_reads < total / BENCH_RPS);
+}
+
+static void test_allow_list_reads(void **state) {
+  (void)state;
+
+  uint32_t cold, warm;
+
+  // count the flash reads without the attribute cache of fs
+  fs_set_cache_enabled(0);
+  assert_int_equal(ctap_install(0), 0);
+  bd_reads = 0;
+  assert_int_equal(get_assertion_allow_list("allow.example.com", BENCH_ALLOW_LIST), CTAP2_ERR_NO_CREDENTIALS);
+  cold = bd_reads;
+  bd_reads = 0;
+  assert_int_equal(get_assertion_allow_list("allow.example.com", BENCH_ALLOW_LIST), CTAP2_ERR_NO_CREDENTIALS);
+  warm = bd_reads;
+  fs_set_cache_enabled(1);
+
+  // the master key is loaded once after power-on, not for every descriptor
+  assert_true(warm < cold);
+}
+
+static void test_keypair_pool(void **state) {
+  (void)state;
+
+  CredentialId kh;
+  uint8_t pubkey[PUB_KEY_SIZE], pri_key[PRI_KEY_SIZE], expected[PUB_KEY_SIZE];
+
+  memset(kh.rpIdHash, 0x33, sizeof(kh.rpIdHash));
+  for (int i = 0; i < 2 * BENCH_POOL + 1; ++i)
+    ctap_precompute();
+  // the pooled key pairs come first, then they are computed on demand
+  for (int i = 0; i < 2 * BENCH_POOL; ++i) {
+    assert_int_equal(generate_key_handle(&kh, pubkey, COSE_ALG_ES256), 0);
+    // the key handle derives the private key of the public key
+    assert_int_equal(verify_key_handle(&kh, pri_key), 0);
+    assert_int_equal(ecc_get_public_key(ECC_SECP256R1, pri_key, expected), 0);
+    assert_memory_equal(pubkey, expected, PUB_KEY_SIZE);
+  }
+
+  // the pool does not survive a reset, its key pairs belong to the old KH key
+  for (int i = 0; i < BENCH_POOL; ++i)
+    ctap_precompute();
+  test_install(NULL);
+  assert_int_equal(generate_key_handle(&kh, pubkey, COSE_ALG_ES256), 0);
+  assert_int_equal(verify_key_handle(&kh, pri_key), 0);
+  assert_int_equal(ecc_get_public_key(ECC_SECP256R1, pri_key, expected), 0);
+  assert_memory_equal(pubkey, expected, PUB_KEY_SIZE);
+}
+
+static void test_lazy_key_agreement(void **state) {
+  (void)state;
+
+  uint8_t first[128], second[128];
+  size_t first_len = sizeof(first), second_len = sizeof(second);
+
+  assert_int_equal(ctap_install(0), 0);
+
+  // generated on first use, then kept until the next install
+  assert_int_equal(get_key_agreement(first, &first_len), CTAP2_OK);
+  assert_int_equal(get_key_agreement(second, &second_len), CTAP2_OK);
+  assert_int_equal(first_len, second_len);
+  assert_memory_equal(first, second, first_len);
+  assert_int_equal(ctap_install(0), 0);
+  second_len = sizeof(second);
+  assert_int_equal(get_key_agreement(second, &second_len), CTAP2_OK);
+  assert_memory_not_equal(first, second, first_len);
+}
+
+static void test_assertion_session(void **state) {
+  (void)state;
+
+  const int users = 8;
+  uint8_t seen[8] = {0};
+  uint32_t cached = 0, uncached = 0;
+  int n;
+
+  // more credentials than the read-ahead of GetAssertion holds
+  for (int user = 0; user < users; ++user)
+    assert_int_equal(make_credential("session.example.com", user), CTAP2_OK);
+  assert_int_equal(get_assertion("session.example.com", &n), CTAP2_OK);
+  assert_int_equal(n, users);
+  for (int i = 1; i < n; ++i) {
+    bd_reads = 0;
+    int user = get_next_assertion_user();
+    assert_true(user >= 0 && user < users);
+    assert_false(seen[user]);
+    seen[user] = 1;
+    if (i <= 4)
+      cached += bd_reads;
+    else
+      uncached += bd_reads;
+  }
+  assert_int_equal(get_next_assertion(), CTAP2_ERR_NOT_ALLOWED);
+
+  // any other command ends the sequence
+  uint8_t resp[128];
+  size_t resp_len = sizeof(resp);
+  assert_int_equal(get_assertion("session.example.com", &n), CTAP2_OK);
+  assert_int_equal(get_key_agreement(resp, &resp_len), CTAP2_OK);
+  assert_int_equal(get_next_assertion(), CTAP2_ERR_NOT_ALLOWED);
+
+  // per GetNextAssertion, the 4 credentials read ahead cost fewer reads than the rest
+  assert_true(cached * (users - 5) < uncached * 4);
+}
+
+static void test_shared_secret_cache(void **state) {
+  (void)state;
+
+  const char pin[] = "123456";
+  uint8_t new_pin_enc[64] = {0}, pin_auth[SHA256_DIGEST_LENGTH], pin_hash_enc[16], digest[SHA256_DIGEST_LENGTH];
+  platform_t platform, other;
+
+  // the test leaves a PIN set behind
+  test_install(NULL);
+  platform_init(&platform);
+  memcpy(new_pin_enc, pin, strlen(pin));
+  platform_encrypt(&platform, new_pin_enc, sizeof(new_pin_enc));
+  hmac_sha256(platform.shared_secret, SHARED_SECRET_SIZE, new_pin_enc, sizeof(new_pin_enc), pin_auth);
+  assert_int_equal(client_pin(&platform, 3, 5, new_pin_enc, sizeof(new_pin_enc), pin_auth), CTAP2_OK);
+
+  // the same platform key is served from the cache, and must give the same secret
+  sha256_raw((const uint8_t *)pin, strlen(pin), digest);
+  for (int i = 0; i < BENCH_ROUNDS; ++i) {
+    memcpy(pin_hash_enc, digest, sizeof(pin_hash_enc));
+    platform_encrypt(&platform, pin_hash_enc, sizeof(pin_hash_enc));
+    assert_int_equal(client_pin(&platform, 5, 6, pin_hash_enc, sizeof(pin_hash_enc), NULL), CTAP2_OK);
+  }
+
+  // another platform key does not hit the entry of the first one
+  platform_init(&other);
+  memcpy(pin_hash_enc, digest, sizeof(pin_hash_enc));
+  platform_encrypt(&other, pin_hash_enc, sizeof(pin_hash_enc));
+  assert_int_equal(client_pin(&other, 5, 6, pin_hash_enc, sizeof(pin_hash_enc), NULL), CTAP2_OK);
+
+  // a new key agreement key invalidates the cache
+  assert_int_equal(ctap_install(0), 0);
+  memcpy(pin_hash_enc, digest, sizeof(pin_hash_enc));
+  platform_encrypt(&platform, pin_hash_enc, sizeof(pin_hash_enc));
+  assert_int_not_equal(client_pin(&platform, 5, 6, pin_hash_enc, sizeof(pin_hash_enc), NULL), CTAP2_OK);
+  platform_init(&platform);
+  memcpy(pin_hash_enc, digest, sizeof(pin_hash_enc));
+  platform_encrypt(&platform, pin_hash_enc, sizeof(pin_hash_enc));
+  assert_int_equal(client_pin(&platform, 5, 6, pin_hash_enc, sizeof(pin_hash_enc), NULL), CTAP2_OK);
+}
+
+// the GetInfo response as tinycbor builds it
+static size_t build_get_info(uint8_t *buf, size_t len, bool client_pin) {
+  static const uint8_t aaguid[] = {0x24, 0x4e, 0xb2, 0x9e, 0xe0, 0x90, 0x4e, 0x49,
+                                   0x81, 0xfe, 0x1f, 0x20, 0xf8, 0xd3, 0xb8, 0xf4};
+  CborEncoder encoder, map, array, option_map;
+
+  cbor_encoder_init(&encoder, buf, len, 0);
+  cbor_encoder_create_map(&encoder, &map, 6);
+  cbor_encode_int(&map, 1);
+  cbor_encoder_create_array(&map, &array, 2);
+  cbor_encode_text_stringz(&array, "FIDO_2_0");
+  cbor_encode_text_stringz(&array, "U2F_V2");
+  cbor_encoder_close_container(&map, &array);
+  cbor_encode_int(&map, 2);
+  cbor_encoder_create_array(&map, &array, 1);
+  cbor_encode_text_stringz(&array, "hmac-secret");
+  cbor_encoder_close_container(&map, &array);
+  cbor_encode_int(&map, 3);
+  cbor_encode_byte_string(&map, aaguid, sizeof(aaguid));
+  cbor_encode_int(&map, 4);
+  cbor_encoder_create_map(&map, &option_map, 2);
+  cbor_encode_text_stringz(&option_map, "rk");
+  cbor_encode_boolean(&option_map, true);
+  cbor_encode_text_stringz(&option_map, "clientPin");
+  cbor_encode_boolean(&option_map, client_pin);
+  cbor_encoder_close_container(&map, &option_map);
+  cbor_encode_int(&map, 5);
+  cbor_encode_int(&map, 1280);
+  cbor_encode_int(&map, 6);
+  cbor_encoder_create_array(&map, &array, 1);
+  cbor_encode_int(&array, 1);
+  cbor_encoder_close_container(&map, &array);
+  cbor_encoder_close_container(&encoder, &map);
+  return cbor_encoder_get_buffer_size(&encoder, buf);
+}
+
+static void check_get_info(bool client_pin) {
+  uint8_t req[1] = {CMD_GET_INFO}, resp[256], expected[256];
+  size_t resp_len = sizeof(resp);
+
+  ctap_process_cbor(req, sizeof(req), resp, &resp_len);
+  assert_int_equal(resp[0], CTAP2_OK);
+  size_t len = build_get_info(expected, sizeof(expected), client_pin);
+  assert_int_equal(resp_len - 1, len);
+  assert_memory_equal(resp + 1, expected, len);
+}
+
+static void test_get_info(void **state) {
+  (void)state;
+
+  // test_shared_secret_cache has set a PIN
+  check_get_info(true);
+  test_install(NULL);
+  check_get_info(false);
+}
+
+// compare the last MakeCredential response with the packed attestation object built by tinycbor
+static void check_packed_attestation(const uint8_t *cert, size_t cert_len) {
+  uint8_t auth_data[256], sig[72], expected[1280];
+  size_t auth_data_len = sizeof(auth_data), sig_len = sizeof(sig);
+  CborParser parser;
+  CborValue it, map, att_stmt;
+  CborEncoder encoder, resp_map, att_map, x5c;
+  bool is_packed;
+
+  assert_int_equal(mc_resp[0], CTAP2_OK);
+  assert_int_equal(cbor_parser_init(mc_resp + 1, mc_resp_len - 1, 0, &parser, &it), CborNoError);
+  assert_int_equal(cbor_value_enter_container(&it, &map), CborNoError);
+  cbor_value_advance(&map);
+  assert_int_equal(cbor_value_text_string_equals(&map, "packed", &is_packed), CborNoError);
+  assert_true(is_packed);
+  cbor_value_advance(&map);
+  cbor_value_advance(&map);
+  assert_int_equal(cbor_value_copy_byte_string(&map, auth_data, &auth_data_len, NULL), CborNoError);
+  cbor_value_advance(&map);
+  cbor_value_advance(&map);
+  assert_int_equal(cbor_value_map_find_value(&map, "sig", &att_stmt), CborNoError);
+  assert_int_equal(cbor_value_copy_byte_string(&att_stmt, sig, &sig_len, NULL), CborNoError);
+
+  cbor_encoder_init(&encoder, expected, sizeof(expected), 0);
+  cbor_encoder_create_map(&encoder, &resp_map, 3);
+  cbor_encode_int(&resp_map, 1);
+  cbor_encode_text_stringz(&resp_map, "packed");
+  cbor_encode_int(&resp_map, 2);
+  cbor_encode_byte_string(&resp_map, auth_data, auth_data_len);
+  cbor_encode_int(&resp_map, 3);
+  cbor_encoder_create_map(&resp_map, &att_map, 3);
+  cbor_encode_text_stringz(&att_map, "alg");
+  cbor_encode_int(&att_map, COSE_ALG_ES256);
+  cbor_encode_text_stringz(&att_map, "sig");
+  cbor_encode_byte_string(&att_map, sig, sig_len);
+  cbor_encode_text_stringz(&att_map, "x5c");
+  cbor_encoder_create_array(&att_map, &x5c, 1);
+  cbor_encode_byte_string(&x5c, cert, cert_len);
+  cbor_encoder_close_container(&att_map, &x5c);
+  cbor_encoder_close_container(&resp_map, &att_map);
+  cbor_encoder_close_container(&encoder, &resp_map);
+  size_t len = cbor_encoder_get_buffer_size(&encoder, expected);
+  assert_int_equal(mc_resp_len - 1, len);
+  assert_memory_equal(mc_resp + 1, expected, len);
+}
+
+static void test_packed_attestation(void **state) {
+  (void)state;
+
+  uint8_t c_buf[300], r_buf[64], cert[] = {0x30, 0x03, 0x02, 0x01, 0x01};
+  CAPDU C = {.data = c_buf};
+  RAPDU R = {.data = r_buf};
+
+  test_install(NULL);
+  assert_int_equal(make_credential("packed.example.com", 1), CTAP2_OK);
+  check_packed_attestation(cert, sizeof(cert));
+  assert_int_equal(make_credential("packed.example.com", 2), CTAP2_OK);
+  check_packed_attestation(cert, sizeof(cert));
+
+  // a new certificate replaces the one in RAM
+  memset(c_buf, 0x5A, sizeof(c_buf));
+  C.lc = sizeof(c_buf);
+  assert_int_equal(ctap_install_cert(&C, &R), 0);
+  assert_int_equal(make_credential("packed.example.com", 3), CTAP2_OK);
+  check_packed_attestation(c_buf, sizeof(c_buf));
+
+  // one written behind the back of CTAP is picked up by the next install
+  assert_int_equal(write_file("ctap_cert", cert, 0, sizeof(cert), 1), 0);
+  assert_int_equal(ctap_install(0), 0);
+  assert_int_equal(make_credential("packed.example.com", 4), CTAP2_OK);
+  check_packed_attestation(cert, sizeof(cert));
+
+  test_install(NULL);
+}
+
+int main() {
+  struct lfs_config cfg;
+  lfs_filebd_t bd;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &counting_read;
+  cfg.prog = &lfs_filebd_prog;
+  cfg.erase = &lfs_filebd_erase;
+  cfg.sync = &lfs_filebd_sync;
+  cfg.read_size = 16;
+  cfg.prog_size = 16;
+  cfg.block_size = 512;
+  cfg.block_count = 400;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 128;
+  cfg.lookahead_size = 16;
+  lfs_filebd_create(&cfg, "lfs-root");
+
+  fs_format(&cfg);
+  fs_mount(&cfg);
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_install),
+      cmocka_unit_test(test_resident_keys),
+      cmocka_unit_test(test_resident_key_lookup),
+      cmocka_unit_test(test_allow_list_reads),
+      cmocka_unit_test(test_migration),
+      cmocka_unit_test(test_keypair_pool),
+      cmocka_unit_test(test_lazy_key_agreement),
+      cmocka_unit_test(test_assertion_session),
+      cmocka_unit_test(test_shared_secret_cache),
+      cmocka_unit_test(test_get_info),
+      cmocka_unit_test(test_packed_attestation),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  lfs_filebd_destroy(&cfg);
+
+  return ret;
+}
@@ -0,0 +1,272 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <bd/lfs_filebd.h>
+#include <fs.h>
+#include <lfs.h>
+#include <pin.h>
+#include <string.h>
+
+static uint32_t bd_progs;
+
+static int counting_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer,
+                         lfs_size_t size) {
+  ++bd_progs;
+  return lfs_filebd_prog(c, block, off, buffer, size);
+}
+
+static void test_read_write(void **state) {
+  (void)state;
+
+  uint8_t buf[64];
+  assert_int_equal(write_file("fs-test", "0123456789", 0, 10, 1), 0);
+  assert_int_equal(read_file("fs-test", buf, 0, sizeof(buf)), 10);
+  assert_memory_equal(buf, "0123456789", 10);
+
+  // writes through the cached handle are visible to later reads
+  assert_int_equal(write_file("fs-test", "abc", 4, 3, 0), 0);
+  assert_int_equal(read_file("fs-test", buf, 2, 6), 6);
+  assert_memory_equal(buf, "23abc7", 6);
+  assert_int_equal(get_file_size("fs-test"), 10);
+
+  // appending past the end
+  assert_int_equal(write_file("fs-test", "XY", 10, 2, 0), 0);
+  assert_int_equal(get_file_size("fs-test"), 12);
+
+  // recreating and truncating the file must invalidate the cached handle
+  assert_int_equal(write_file("fs-test", "new", 0, 3, 1), 0);
+  assert_int_equal(read_file("fs-test", buf, 0, sizeof(buf)), 3);
+  assert_memory_equal(buf, "new", 3);
+  assert_int_equal(truncate_file("fs-test", 1), 0);
+  assert_int_equal(get_file_size("fs-test"), 1);
+  assert_int_equal(read_file("fs-test", buf, 0, sizeof(buf)), 1);
+
+  // inserting moves the tail
+  char big[200];
+  for (int i = 0; i < (int)sizeof(big); ++i) big[i] = 'a' + i % 26;
+  assert_int_equal(write_file("fs-test", big, 0, sizeof(big), 1), 0);
+  assert_int_equal(insert_file("fs-test", "012", 5, 3), 0);
+  assert_int_equal(insert_file("fs-test", "end", sizeof(big) + 3, 3), 0);
+  assert_int_equal(get_file_size("fs-test"), sizeof(big) + 6);
+  assert_int_equal(read_file("fs-test", buf, 0, 10), 10);
+  assert_memory_equal(buf, "abcde012fg", 10);
+  assert_int_equal(read_file("fs-test", buf, sizeof(big) + 1, 5), 5);
+  assert_memory_equal(buf, big + sizeof(big) - 2, 2);
+  assert_memory_equal(buf + 2, "end", 3);
+  assert_int_equal(insert_file("fs-test", "x", sizeof(big) + 7, 1), LFS_ERR_INVAL);
+  assert_int_equal(remove_file("fs-test"), 0);
+
+  // reading must not create a file
+  assert_int_equal(read_file("fs-none", buf, 0, sizeof(buf)), LFS_ERR_NOENT);
+  assert_int_equal(get_file_size("fs-none"), LFS_ERR_NOENT);
+}
+
+static void test_lru(void **state) {
+  (void)state;
+
+  char path[] = "fs-lru-0";
+  uint8_t buf[4];
+  fs_cache_stats_t stats;
+
+  for (int i = 0; i < 8; ++i) {
+    path[7] = '0' + i;
+    assert_int_equal(write_file(path, path, 0, 4, 1), 0);
+  }
+  // cycle through more files than the pool holds, every file must still read back correctly
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 8; ++i) {
+      path[7] = '0' + i;
+      assert_int_equal(read_file(path, buf, 0, sizeof(buf)), 4);
+      assert_memory_equal(buf, path, 4);
+    }
+  }
+
+  fs_reset_cache_stats();
+  path[7] = '7';
+  for (int i = 0; i < 10; ++i)
+    assert_int_equal(read_file(path, buf, 0, sizeof(buf)), 4);
+  fs_get_cache_stats(&stats);
+  assert_int_equal(stats.handle_misses, 0);
+  assert_int_equal(stats.handle_hits, 10);
+
+  // paths too long for the pool bypass it
+  assert_int_equal(write_file("fs-a-very-long-path", "long", 0, 4, 1), 0);
+  assert_int_equal(read_file("fs-a-very-long-path", buf, 0, sizeof(buf)), 4);
+  assert_memory_equal(buf, "long", 4);
+}
+
+static void test_attr(void **state) {
+  (void)state;
+
+  uint8_t buf[64], big[64];
+  fs_cache_stats_t stats;
+
+  assert_int_equal(write_file("fs-attr", NULL, 0, 0, 1), 0);
+  assert_int_equal(write_attr("fs-attr", 1, "value", 5), 0);
+  fs_reset_cache_stats();
+  for (int i = 0; i < 4; ++i) {
+    assert_int_equal(read_attr("fs-attr", 1, buf, sizeof(buf)), 5);
+    assert_memory_equal(buf, "value", 5);
+  }
+  // a short buffer still gets the stored size, like lfs_getattr
+  memset(buf, 0, sizeof(buf));
+  assert_int_equal(read_attr("fs-attr", 1, buf, 2), 5);
+  assert_memory_equal(buf, "va\0", 3);
+  fs_get_cache_stats(&stats);
+  assert_int_equal(stats.attr_misses, 0);
+  assert_int_equal(stats.attr_hits, 5);
+
+  // missing attributes are cached as well
+  assert_int_equal(read_attr("fs-attr", 2, buf, sizeof(buf)), LFS_ERR_NOATTR);
+  assert_int_equal(read_attr("fs-attr", 2, buf, sizeof(buf)), LFS_ERR_NOATTR);
+  assert_int_equal(write_attr("fs-attr", 2, "x", 1), 0);
+  assert_int_equal(read_attr("fs-attr", 2, buf, sizeof(buf)), 1);
+  assert_int_equal(write_attr("fs-attr", 2, NULL, 0), 0);
+  assert_int_equal(read_attr("fs-attr", 2, buf, sizeof(buf)), 0);
+
+  // values too large for the cache go to flash every time
+  memset(big, 0xA5, sizeof(big));
+  assert_int_equal(write_attr("fs-attr", 3, big, sizeof(big)), 0);
+  assert_int_equal(read_attr("fs-attr", 3, buf, sizeof(buf)), sizeof(big));
+  assert_memory_equal(buf, big, sizeof(big));
+
+  // a file recreated with trunc=1 must not be served from stale entries
+  assert_int_equal(write_file("fs-attr", "data", 0, 4, 1), 0);
+  int cached = read_attr("fs-attr", 1, buf, sizeof(buf));
+  fs_set_cache_enabled(0);
+  assert_int_equal(read_attr("fs-attr", 1, big, sizeof(big)), cached);
+  fs_set_cache_enabled(1);
+  if (cached > 0) assert_memory_equal(buf, big, cached);
+  assert_int_equal(read_attr("fs-attr", 9, buf, sizeof(buf)), LFS_ERR_NOATTR);
+
+  // errors are not cached
+  assert_int_equal(read_attr("fs-none", 1, buf, sizeof(buf)), LFS_ERR_NOENT);
+  assert_int_equal(write_attr("fs-none", 1, "v", 1), LFS_ERR_NOENT);
+  assert_int_equal(read_attr("fs-none", 1, buf, sizeof(buf)), LFS_ERR_NOENT);
+}
+
+static void test_write_attrs(void **state) {
+  (void)state;
+
+  uint8_t a = 1, b[20], buf[20];
+  memset(b, 0x5A, sizeof(b));
+  struct lfs_attr attrs[] = {{1, &a, 1}, {2, b, sizeof(b)}, {3, NULL, 0}};
+
+  assert_int_equal(write_file("fs-attrs", NULL, 0, 0, 1), 0);
+  assert_int_equal(write_attrs("fs-attrs", attrs, 3), 0);
+  for (int cached = 1; cached >= 0; --cached) {
+    fs_set_cache_enabled(cached);
+    assert_int_equal(read_attr("fs-attrs", 1, buf, sizeof(buf)), 1);
+    assert_int_equal(buf[0], 1);
+    assert_int_equal(read_attr("fs-attrs", 2, buf, sizeof(buf)), sizeof(b));
+    assert_memory_equal(buf, b, sizeof(b));
+    assert_int_equal(read_attr("fs-attrs", 3, buf, sizeof(buf)), 0);
+  }
+  fs_set_cache_enabled(1);
+
+  // the file content is left untouched
+  assert_int_equal(write_file("fs-attrs", "abc", 0, 3, 0), 0);
+  a = 2;
+  assert_int_equal(write_attrs("fs-attrs", attrs, 1), 0);
+  assert_int_equal(read_file("fs-attrs", buf, 0, sizeof(buf)), 3);
+  assert_memory_equal(buf, "abc", 3);
+  assert_int_equal(read_attr("fs-attrs", 1, buf, sizeof(buf)), 1);
+  assert_int_equal(buf[0], 2);
+
+  assert_int_equal(write_attrs("fs-none", attrs, 1), LFS_ERR_NOENT);
+}
+
+static void test_rename(void **state) {
+  (void)state;
+
+  uint8_t buf[8];
+
+  assert_int_equal(write_file("fs-old", "new", 0, 3, 1), 0);
+  assert_int_equal(write_attr("fs-old", 1, "a", 1), 0);
+  assert_int_equal(write_file("fs-new", "stale", 0, 5, 1), 0);
+  assert_int_equal(write_attr("fs-new", 1, "b", 1), 0);
+  // warm up the caches of both paths
+  assert_int_equal(read_file("fs-new", buf, 0, sizeof(buf)), 5);
+  assert_int_equal(read_attr("fs-new", 1, buf, sizeof(buf)), 1);
+
+  // the file replaces the one at the new path, along with its attributes
+  assert_int_equal(rename_file("fs-old", "fs-new"), 0);
+  assert_int_equal(get_file_size("fs-old"), LFS_ERR_NOENT);
+  assert_int_equal(read_attr("fs-old", 1, buf, sizeof(buf)), LFS_ERR_NOENT);
+  assert_int_equal(read_file("fs-new", buf, 0, sizeof(buf)), 3);
+  assert_memory_equal(buf, "new", 3);
+  assert_int_equal(read_attr("fs-new", 1, buf, sizeof(buf)), 1);
+  assert_int_equal(buf[0], 'a');
+
+  assert_int_equal(rename_file("fs-old", "fs-new"), LFS_ERR_NOENT);
+  assert_int_equal(remove_file("fs-new"), 0);
+}
+
+static pin_t pin = {.min_length = 4, .max_length = PIN_MAX_LENGTH, .is_validated = 0, .path = "fs-pin"};
+
+static void test_pin_verify_writes(void **state) {
+  (void)state;
+
+  uint8_t retries;
+
+  assert_int_equal(pin_create(&pin, "1234", 4, 3), 0);
+  bd_progs = 0;
+  for (int i = 0; i < 10; ++i)
+    assert_int_equal(pin_verify(&pin, "1234", 4, &retries), 0);
+  // nothing to commit when the retry counter is already at its default value
+  assert_int_equal(bd_progs, 0);
+  assert_int_equal(retries, 3);
+
+  assert_int_equal(pin_verify(&pin, "0000", 4, &retries), PIN_AUTH_FAIL);
+  assert_int_equal(retries, 2);
+  assert_true(bd_progs > 0);
+  assert_int_equal(pin_verify(&pin, "1234", 4, &retries), 0);
+  assert_int_equal(pin_get_retries(&pin), 3);
+
+  assert_int_equal(pin_update(&pin, "5678", 4), 0);
+  assert_int_equal(pin_verify(&pin, "1234", 4, &retries), PIN_AUTH_FAIL);
+  assert_int_equal(pin_update(&pin, "1234", 4), 0);
+  assert_int_equal(pin_get_retries(&pin), 3);
+  assert_int_equal(pin_clear(&pin), 0);
+  assert_int_equal(pin_get_retries(&pin), 0);
+}
+
+int main() {
+  struct lfs_config cfg;
+  lfs_filebd_t bd;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.context = &bd;
+  cfg.read = &lfs_filebd_read;
+  cfg.prog = &counting_prog;
+  cfg.erase = &lfs_filebd_erase;
+  cfg.sync = &lfs_filebd_sync;
+  cfg.read_size = 16;
+  cfg.prog_size = 16;
+  cfg.block_size = 512;
+  cfg.block_count = 400;
+  cfg.block_cycles = 50000;
+  cfg.cache_size = 128;
+  cfg.lookahead_size = 16;
+  lfs_filebd_create(&cfg, "lfs-root");
+
+  fs_format(&cfg);
+  fs_mount(&cfg);
+
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_read_write),
+      cmocka_unit_test(test_lru),
+      cmocka_unit_test(test_attr),
+      cmocka_unit_test(test_write_attrs),
+      cmocka_unit_test(test_rename),
+      cmocka_unit_test(test_pin_verify_writes),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  lfs_filebd_destroy(&cfg);
+
+  return ret;
+}
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <cmocka.h>
+
+#include <hmac-ctx.h>
+#include <hmac.h>
+#include <string.h>
+
+#define BATCH_MAX 1000
+
+static void test_hmac_ctx(void **state) {
+  (void)state;
+
+  uint8_t key[150], msg[80], expected[SHA512_DIGEST_LENGTH], actual[SHA512_DIGEST_LENGTH];
+  hmac_sha1_ctx_t sha1_ctx;
+  hmac_sha256_ctx_t sha256_ctx;
+  hmac_sha512_ctx_t sha512_ctx;
+
+  for (size_t i = 0; i < sizeof(key); ++i)
+    key[i] = i * 7 + 1;
+  for (size_t i = 0; i < sizeof(msg); ++i)
+    msg[i] = i * 13 + 5;
+  // short, block-sized and hashed keys, with several messages per key
+  const size_t key_lens[] = {0, 20, 32, SHA256_BLOCK_SIZE, 100, SHA512_BLOCK_SIZE, sizeof(key)};
+  for (size_t k = 0; k < sizeof(key_lens) / sizeof(key_lens[0]); ++k) {
+    hmac_sha1_ctx_init(&sha1_ctx, key, key_lens[k]);
+    hmac_sha256_ctx_init(&sha256_ctx, key, key_lens[k]);
+    hmac_sha512_ctx_init(&sha512_ctx, key, key_lens[k]);
+    for (size_t len = 0; len <= sizeof(msg); len += 16) {
+      hmac_sha1(key, key_lens[k], msg, len, expected);
+      hmac_sha1_ctx_compute(&sha1_ctx, msg, len, actual);
+      assert_memory_equal(actual, expected, SHA1_DIGEST_LENGTH);
+      hmac_sha256(key, key_lens[k], msg, len, expected);
+      hmac_sha256_ctx_compute(&sha256_ctx, msg, len, actual);
+      assert_memory_equal(actual, expected, SHA256_DIGEST_LENGTH);
+      hmac_sha512(key, key_lens[k], msg, len, expected);
+      hmac_sha512_ctx_compute(&sha512_ctx, msg, len, actual);
+      assert_memory_equal(actual, expected, SHA512_DIGEST_LENGTH);
+    }
+  }
+
+  // the output may overwrite the message
+  hmac_sha256(key, 32, msg, 32, expected);
+  hmac_sha256_ctx_init(&sha256_ctx, key, 32);
+  hmac_sha256_ctx_compute(&sha256_ctx, msg, 32, msg);
+  assert_memory_equal(msg, expected, SHA256_DIGEST_LENGTH);
+
+  hmac_sha256_ctx_clear(&sha256_ctx);
+  for (size_t i = 0; i < sizeof(sha256_ctx.ipad); ++i)
+    assert_int_equal(sha256_ctx.ipad[i] | sha256_ctx.opad[i], 0);
+}
+
+static hmac_sha1_ctx_t sha1_ctxs[BATCH_MAX];
+static hmac_sha256_ctx_t sha256_ctxs[BATCH_MAX];
+static uint8_t keys[BATCH_MAX][20], batch_out[BATCH_MAX * SHA256_DIGEST_LENGTH];
+
+static void init_batch_keys(size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    memset(keys[i], i, sizeof(keys[i]));
+    keys[i][0] = i >> 8;
+    hmac_sha1_ctx_init(&sha1_ctxs[i], keys[i], sizeof(keys[i]));
+    hmac_sha256_ctx_init(&sha256_ctxs[i], keys[i], sizeof(keys[i]));
+  }
+}
+
+static void test_hmac_batch(void **state) {
+  (void)state;
+
+  uint8_t msg[200], expected[SHA256_DIGEST_LENGTH];
+  const size_t n = 9;
+
+  for (size_t i = 0; i < sizeof(msg); ++i)
+    msg[i] = i * 3 + 1;
+  init_batch_keys(n);
+  // the message is padded into one or two blocks, and longer messages are also accepted
+  const size_t msg_lens[] = {0, 8, 55, 56, 64, 119, 120, sizeof(msg)};
+  for (size_t m = 0; m < sizeof(msg_lens) / sizeof(msg_lens[0]); ++m) {
+    hmac_sha1_batch(sha1_ctxs, n, msg, msg_lens[m], batch_out);
+    for (size_t i = 0; i < n; ++i) {
+      hmac_sha1(keys[i], sizeof(keys[i]), msg, msg_lens[m], expected);
+      assert_memory_equal(batch_out + i * SHA1_DIGEST_LENGTH, expected, SHA1_DIGEST_LENGTH);
+    }
+    hmac_sha256_batch(sha256_ctxs, n, msg, msg_lens[m], batch_out);
+    for (size_t i = 0; i < n; ++i) {
+      hmac_sha256(keys[i], sizeof(keys[i]), msg, msg_lens[m], expected);
+      assert_memory_equal(batch_out + i * SHA256_DIGEST_LENGTH, expected, SHA256_DIGEST_LENGTH);
+    }
+  }
+}
+
+static void test_hmac_batch_max(void **state) {
+  (void)state;
+
+  // a TOTP challenge for a full batch of records
+  const uint8_t challenge[8] = {0x00, 0x00, 0x00, 0x00, 0x03, 0x5A, 0x1E, 0x21};
+  uint8_t expected[SHA256_DIGEST_LENGTH];
+
+  init_batch_keys(BATCH_MAX);
+  hmac_sha1_batch(sha1_ctxs, BATCH_MAX, challenge, sizeof(challenge), batch_out);
+  for (size_t i = 0; i < BATCH_MAX; ++i) {
+    hmac_sha1(keys[i], sizeof(keys[i]), challenge, sizeof(challenge), expected);
+    assert_memory_equal(batch_out + i * SHA1_DIGEST_LENGTH, expected, SHA1_DIGEST_LENGTH);
+  }
+  hmac_sha256_batch(sha256_ctxs, BATCH_MAX, challenge, sizeof(challenge), batch_out);
+  for (size_t i = 0; i < BATCH_MAX; ++i) {
+    hmac_sha256(keys[i], sizeof(keys[i]), challenge, sizeof(challenge), expected);
+    assert_memory_equal(batch_out + i * SHA256_DIGEST_LENGTH, expected, SHA256_DIGEST_LENGTH);
+  }
+}
+
+int main() {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_hmac_ctx),
+      cmocka_unit_test(test_hmac_batch),
+      cmocka_unit_test(test_hmac_batch_max),
+  };
+
+  int ret = cmocka_run_group_tests(tests, NULL, NULL);
+
+  return ret;
+}
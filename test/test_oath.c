@@ -11,6 +11,28 @@
 #include <lfs.h>
 #include <oath.h>
 
+static uint32_t bd_reads, bd_progs;
+
+static int counting_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+  ++bd_reads;
+  return lfs_filebd_read(c, block, off, buffer, size);
+}
+
+static int counting_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer,
+                         lfs_size_t size) {
+  ++bd_progs;
+  return lfs_filebd_prog(c, block, off, buffer, size);
+}
+
+static void oath_apdu(uint8_t ins, uint8_t p1, uint8_t *data, uint16_t lc, uint16_t le, uint16_t expected_sw) {
+  uint8_t r_buf[APDU_BUFFER_SIZE];
+  CAPDU C = {.data = data, .ins = ins, .p1 = p1, .lc = lc, .le = le};
+  RAPDU R = {.data = r_buf};
+
+  oath_process_apdu(&C, &R);
+  assert_int_equal(R.sw, expected_sw);
+}
+
 static void test_helper_resp(uint8_t *data, size_t data_len, uint8_t ins, uint16_t expected_error, uint8_t *expected_resp, size_t resp_len) {
   uint8_t c_buf[1024], r_buf[1024];
   // only tag, no length nor data
@@ -241,6 +263,72 @@ static void test_increasing_only(void **state) {
   test_helper(data, sizeof(data), OATH_INS_CALCULATE, SW_SECURITY_STATUS_NOT_SATISFIED);
 }
 
+// should be called after test_increasing_only
+static void test_increasing_power_loss(void **state) {
+  (void)state;
+
+  uint8_t data[] = {
+    OATH_TAG_NAME, 0x03, 'i', 'n', 'c',
+    OATH_TAG_CHALLENGE, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10};
+  uint8_t r_buf[128];
+  CAPDU select = {.ins = OATH_INS_SELECT, .p1 = 0x04};
+  RAPDU R = {.data = r_buf};
+
+  test_helper(data, sizeof(data), OATH_INS_CALCULATE, SW_NO_ERROR);
+
+  // what has been accepted is still there after a power loss
+  oath_install(0);
+  oath_process_apdu(&select, &R);
+  data[sizeof(data)-1] = 0x0F;
+  test_helper(data, sizeof(data), OATH_INS_CALCULATE, SW_SECURITY_STATUS_NOT_SATISFIED);
+  data[sizeof(data)-1] = 0x10;
+  test_helper(data, sizeof(data), OATH_INS_CALCULATE, SW_NO_ERROR);
+
+  // and so is it when the journal has been checkpointed in between
+  for (int i = 0x11; i != 0x11 + 400; ++i) {
+    data[sizeof(data)-2] = i >> 8;
+    data[sizeof(data)-1] = i;
+    test_helper(data, sizeof(data), OATH_INS_CALCULATE, SW_NO_ERROR);
+  }
+  oath_install(0);
+  oath_process_apdu(&select, &R);
+  data[sizeof(data)-1]--;
+  test_helper(data, sizeof(data), OATH_INS_CALCULATE, SW_SECURITY_STATUS_NOT_SATISFIED);
+  data[sizeof(data)-1]++;
+  test_helper(data, sizeof(data), OATH_INS_CALCULATE, SW_NO_ERROR);
+}
+
+// should be called after test_increasing_power_loss
+static void test_increasing_rename(void **state) {
+  (void)state;
+
+  uint8_t data[] = {
+    OATH_TAG_NAME, 0x03, 'i', 'n', 'c',
+    OATH_TAG_CHALLENGE, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00};
+  uint8_t rename[] = {OATH_TAG_NAME, 0x03, 'i', 'n', 'c', OATH_TAG_NAME, 0x03, 'c', 'n', 'i'};
+  uint8_t r_buf[128];
+  CAPDU select = {.ins = OATH_INS_SELECT, .p1 = 0x04};
+  RAPDU R = {.data = r_buf};
+
+  // the journal follows the record through renames and power cycles
+  test_helper(data, sizeof(data), OATH_INS_CALCULATE, SW_NO_ERROR);
+  test_helper(rename, sizeof(rename), OATH_INS_RENAME, SW_NO_ERROR);
+  data[2] = 'c';
+  data[4] = 'i';
+  oath_install(0);
+  oath_process_apdu(&select, &R);
+  data[sizeof(data)-2] = 0x0F;
+  test_helper(data, sizeof(data), OATH_INS_CALCULATE, SW_SECURITY_STATUS_NOT_SATISFIED);
+  data[sizeof(data)-2] = 0x10;
+  test_helper(data, sizeof(data), OATH_INS_CALCULATE, SW_NO_ERROR);
+
+  rename[2] = 'c';
+  rename[4] = 'i';
+  rename[7] = 'i';
+  rename[9] = 'c';
+  test_helper(rename, sizeof(rename), OATH_INS_RENAME, SW_NO_ERROR);
+}
+
 static void test_list(void **state) {
   (void)state;
 
@@ -386,43 +474,365 @@ static void test_put_unsupported_counter(void **state) {
   test_helper(data, sizeof(data), OATH_INS_PUT, SW_WRONG_DATA);
 }
 
-static void test_space_full(void **state) {
+// runs LIST until all the names are sent, returns the number of them
+static int list_records(void) {
+  uint8_t r_buf[APDU_BUFFER_SIZE];
+  CAPDU C = {.ins = OATH_INS_LIST, .le = 0xFF};
+  RAPDU R = {.data = r_buf};
+  int n = 0;
+
+  while (1) {
+    oath_process_apdu(&C, &R);
+    for (size_t off = 0; off < R.len; off += 2 + r_buf[off + 1])
+      n++;
+    if (R.sw != 0x61FF) break;
+    C.ins = OATH_INS_SEND_REMAINING;
+  }
+  assert_int_equal(R.sw, SW_NO_ERROR);
+  return n;
+}
+
+static void test_many_records(void **state) {
   (void)state;
 
-  uint8_t c_buf[128], r_buf[128];
-  // name: abc, algo: TOTP+SHA1, digit: 6, key: 0x00 0x01 0x02
-  uint8_t data[] = {0x71, 0x03, 'A', '-', '0', 0x73, 0x05, 0x21, 0x06, 0x00, 0x01, 0x02, 0x78, OATH_PROP_TOUCH};
-  CAPDU C = {.data = c_buf}; RAPDU R = {.data = r_buf};
-  CAPDU *capdu = &C;
-  RAPDU *rapdu = &R;
+  // name: many + a byte, algo: TOTP+SHA1, digit: 6, key: 0x00 0x01 0x02
+  uint8_t data[] = {OATH_TAG_NAME, 0x05, 'm', 'a', 'n', 'y', 0, OATH_TAG_KEY, 0x05, 0x21, 0x06, 0x00, 0x01, 0x02};
+  uint8_t calc[] = {OATH_TAG_NAME, 0x05, 'm', 'a', 'n', 'y', 0, OATH_TAG_CHALLENGE, 0x01, 0x01};
+  int n_records = list_records();
 
-  capdu->ins = OATH_INS_PUT;
-  capdu->data = data;
-  capdu->lc = sizeof(data);
+  // more than the old limit of 100 records, and more than the name index holds
+  for (int i = 0; i != 200; ++i) {
+    data[6] = i;
+    test_helper(data, sizeof(data), OATH_INS_PUT, SW_NO_ERROR);
+  }
+  assert_int_equal(list_records(), n_records + 200);
+  test_helper(data, sizeof(data), OATH_INS_PUT, SW_CONDITIONS_NOT_SATISFIED);
+  calc[6] = 199;
+  test_helper(calc, sizeof(calc), OATH_INS_CALCULATE, SW_NO_ERROR);
+
+  // deleting most of them compacts the file
+  for (int i = 0; i != 190; ++i) {
+    calc[6] = i;
+    test_helper(calc, 7, OATH_INS_DELETE, SW_NO_ERROR);
+  }
+  assert_int_equal(list_records(), n_records + 10);
+  calc[6] = 0;
+  test_helper(calc, sizeof(calc), OATH_INS_CALCULATE, SW_DATA_INVALID);
+  for (int i = 190; i != 200; ++i) {
+    calc[6] = i;
+    test_helper(calc, sizeof(calc), OATH_INS_CALCULATE, SW_NO_ERROR);
+  }
+}
 
-  // make it full
-  int record_added = 0;
-  for (int i = 0; i != 100; ++i) {
-    data[2] = ' ' + i;
-    oath_process_apdu(capdu, rapdu);
-    if (rapdu->sw != SW_NO_ERROR) break;
-    record_added++;
+static void test_list_after_compaction(void **state) {
+  (void)state;
+
+  uint8_t put[] = {OATH_TAG_NAME, 0x04, 'l', 'i', 's', 0, OATH_TAG_KEY, 0x05, 0x21, 0x06, 0x00, 0x01, 0x02};
+  uint8_t r_buf[APDU_BUFFER_SIZE];
+  CAPDU C = {.ins = OATH_INS_LIST, .le = 32};
+  RAPDU R = {.data = r_buf};
+  int n_records = list_records();
+
+  for (int i = 0; i != 30; ++i) {
+    put[5] = i;
+    test_helper(put, sizeof(put), OATH_INS_PUT, SW_NO_ERROR);
+  }
+  oath_process_apdu(&C, &R);
+  assert_int_equal(R.sw, 0x61FF);
+
+  // the deletions compact the file, so the records have moved under the LIST
+  for (int i = 0; i != 30; ++i) {
+    put[5] = i;
+    test_helper(put, 6, OATH_INS_DELETE, SW_NO_ERROR);
+  }
+  C.ins = OATH_INS_SEND_REMAINING;
+  oath_process_apdu(&C, &R);
+  assert_int_equal(R.sw, SW_CONDITIONS_NOT_SATISFIED);
+  assert_int_equal(list_records(), n_records);
+}
+
+static void test_name_index(void **state) {
+  (void)state;
+
+  uint8_t put[] = {OATH_TAG_NAME, 0x03, 'i', 'd', 'x', OATH_TAG_KEY, 0x05, 0x21, 0x06, 0x00, 0x01, 0x02};
+  uint8_t calc[] = {OATH_TAG_NAME, 0x03, 'i', 'd', 'x', OATH_TAG_CHALLENGE, 0x01, 0x01};
+  uint8_t rename[] = {OATH_TAG_NAME, 0x03, 'i', 'd', 'x', OATH_TAG_NAME, 0x03, 'n', 'e', 'w'};
+  uint8_t calc_new[] = {OATH_TAG_NAME, 0x03, 'n', 'e', 'w', OATH_TAG_CHALLENGE, 0x01, 0x01};
+  uint8_t rename_long[] = {OATH_TAG_NAME, 0x03, 'n', 'e', 'w', OATH_TAG_NAME, 0x04, 'l', 'o', 'n', 'g'};
+  uint8_t calc_long[] = {OATH_TAG_NAME, 0x04, 'l', 'o', 'n', 'g', OATH_TAG_CHALLENGE, 0x01, 0x01};
+  uint8_t rename_back[] = {OATH_TAG_NAME, 0x04, 'l', 'o', 'n', 'g', OATH_TAG_NAME, 0x03, 'n', 'e', 'w'};
+  uint8_t r_buf[128];
+  CAPDU select = {.ins = OATH_INS_SELECT, .p1 = 0x04};
+  RAPDU R = {.data = r_buf};
+
+  test_helper(put, sizeof(put), OATH_INS_PUT, SW_NO_ERROR);
+  test_helper(put, sizeof(put), OATH_INS_PUT, SW_CONDITIONS_NOT_SATISFIED);
+  test_helper(calc, sizeof(calc), OATH_INS_CALCULATE, SW_NO_ERROR);
+
+  // the index follows renames and deletions
+  test_helper(rename, sizeof(rename), OATH_INS_RENAME, SW_NO_ERROR);
+  test_helper(calc, sizeof(calc), OATH_INS_CALCULATE, SW_DATA_INVALID);
+  test_helper(calc_new, sizeof(calc_new), OATH_INS_CALCULATE, SW_NO_ERROR);
+  // a name of another length rebuilds the file with the renamed record in place of the old one
+  int n_records = list_records();
+  test_helper(rename_long, sizeof(rename_long), OATH_INS_RENAME, SW_NO_ERROR);
+  assert_int_equal(list_records(), n_records);
+  test_helper(calc_new, sizeof(calc_new), OATH_INS_CALCULATE, SW_DATA_INVALID);
+  test_helper(calc_long, sizeof(calc_long), OATH_INS_CALCULATE, SW_NO_ERROR);
+  test_helper(rename_back, sizeof(rename_back), OATH_INS_RENAME, SW_NO_ERROR);
+  test_helper(calc_new, 5, OATH_INS_DELETE, SW_NO_ERROR);
+  test_helper(calc_new, sizeof(calc_new), OATH_INS_CALCULATE, SW_DATA_INVALID);
+
+  // the freed slot is reused, and the index rebuilt after a power cycle agrees
+  test_helper(put, sizeof(put), OATH_INS_PUT, SW_NO_ERROR);
+  oath_install(0);
+  oath_process_apdu(&select, &R);
+  assert_int_equal(R.sw, SW_NO_ERROR);
+  test_helper(put, sizeof(put), OATH_INS_PUT, SW_CONDITIONS_NOT_SATISFIED);
+  test_helper(calc, sizeof(calc), OATH_INS_CALCULATE, SW_NO_ERROR);
+  test_helper(calc, 5, OATH_INS_DELETE, SW_NO_ERROR);
+
+  // and so does the one after a reset
+  oath_install(1);
+  oath_process_apdu(&select, &R);
+  assert_int_equal(R.sw, SW_NO_ERROR);
+  test_helper(calc, sizeof(calc), OATH_INS_CALCULATE, SW_DATA_INVALID);
+  test_helper(put, sizeof(put), OATH_INS_PUT, SW_NO_ERROR);
+  test_helper(calc, sizeof(calc), OATH_INS_CALCULATE, SW_NO_ERROR);
+}
+
+static void test_migration(void **state) {
+  (void)state;
+
+  // records of the fixed-size format: a TOTP one, an empty slot and the RFC 4226 example as the default
+  OATH_RECORD records[3];
+  memset(records, 0, sizeof(records));
+  records[0].name_len = 4;
+  memcpy(records[0].name, "totp", 4);
+  records[0].key_len = 5;
+  memcpy(records[0].key, (uint8_t[]){0x21, 0x06, 0x00, 0x01, 0x02}, 5);
+  records[2].name_len = 4;
+  memcpy(records[2].name, "hotp", 4);
+  records[2].key_len = 22;
+  memcpy(records[2].key, (uint8_t[]){0x11, 0x06}, 2);
+  memcpy(records[2].key + 2, "12345678901234567890", 20);
+  uint32_t default_offset = 2 * sizeof(OATH_RECORD);
+  uint8_t calc[] = {OATH_TAG_NAME, 0x04, 't', 'o', 't', 'p', OATH_TAG_CHALLENGE, 0x01, 0x01};
+  uint8_t r_buf[128];
+  CAPDU select = {.ins = OATH_INS_SELECT, .p1 = 0x04};
+  RAPDU R = {.data = r_buf};
+  char buf[9];
+
+  oath_install(1);
+  assert_int_equal(remove_file("oath_rec"), 0);
+  assert_int_equal(write_file("oath", records, 0, sizeof(records), 1), 0);
+  assert_int_equal(write_attr("oath", ATTR_DEFAULT_RECORD, &default_offset, sizeof(default_offset)), 0);
+
+  oath_install(0);
+  assert_int_equal(get_file_size("oath"), 0);
+  oath_process_apdu(&select, &R);
+  assert_int_equal(R.sw, SW_NO_ERROR);
+  assert_int_equal(list_records(), 2);
+  test_helper(calc, sizeof(calc), OATH_INS_CALCULATE, SW_NO_ERROR);
+  assert_int_equal(oath_process_one_touch(buf, sizeof(buf)), 0);
+  assert_string_equal(buf, "287082");
+
+  // the migrated records are kept on the next start
+  oath_install(0);
+  oath_process_apdu(&select, &R);
+  assert_int_equal(list_records(), 2);
+  assert_int_equal(oath_process_one_touch(buf, sizeof(buf)), 0);
+  assert_string_equal(buf, "359152");
+}
+
+// runs CALCULATE ALL until all the responses are sent, returns the length of them
+static size_t calculate_all_records(uint8_t *out) {
+  uint8_t r_buf[APDU_BUFFER_SIZE], data[] = {OATH_TAG_CHALLENGE, 0x08, 0x00, 0x00, 0x00, 0x00, 0x03, 0x5A, 0x1E, 0x21};
+  CAPDU C = {.data = data, .ins = OATH_INS_SELECT, .lc = sizeof(data), .le = 0xFF};
+  RAPDU R = {.data = r_buf};
+  size_t len = 0;
+
+  while (1) {
+    oath_process_apdu(&C, &R);
+    memcpy(out + len, r_buf, R.len);
+    len += R.len;
+    if (R.sw != 0x61FF) break;
+    C.ins = OATH_INS_SEND_REMAINING;
   }
-  assert_int_equal(rapdu->sw, SW_NOT_ENOUGH_SPACE);
+  assert_int_equal(R.sw, SW_NO_ERROR);
+  return len;
+}
+
+// runs CALCULATE ALL through process_apdu with the given Le, returns the number of exchanges
+static int calculate_all_exchanges(uint32_t le, uint8_t *out, size_t *out_len) {
+  uint8_t c_buf[16], r_buf[APDU_BUFFER_SIZE];
+  uint8_t data[] = {OATH_TAG_CHALLENGE, 0x08, 0x00, 0x00, 0x00, 0x00, 0x03, 0x5A, 0x1E, 0x21};
+  CAPDU C = {.data = c_buf, .ins = OATH_INS_SELECT, .lc = sizeof(data), .le = le};
+  RAPDU R = {.data = r_buf};
+  int exchanges = 0;
 
   memcpy(c_buf, data, sizeof(data));
-  c_buf[2] = ' '; // delete the first one we put
-  test_helper(c_buf, sizeof(data), OATH_INS_DELETE, SW_NO_ERROR);
+  *out_len = 0;
+  while (1) {
+    process_apdu(&C, &R);
+    exchanges++;
+    memcpy(out + *out_len, R.data, R.len);
+    *out_len += R.len;
+    if ((R.sw & 0xFF00) != 0x6100) break;
+    C.ins = OATH_INS_SEND_REMAINING;
+    C.lc = 0;
+  }
+  assert_int_equal(R.sw, SW_NO_ERROR);
+  return exchanges;
+}
 
-  // then try again
-  oath_process_apdu(capdu, rapdu);
-  assert_int_equal(rapdu->sw, SW_NO_ERROR);
+static void test_calc_all_extended(void **state) {
+  (void)state;
+
+  static uint8_t direct_resp[100 * 20], short_resp[100 * 20], extended_resp[100 * 20];
+  uint8_t aid[] = {0xA0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01}, c_buf[32], r_buf[APDU_BUFFER_SIZE];
+  CAPDU C = {.data = c_buf, .ins = OATH_INS_SELECT, .p1 = 0x04, .lc = sizeof(aid), .le = 0x100};
+  RAPDU R = {.data = r_buf};
+  size_t short_len, extended_len;
+
+  oath_install(1);
+  memcpy(c_buf, aid, sizeof(aid));
+  process_apdu(&C, &R);
+  assert_int_equal(R.sw, SW_NO_ERROR);
+  for (int i = 0; i < 100; ++i) {
+    uint8_t data[] = {OATH_TAG_NAME, 0x08, 'c', 'a', 'l', 'c', '-', 'x', '0' + i / 10, '0' + i % 10,
+                      OATH_TAG_KEY, 0x05, 0x21, 0x06, 0x00, 0x01, i};
+    test_helper(data, sizeof(data), OATH_INS_PUT, SW_NO_ERROR);
+  }
+
+  size_t direct_len = calculate_all_records(direct_resp);
+  int short_exchanges = calculate_all_exchanges(0x100, short_resp, &short_len);
+  int extended_exchanges = calculate_all_exchanges(0x10000, extended_resp, &extended_len);
+  // every Le gives the same codes, and an extended one fills the whole buffer each time
+  assert_int_equal(short_len, direct_len);
+  assert_memory_equal(short_resp, direct_resp, direct_len);
+  assert_int_equal(extended_len, direct_len);
+  assert_memory_equal(extended_resp, direct_resp, direct_len);
+  assert_int_equal(extended_exchanges, (direct_len + APDU_BUFFER_SIZE - 1) / APDU_BUFFER_SIZE);
+  assert_true(short_exchanges > extended_exchanges);
+}
+
+static void test_calc_all_cached(void **state) {
+  (void)state;
+
+  static uint8_t cold_resp[100 * 80], warm_resp[100 * 80];
+  uint8_t c_buf[128], r_buf[128];
+  CAPDU C = {.data = c_buf, .ins = OATH_INS_SELECT, .p1 = 0x04};
+  RAPDU R = {.data = r_buf};
+  const uint8_t algs[] = {0x21, 0x23}; // TOTP with SHA-1 and SHA-512
+
+  for (int a = 0; a < 2; ++a) {
+    // name: bench-00, key: 20 bytes for SHA-1, 64 bytes for SHA-512
+    uint8_t key_len = a == 0 ? 20 : 64;
+    oath_install(1);
+    oath_process_apdu(&C, &R);
+    for (int i = 0; i < 100; ++i) {
+      uint8_t data[] = {OATH_TAG_NAME, 0x08, 'b', 'e', 'n', 'c', 'h', '-', '0' + i / 10, '0' + i % 10,
+                        OATH_TAG_KEY, 2 + key_len, algs[a], 0x06};
+      memcpy(c_buf, data, sizeof(data));
+      memset(c_buf + sizeof(data), i, key_len);
+      CAPDU P = {.data = c_buf, .ins = OATH_INS_PUT, .lc = sizeof(data) + key_len};
+      oath_process_apdu(&P, &R);
+      assert_int_equal(R.sw, SW_NO_ERROR);
+    }
+
+    size_t cold_len = calculate_all_records(cold_resp);
+    size_t warm_len = calculate_all_records(warm_resp);
+    // the cached contexts give the same codes
+    assert_int_equal(warm_len, cold_len);
+    assert_memory_equal(warm_resp, cold_resp, cold_len);
+  }
+}
+
+static uint32_t calc_all_reads(int rounds) {
+  uint8_t data[] = {OATH_TAG_CHALLENGE, 0x08, 0x00, 0x00, 0x00, 0x00, 0x03, 0x21, 0x06, 0x00};
+
+  bd_reads = 0;
+  for (int i = 0; i < rounds; ++i)
+    oath_apdu(OATH_INS_SELECT, 0x00, data, sizeof(data), APDU_BUFFER_SIZE, SW_NO_ERROR);
+  return bd_reads / rounds;
+}
+
+static void test_calc_all_reads(void **state) {
+  (void)state;
+
+  uint8_t data[] = {OATH_TAG_NAME, 0x04, 'b', 'e', 'n', '0', OATH_TAG_KEY, 0x05, 0x21, 0x06, 0x00, 0x01, 0x02};
+  oath_install(1);
+  oath_apdu(OATH_INS_SELECT, 0x04, NULL, 0, 0, SW_NO_ERROR);
+  for (int i = 0; i < 20; ++i) {
+    data[5] = 'A' + i;
+    oath_apdu(OATH_INS_PUT, 0x00, data, sizeof(data), 0, SW_NO_ERROR);
+  }
+
+  fs_set_cache_enabled(0);
+  uint32_t uncached = calc_all_reads(5);
+  fs_set_cache_enabled(1);
+  calc_all_reads(1);
+  assert_true(calc_all_reads(5) < uncached);
+}
+
+static void test_lookup_reads(void **state) {
+  (void)state;
+
+  uint8_t put[] = {OATH_TAG_NAME, 0x04, 'b', 'e', 'n', '0', OATH_TAG_KEY, 0x05, 0x21, 0x06, 0x00, 0x01, 0x02};
+  uint8_t data[] = {OATH_TAG_NAME, 0x04, 'b', 'e', 'n', 'A' + 19,
+                    OATH_TAG_CHALLENGE, 0x08, 0x00, 0x00, 0x00, 0x00, 0x03, 0x21, 0x06, 0x01};
+
+  oath_install(1);
+  oath_apdu(OATH_INS_SELECT, 0x04, NULL, 0, 0, SW_NO_ERROR);
+  for (int i = 0; i < 20; ++i) {
+    put[5] = 'A' + i;
+    oath_apdu(OATH_INS_PUT, 0x00, put, sizeof(put), 0, SW_NO_ERROR);
+  }
 
-  // leave some space for further tests
-  for (int i = 1; i != 20; ++i) {
-    c_buf[2] = ' ' + i;
-    test_helper(c_buf, sizeof(data), OATH_INS_DELETE, SW_NO_ERROR);
+  // with the fs caches off, the name index alone tells that a record is missing
+  fs_set_cache_enabled(0);
+  oath_apdu(OATH_INS_CALCULATE, 0x00, data, sizeof(data), APDU_BUFFER_SIZE, SW_NO_ERROR);
+  data[5] = 'z';
+  bd_reads = 0;
+  oath_apdu(OATH_INS_CALCULATE, 0x00, data, sizeof(data), APDU_BUFFER_SIZE, SW_DATA_INVALID);
+  fs_set_cache_enabled(1);
+  assert_int_equal(bd_reads, 0);
+}
+
+static void test_journal_progs(void **state) {
+  (void)state;
+
+  uint8_t data[] = {OATH_TAG_NAME, 0x04, 'i', 'n', 'c', '0', OATH_TAG_KEY, 0x05, 0x21, 0x06, 0x00, 0x01, 0x02,
+                    OATH_TAG_PROPERTY, OATH_PROP_INC};
+  uint8_t challenge[] = {OATH_TAG_CHALLENGE, 0x08, 0x00, 0x00, 0x00, 0x00, 0x03, 0x21, 0x06, 0x00};
+  uint8_t record[40] = {0};
+  const int rounds = 10;
+
+  oath_install(1);
+  oath_apdu(OATH_INS_SELECT, 0x04, NULL, 0, 0, SW_NO_ERROR);
+  for (int i = 0; i < 20; ++i) {
+    data[5] = 'A' + i;
+    oath_apdu(OATH_INS_PUT, 0x00, data, sizeof(data), 0, SW_NO_ERROR);
+  }
+  bd_progs = 0;
+  for (int i = 1; i <= rounds; ++i) {
+    challenge[sizeof(challenge) - 1] = i; // a new time step every time
+    oath_apdu(OATH_INS_SELECT, 0x00, challenge, sizeof(challenge), APDU_BUFFER_SIZE, SW_NO_ERROR);
   }
+  uint32_t journal = bd_progs;
+
+  // what writing the challenge into every record would cost
+  for (int i = 0; i < 20; ++i)
+    assert_int_equal(write_file("oath-inplace", record, i * sizeof(record), sizeof(record), 0), 0);
+  bd_progs = 0;
+  for (int i = 1; i <= rounds; ++i)
+    for (int j = 0; j < 20; ++j)
+      assert_int_equal(write_file("oath-inplace", challenge + 2, j * sizeof(record) + 4, 8, 0), 0);
+  uint32_t in_place = bd_progs;
+  assert_int_equal(remove_file("oath-inplace"), 0);
+
+  assert_true(journal < in_place);
 }
 
 int main() {
@@ -430,8 +840,8 @@ int main() {
   lfs_filebd_t bd;
   memset(&cfg, 0, sizeof(cfg));
   cfg.context = &bd;
-  cfg.read = &lfs_filebd_read;
-  cfg.prog = &lfs_filebd_prog;
+  cfg.read = &counting_read;
+  cfg.prog = &counting_prog;
   cfg.erase = &lfs_filebd_erase;
   cfg.sync = &lfs_filebd_sync;
   cfg.read_size = 16;
@@ -456,11 +866,21 @@ int main() {
       cmocka_unit_test(test_put_unsupported_counter),
       cmocka_unit_test(test_calc),
       cmocka_unit_test(test_increasing_only),
+      cmocka_unit_test(test_increasing_power_loss),
+      cmocka_unit_test(test_increasing_rename),
       cmocka_unit_test(test_list),
       cmocka_unit_test(test_calc_all),
       cmocka_unit_test(test_hotp_touch),
-      cmocka_unit_test(test_space_full),
+      cmocka_unit_test(test_many_records),
+      cmocka_unit_test(test_list_after_compaction),
       cmocka_unit_test(test_regression_fuzz),
+      cmocka_unit_test(test_name_index),
+      cmocka_unit_test(test_migration),
+      cmocka_unit_test(test_calc_all_extended),
+      cmocka_unit_test(test_calc_all_cached),
+      cmocka_unit_test(test_calc_all_reads),
+      cmocka_unit_test(test_lookup_reads),
+      cmocka_unit_test(test_journal_progs),
   };
 
   int ret = cmocka_run_group_tests(tests, NULL, NULL);
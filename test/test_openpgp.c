@@ -11,6 +11,13 @@
 #include <fs.h>
 #include <lfs.h>
 
+static uint32_t bd_reads;
+
+static int counting_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+  ++bd_reads;
+  return lfs_filebd_read(c, block, off, buffer, size);
+}
+
 static void test_verify(void **state) {
   (void)state;
 
@@ -261,12 +268,35 @@ static void test_special(void **state) {
   print_hex(RDATA, LL);
 }
 
+static void test_get_data_reads(void **state) {
+  (void)state;
+
+  uint8_t r_buf[APDU_BUFFER_SIZE];
+  CAPDU C = {.ins = OPENPGP_INS_GET_DATA, .p2 = TAG_APPLICATION_RELATED_DATA, .le = APDU_BUFFER_SIZE};
+  RAPDU R = {.data = r_buf};
+
+  openpgp_install(1);
+  fs_set_cache_enabled(0);
+  bd_reads = 0;
+  openpgp_process_apdu(&C, &R);
+  assert_int_equal(R.sw, SW_NO_ERROR);
+  uint32_t uncached = bd_reads;
+
+  // the attributes gathered by GET DATA 6E are served from the attr cache once warm
+  fs_set_cache_enabled(1);
+  openpgp_process_apdu(&C, &R);
+  bd_reads = 0;
+  openpgp_process_apdu(&C, &R);
+  assert_int_equal(R.sw, SW_NO_ERROR);
+  assert_true(bd_reads < uncached);
+}
+
 int main() {
   struct lfs_config cfg;
   lfs_filebd_t bd;
   memset(&cfg, 0, sizeof(cfg));
   cfg.context = &bd;
-  cfg.read = &lfs_filebd_read;
+  cfg.read = &counting_read;
   cfg.prog = &lfs_filebd_prog;
   cfg.erase = &lfs_filebd_erase;
   cfg.sync = &lfs_filebd_sync;
@@ -291,6 +321,7 @@ int main() {
       cmocka_unit_test(test_import_key),
       cmocka_unit_test(test_generate_key),
       cmocka_unit_test(test_special),
+      cmocka_unit_test(test_get_data_reads),
   };
 
   int ret = cmocka_run_group_tests(tests, NULL, NULL);
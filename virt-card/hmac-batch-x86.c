@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: Apache-2.0
+// Batched HMAC for x86-64 hosts using the SHA extensions, overriding the generic loop in src/hmac-ctx.c.
+#if defined(__x86_64__)
+
+#include <cpuid.h>
+#include <hmac-ctx.h>
+#include <immintrin.h>
+#include <memzero.h>
+#include <string.h>
+
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1")))
+// the padded message that follows the ipad block must fit in this buffer
+#define MAX_TAIL_BLOCKS 2
+
+static const uint32_t sha1_iv[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+static const uint32_t sha256_iv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                      0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+static const uint32_t sha256_k[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2};
+
+static int has_sha_ni(void) {
+  static int cached = -1;
+  if (cached < 0) {
+    unsigned int eax, ebx, ecx, edx;
+    cached = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA) &&
+             __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1);
+  }
+  return cached;
+}
+
+SHA_NI_TARGET static void sha1_blocks(uint32_t state[5], const uint8_t *data, size_t n) {
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090A0B0C0D0E0FULL);
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+  __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+  for (; n > 0; --n, data += 64) {
+    __m128i abcd_save = abcd, e0_save = e0, prev = abcd, e, w[4];
+    for (int i = 0; i < 4; ++i)
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+    for (int j = 0; j < 20; ++j) {
+      // w[j % 4] holds W[j - 4] here, and is replaced by W[j]
+      if (j >= 4)
+        w[j % 4] = _mm_sha1msg2_epu32(
+            _mm_xor_si128(_mm_sha1msg1_epu32(w[j % 4], w[(j + 1) % 4]), w[(j + 2) % 4]), w[(j + 3) % 4]);
+      e = j == 0 ? _mm_add_epi32(e0, w[0]) : _mm_sha1nexte_epu32(prev, w[j % 4]);
+      prev = abcd;
+      switch (j / 5) {
+      case 0:
+        abcd = _mm_sha1rnds4_epu32(abcd, e, 0);
+        break;
+      case 1:
+        abcd = _mm_sha1rnds4_epu32(abcd, e, 1);
+        break;
+      case 2:
+        abcd = _mm_sha1rnds4_epu32(abcd, e, 2);
+        break;
+      default:
+        abcd = _mm_sha1rnds4_epu32(abcd, e, 3);
+        break;
+      }
+    }
+    e0 = _mm_sha1nexte_epu32(prev, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = _mm_extract_epi32(e0, 3);
+}
+
+SHA_NI_TARGET static void sha256_blocks(uint32_t state[8], const uint8_t *data, size_t n) {
+  const __m128i mask = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1); // CDAB
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B); // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);                                      // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);                                           // CDGH
+
+  for (; n > 0; --n, data += 64) {
+    __m128i abef_save = state0, cdgh_save = state1, msg, w[4];
+    for (int i = 0; i < 4; ++i)
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+    for (int j = 0; j < 16; ++j) {
+      // w[j % 4] holds W[4j - 16 .. 4j - 13] here, and is replaced by W[4j .. 4j + 3]
+      if (j >= 4)
+        w[j % 4] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w[j % 4], w[(j + 1) % 4]),
+                                                      _mm_alignr_epi8(w[(j + 3) % 4], w[(j + 2) % 4], 4)),
+                                        w[(j + 3) % 4]);
+      msg = _mm_add_epi32(w[j % 4], _mm_loadu_si128((const __m128i *)&sha256_k[4 * j]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+    }
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);                                         // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);                                      // DCHG
+  _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));    // DCBA
+  _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));       // HGFE
+}
+
+// appends 0x80, zeros and the bit length of prefix_len + len to the len bytes in out, returns the number of blocks
+static size_t pad_message(uint8_t *out, size_t len, size_t prefix_len) {
+  size_t blocks = (len + 9 + 63) / 64;
+  uint64_t bits = (uint64_t)(prefix_len + len) * 8;
+  memset(out + len, 0, blocks * 64 - len);
+  out[len] = 0x80;
+  for (int i = 0; i < 8; ++i)
+    out[blocks * 64 - 1 - i] = bits >> (8 * i);
+  return blocks;
+}
+
+static void store_be32(uint8_t *out, const uint32_t *state, size_t words) {
+  for (size_t i = 0; i < words; ++i) {
+    out[4 * i] = state[i] >> 24;
+    out[4 * i + 1] = state[i] >> 16;
+    out[4 * i + 2] = state[i] >> 8;
+    out[4 * i + 3] = state[i];
+  }
+}
+
+void hmac_sha1_batch(const hmac_sha1_ctx_t *ctxs, size_t n, const uint8_t *msg, size_t msg_len, uint8_t *hmacs) {
+  uint8_t tail[MAX_TAIL_BLOCKS * 64], outer[64];
+  uint32_t state[5];
+
+  if (!has_sha_ni() || msg_len + 9 > sizeof(tail)) {
+    for (size_t i = 0; i < n; ++i)
+      hmac_sha1_ctx_compute(&ctxs[i], msg, msg_len, hmacs + i * SHA1_DIGEST_LENGTH);
+    return;
+  }
+  // the padded message is shared by every key, and so is the padding of the outer block
+  memcpy(tail, msg, msg_len);
+  size_t tail_blocks = pad_message(tail, msg_len, SHA1_BLOCK_SIZE);
+  pad_message(outer, SHA1_DIGEST_LENGTH, SHA1_BLOCK_SIZE);
+  for (size_t i = 0; i < n; ++i) {
+    memcpy(state, sha1_iv, sizeof(state));
+    sha1_blocks(state, ctxs[i].ipad, 1);
+    sha1_blocks(state, tail, tail_blocks);
+    store_be32(outer, state, 5);
+    memcpy(state, sha1_iv, sizeof(state));
+    sha1_blocks(state, ctxs[i].opad, 1);
+    sha1_blocks(state, outer, 1);
+    store_be32(hmacs + i * SHA1_DIGEST_LENGTH, state, 5);
+  }
+  memzero(outer, sizeof(outer));
+  memzero(state, sizeof(state));
+}
+
+void hmac_sha256_batch(const hmac_sha256_ctx_t *ctxs, size_t n, const uint8_t *msg, size_t msg_len,
+                       uint8_t *hmacs) {
+  uint8_t tail[MAX_TAIL_BLOCKS * 64], outer[64];
+  uint32_t state[8];
+
+  if (!has_sha_ni() || msg_len + 9 > sizeof(tail)) {
+    for (size_t i = 0; i < n; ++i)
+      hmac_sha256_ctx_compute(&ctxs[i], msg, msg_len, hmacs + i * SHA256_DIGEST_LENGTH);
+    return;
+  }
+  memcpy(tail, msg, msg_len);
+  size_t tail_blocks = pad_message(tail, msg_len, SHA256_BLOCK_SIZE);
+  pad_message(outer, SHA256_DIGEST_LENGTH, SHA256_BLOCK_SIZE);
+  for (size_t i = 0; i < n; ++i) {
+    memcpy(state, sha256_iv, sizeof(state));
+    sha256_blocks(state, ctxs[i].ipad, 1);
+    sha256_blocks(state, tail, tail_blocks);
+    store_be32(outer, state, 8);
+    memcpy(state, sha256_iv, sizeof(state));
+    sha256_blocks(state, ctxs[i].opad, 1);
+    sha256_blocks(state, outer, 1);
+    store_be32(hmacs + i * SHA256_DIGEST_LENGTH, state, 8);
+  }
+  memzero(outer, sizeof(outer));
+  memzero(state, sizeof(state));
+}
+
+#endif
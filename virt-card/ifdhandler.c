@@ -137,7 +137,7 @@ RESPONSECODE IFDHTransmitToICC ( DWORD Lun, SCARD_IO_HEADER SendPci,
             *RxLength = 0;
             return IFD_ERROR_INSUFFICIENT_BUFFER;
         }
-        memcpy(RxBuffer, bulkin_data[Lun].abData, bulkin_data[Lun].dwLength);
+        memcpy(RxBuffer, CCID_XfrBlockResponse(), bulkin_data[Lun].dwLength);
         *RxLength = bulkin_data[Lun].dwLength;
     }
 